@@ -6,181 +6,157 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <jansson_config.h>   /* for JSON_INLINE */
-#include "jansson_private.h"  /* for container_of() */
+#include "jansson_private.h"  /* for jsonp_malloc() */
 #include "hashtable.h"
 
-typedef struct hashtable_list list_t;
 typedef struct hashtable_pair pair_t;
-typedef struct hashtable_bucket bucket_t;
 
-#define list_to_pair(list_)  container_of(list_, pair_t, list)
+/* size of pairs[] the first time something is added */
+#define INITIAL_CAPACITY  4
 
-static JSON_INLINE void list_init(list_t *list)
+static void *hashtable_alloc(hashtable_t *hashtable, size_t size)
 {
-    list->next = list;
-    list->prev = list;
+    if(hashtable->arena)
+        return jsonp_arena_alloc(hashtable->arena, size);
+    return jsonp_malloc(size);
 }
 
-static JSON_INLINE void list_insert(list_t *list, list_t *node)
+static void hashtable_release(hashtable_t *hashtable, void *ptr)
 {
-    node->next = list;
-    node->prev = list->prev;
-    list->prev->next = node;
-    list->prev = node;
+    if(!hashtable->arena)
+        jsonp_free(ptr);
 }
 
-static JSON_INLINE void list_remove(list_t *list)
+static void index_insert(hashtable_t *hashtable, size_t hash, size_t position)
 {
-    list->prev->next = list->next;
-    list->next->prev = list->prev;
+    size_t i = hash & hashtable->index_mask;
+
+    while(hashtable->index[i])
+        i = (i + 1) & hashtable->index_mask;
+
+    hashtable->index[i] = position + 1;
 }
 
-static JSON_INLINE int bucket_is_empty(hashtable_t *hashtable, bucket_t *bucket)
+/* Keys are compared by address first, so that looking up a key with
+   the very pointer that was stored (e.g. an interned object key) costs
+   no string comparison. */
+static JSON_INLINE int key_matches(hashtable_t *hashtable, const pair_t *pair,
+                                   const void *key, size_t hash)
 {
-    return bucket->first == &hashtable->list && bucket->first == bucket->last;
+    return pair->hash == hash && pair->key &&
+           (pair->key == key || hashtable->cmp_keys(pair->key, key));
 }
 
-static void insert_to_bucket(hashtable_t *hashtable, bucket_t *bucket,
-                             list_t *list)
+/* (Re)builds the index for the current capacity, or drops it if the
+   table is small enough to be searched linearly. */
+static int index_build(hashtable_t *hashtable)
 {
-    if(bucket_is_empty(hashtable, bucket))
-    {
-        list_insert(&hashtable->list, list);
-        bucket->first = bucket->last = list;
-    }
-    else
-    {
-        list_insert(bucket->first, list);
-        bucket->first = list;
-    }
-}
+    size_t i, index_size;
 
-static size_t primes[] = {
-    5, 13, 23, 53, 97, 193, 389, 769, 1543, 3079, 6151, 12289, 24593,
-    49157, 98317, 196613, 393241, 786433, 1572869, 3145739, 6291469,
-    12582917, 25165843, 50331653, 100663319, 201326611, 402653189,
-    805306457, 1610612741
-};
-static const size_t num_primes = sizeof(primes) / sizeof(size_t);
+    hashtable_release(hashtable, hashtable->index);
+    hashtable->index = NULL;
+    hashtable->index_mask = 0;
 
-static JSON_INLINE size_t num_buckets(hashtable_t *hashtable)
-{
-    return primes[hashtable->num_buckets];
-}
+    if(hashtable->capacity <= HASHTABLE_LINEAR_MAX)
+        return 0;
 
+    /* keep the load factor of the index at or below 1/2 */
+    index_size = 1;
+    while(index_size < 2 * hashtable->capacity)
+        index_size <<= 1;
 
-static pair_t *hashtable_find_pair(hashtable_t *hashtable, bucket_t *bucket,
+    hashtable->index = (size_t *) hashtable_alloc(hashtable, index_size * sizeof(size_t));
+    if(!hashtable->index)
+        return -1;
+    memset(hashtable->index, 0, index_size * sizeof(size_t));
+    hashtable->index_mask = index_size - 1;
+
+    for(i = 0; i < hashtable->used; i++)
+        index_insert(hashtable, hashtable->pairs[i].hash, i);
+
+    return 0;
+}
+
+static pair_t *hashtable_find_pair(hashtable_t *hashtable,
                                    const void *key, size_t hash)
 {
-    list_t *list;
     pair_t *pair;
+    size_t i, position;
 
-    if(bucket_is_empty(hashtable, bucket))
+    if(!hashtable->index)
+    {
+        pair_t *end = hashtable->pairs + hashtable->used;
+        for(pair = hashtable->pairs; pair < end; pair++)
+        {
+            if(key_matches(hashtable, pair, key, hash))
+                return pair;
+        }
         return NULL;
+    }
 
-    list = bucket->first;
-    while(1)
+    i = hash & hashtable->index_mask;
+    while((position = hashtable->index[i]) != 0)
     {
-        pair = list_to_pair(list);
-        if(pair->hash == hash && hashtable->cmp_keys(pair->key, key))
+        pair = &hashtable->pairs[position - 1];
+        if(key_matches(hashtable, pair, key, hash))
             return pair;
 
-        if(list == bucket->last)
-            break;
-
-        list = list->next;
+        i = (i + 1) & hashtable->index_mask;
     }
 
     return NULL;
 }
 
-/* returns 0 on success, -1 if key was not found */
-static int hashtable_do_del(hashtable_t *hashtable,
-                            const void *key, size_t hash)
-{
-    pair_t *pair;
-    bucket_t *bucket;
-    size_t index;
-
-    index = hash % num_buckets(hashtable);
-    bucket = &hashtable->buckets[index];
-
-    pair = hashtable_find_pair(hashtable, bucket, key, hash);
-    if(!pair)
-        return -1;
-
-    if(&pair->list == bucket->first && &pair->list == bucket->last)
-        bucket->first = bucket->last = &hashtable->list;
-
-    else if(&pair->list == bucket->first)
-        bucket->first = pair->list.next;
-
-    else if(&pair->list == bucket->last)
-        bucket->last = pair->list.prev;
-
-    list_remove(&pair->list);
-
-    if(hashtable->free_key)
-        hashtable->free_key(pair->key);
-    if(hashtable->free_value)
-        hashtable->free_value(pair->value);
-
-    jsonp_free(pair);
-    hashtable->size--;
-
-    return 0;
-}
-
 static void hashtable_do_clear(hashtable_t *hashtable)
 {
-    list_t *list, *next;
+    size_t i;
     pair_t *pair;
 
-    for(list = hashtable->list.next; list != &hashtable->list; list = next)
+    for(i = 0; i < hashtable->used; i++)
     {
-        next = list->next;
-        pair = list_to_pair(list);
+        pair = &hashtable->pairs[i];
+        if(!pair->key)
+            continue;
         if(hashtable->free_key)
             hashtable->free_key(pair->key);
         if(hashtable->free_value)
             hashtable->free_value(pair->value);
-        jsonp_free(pair);
     }
 }
 
+/* Makes room for one more pair: squeezes out deleted pairs if they
+   take up at least half of the slots, and doubles the capacity
+   otherwise. */
 static int hashtable_do_rehash(hashtable_t *hashtable)
 {
-    list_t *list, *next;
-    pair_t *pair;
-    size_t i, index, new_size;
-
-    jsonp_free(hashtable->buckets);
-
-    hashtable->num_buckets++;
-    new_size = num_buckets(hashtable);
+    pair_t *pairs;
+    size_t i, j, capacity;
 
-    hashtable->buckets = (struct hashtable_bucket *) jsonp_malloc(new_size * sizeof(bucket_t));
-    if(!hashtable->buckets)
-        return -1;
-
-    for(i = 0; i < num_buckets(hashtable); i++)
+    if(hashtable->size <= hashtable->used / 2 && hashtable->used)
     {
-        hashtable->buckets[i].first = hashtable->buckets[i].last =
-            &hashtable->list;
+        for(i = j = 0; i < hashtable->used; i++)
+        {
+            if(hashtable->pairs[i].key)
+                hashtable->pairs[j++] = hashtable->pairs[i];
+        }
+        hashtable->used = j;
+        return index_build(hashtable);
     }
 
-    list = hashtable->list.next;
-    list_init(&hashtable->list);
+    capacity = hashtable->capacity ? 2 * hashtable->capacity : INITIAL_CAPACITY;
+    pairs = (pair_t *) hashtable_alloc(hashtable, capacity * sizeof(pair_t));
+    if(!pairs)
+        return -1;
 
-    for(; list != &hashtable->list; list = next) {
-        next = list->next;
-        pair = list_to_pair(list);
-        index = pair->hash % new_size;
-        insert_to_bucket(hashtable, &hashtable->buckets[index], &pair->list);
-    }
+    if(hashtable->used)
+        memcpy(pairs, hashtable->pairs, hashtable->used * sizeof(pair_t));
+    hashtable_release(hashtable, hashtable->pairs);
+    hashtable->pairs = pairs;
+    hashtable->capacity = capacity;
 
-    return 0;
+    return index_build(hashtable);
 }
 
 
@@ -191,7 +167,7 @@ hashtable_t *hashtable_create(key_hash_fn hash_key, key_cmp_fn cmp_keys,
     if(!hashtable)
         return NULL;
 
-    if(hashtable_init(hashtable, hash_key, cmp_keys, free_key, free_value))
+    if(hashtable_init(hashtable, NULL, hash_key, cmp_keys, free_key, free_value))
     {
         jsonp_free(hashtable);
         return NULL;
@@ -206,55 +182,45 @@ void hashtable_destroy(hashtable_t *hashtable)
     jsonp_free(hashtable);
 }
 
-int hashtable_init(hashtable_t *hashtable,
+int hashtable_init(hashtable_t *hashtable, struct json_arena_t *arena,
                    key_hash_fn hash_key, key_cmp_fn cmp_keys,
                    free_fn free_key, free_fn free_value)
 {
-    size_t i;
-
+    /* nothing is allocated until the first pair is added */
     hashtable->size = 0;
-    hashtable->num_buckets = 0;  /* index to primes[] */
-    hashtable->buckets = (struct hashtable_bucket *) jsonp_malloc(num_buckets(hashtable) * sizeof(bucket_t));
-    if(!hashtable->buckets)
-        return -1;
-
-    list_init(&hashtable->list);
+    hashtable->used = 0;
+    hashtable->capacity = 0;
+    hashtable->pairs = NULL;
+    hashtable->index = NULL;
+    hashtable->index_mask = 0;
+    hashtable->arena = arena;
 
     hashtable->hash_key = hash_key;
     hashtable->cmp_keys = cmp_keys;
     hashtable->free_key = free_key;
     hashtable->free_value = free_value;
 
-    for(i = 0; i < num_buckets(hashtable); i++)
-    {
-        hashtable->buckets[i].first = hashtable->buckets[i].last =
-            &hashtable->list;
-    }
-
     return 0;
 }
 
 void hashtable_close(hashtable_t *hashtable)
 {
     hashtable_do_clear(hashtable);
-    jsonp_free(hashtable->buckets);
+    hashtable_release(hashtable, hashtable->pairs);
+    hashtable_release(hashtable, hashtable->index);
 }
 
 int hashtable_set(hashtable_t *hashtable, void *key, void *value)
 {
-    pair_t *pair;
-    bucket_t *bucket;
-    size_t hash, index;
+    return hashtable_set_hashed(hashtable, key, hashtable->hash_key(key), value);
+}
 
-    /* rehash if the load ratio exceeds 1 */
-    if(hashtable->size >= num_buckets(hashtable))
-        if(hashtable_do_rehash(hashtable))
-            return -1;
+int hashtable_set_hashed(hashtable_t *hashtable, void *key, size_t hash,
+                         void *value)
+{
+    pair_t *pair;
 
-    hash = hashtable->hash_key(key);
-    index = hash % num_buckets(hashtable);
-    bucket = &hashtable->buckets[index];
-    pair = hashtable_find_pair(hashtable, bucket, key, hash);
+    pair = hashtable_find_pair(hashtable, key, hash);
 
     if(pair)
     {
@@ -263,35 +229,34 @@ int hashtable_set(hashtable_t *hashtable, void *key, void *value)
         if(hashtable->free_value)
             hashtable->free_value(pair->value);
         pair->value = value;
+        return 0;
     }
-    else
-    {
-        pair = (pair_t *) jsonp_malloc(sizeof(pair_t));
-        if(!pair)
+
+    if(hashtable->used == hashtable->capacity)
+        if(hashtable_do_rehash(hashtable))
             return -1;
 
-        pair->key = key;
-        pair->value = value;
-        pair->hash = hash;
-        list_init(&pair->list);
+    pair = &hashtable->pairs[hashtable->used];
+    pair->key = key;
+    pair->value = value;
+    pair->hash = hash;
 
-        insert_to_bucket(hashtable, bucket, &pair->list);
+    if(hashtable->index)
+        index_insert(hashtable, hash, hashtable->used);
 
-        hashtable->size++;
-    }
+    hashtable->used++;
+    hashtable->size++;
     return 0;
 }
 
 void *hashtable_get(hashtable_t *hashtable, const void *key)
 {
-    pair_t *pair;
-    size_t hash;
-    bucket_t *bucket;
-
-    hash = hashtable->hash_key(key);
-    bucket = &hashtable->buckets[hash % num_buckets(hashtable)];
+    return hashtable_get_hashed(hashtable, key, hashtable->hash_key(key));
+}
 
-    pair = hashtable_find_pair(hashtable, bucket, key, hash);
+void *hashtable_get_hashed(hashtable_t *hashtable, const void *key, size_t hash)
+{
+    pair_t *pair = hashtable_find_pair(hashtable, key, hash);
     if(!pair)
         return NULL;
 
@@ -300,70 +265,81 @@ void *hashtable_get(hashtable_t *hashtable, const void *key)
 
 int hashtable_del(hashtable_t *hashtable, const void *key)
 {
-    size_t hash = hashtable->hash_key(key);
-    return hashtable_do_del(hashtable, key, hash);
+    pair_t *pair;
+
+    pair = hashtable_find_pair(hashtable, key, hashtable->hash_key(key));
+    if(!pair)
+        return -1;
+
+    if(hashtable->free_key)
+        hashtable->free_key(pair->key);
+    if(hashtable->free_value)
+        hashtable->free_value(pair->value);
+
+    /* the slot stays in the index until the pairs are compacted */
+    pair->key = NULL;
+    pair->value = NULL;
+    hashtable->size--;
+
+    return 0;
 }
 
 void hashtable_clear(hashtable_t *hashtable)
 {
-    size_t i;
-
     hashtable_do_clear(hashtable);
 
-    for(i = 0; i < num_buckets(hashtable); i++)
+    hashtable->used = 0;
+    hashtable->size = 0;
+    if(hashtable->index)
+        memset(hashtable->index, 0,
+               (hashtable->index_mask + 1) * sizeof(size_t));
+}
+
+static void *hashtable_iter_from(hashtable_t *hashtable, pair_t *pair)
+{
+    pair_t *end = hashtable->pairs + hashtable->used;
+
+    for(; pair < end; pair++)
     {
-        hashtable->buckets[i].first = hashtable->buckets[i].last =
-            &hashtable->list;
+        if(pair->key)
+            return pair;
     }
-
-    list_init(&hashtable->list);
-    hashtable->size = 0;
+    return NULL;
 }
 
 void *hashtable_iter(hashtable_t *hashtable)
 {
-    return hashtable_iter_next(hashtable, &hashtable->list);
+    if(!hashtable->pairs)
+        return NULL;
+
+    return hashtable_iter_from(hashtable, hashtable->pairs);
 }
 
 void *hashtable_iter_at(hashtable_t *hashtable, const void *key)
 {
-    pair_t *pair;
-    size_t hash;
-    bucket_t *bucket;
-
-    hash = hashtable->hash_key(key);
-    bucket = &hashtable->buckets[hash % num_buckets(hashtable)];
-
-    pair = hashtable_find_pair(hashtable, bucket, key, hash);
-    if(!pair)
-        return NULL;
-
-    return &pair->list;
+    return hashtable_find_pair(hashtable, key, hashtable->hash_key(key));
 }
 
 void *hashtable_iter_next(hashtable_t *hashtable, void *iter)
 {
-    list_t *list = (list_t *)iter;
-    if(list->next == &hashtable->list)
-        return NULL;
-    return list->next;
+    return hashtable_iter_from(hashtable, (pair_t *)iter + 1);
 }
 
 void *hashtable_iter_key(void *iter)
 {
-    pair_t *pair = list_to_pair((list_t *)iter);
+    pair_t *pair = (pair_t *)iter;
     return pair->key;
 }
 
 void *hashtable_iter_value(void *iter)
 {
-    pair_t *pair = list_to_pair((list_t *)iter);
+    pair_t *pair = (pair_t *)iter;
     return pair->value;
 }
 
 void hashtable_iter_set(hashtable_t *hashtable, void *iter, void *value)
 {
-    pair_t *pair = list_to_pair((list_t *)iter);
+    pair_t *pair = (pair_t *)iter;
 
     if(hashtable->free_value)
         hashtable->free_value(pair->value);
@@ -18,33 +18,33 @@ typedef size_t (*key_hash_fn)(const void *key);
 typedef int (*key_cmp_fn)(const void *key1, const void *key2);
 typedef void (*free_fn)(void *key);
 
-struct hashtable_list {
-    struct hashtable_list *prev;
-    struct hashtable_list *next;
-};
-
+/* A deleted pair keeps its slot with a NULL key until the pairs are
+   compacted. */
 struct hashtable_pair {
     void *key;
     void *value;
     size_t hash;
-    struct hashtable_list list;
 };
 
-struct hashtable_bucket {
-    struct hashtable_list *first;
-    struct hashtable_list *last;
-};
+/* The pairs are kept in an array in the order they were added. Small
+   tables are searched linearly, comparing the cached hashes first.
+   Once there are more than HASHTABLE_LINEAR_MAX slots, an open
+   addressing index of pair positions is kept alongside. */
+#define HASHTABLE_LINEAR_MAX  8
 
 typedef struct hashtable {
-    size_t size;
-    struct hashtable_bucket *buckets;
-    size_t num_buckets;  /* index to primes[] */
-    struct hashtable_list list;
+    size_t size;      /* number of pairs */
+    size_t used;      /* slots of pairs[] in use, including deleted pairs */
+    size_t capacity;  /* slots allocated for pairs[] */
+    struct hashtable_pair *pairs;
+    size_t *index;    /* position + 1 of a pair, or 0; NULL if small */
+    size_t index_mask;
 
     key_hash_fn hash_key;
     key_cmp_fn cmp_keys;  /* returns non-zero for equal keys */
     free_fn free_key;
     free_fn free_value;
+    struct json_arena_t *arena;  /* allocate from here if non-NULL */
 } hashtable_t;
 
 /**
@@ -76,6 +76,8 @@ void hashtable_destroy(hashtable_t *hashtable);
  * hashtable_init - Initialize a hashtable object
  *
  * @hashtable: The (statically allocated) hashtable object
+ * @arena: If non-NULL, buckets and pairs are allocated from this arena
+ *     and never freed individually.
  * @hash_key: The key hashing function
  * @cmp_keys: The key compare function. Returns non-zero for equal and
  *     zero for unequal unequal keys
@@ -87,7 +89,7 @@ void hashtable_destroy(hashtable_t *hashtable);
  *
  * Returns 0 on success, -1 on error (out of memory).
  */
-int hashtable_init(hashtable_t *hashtable,
+int hashtable_init(hashtable_t *hashtable, struct json_arena_t *arena,
                    key_hash_fn hash_key, key_cmp_fn cmp_keys,
                    free_fn free_key, free_fn free_value);
 
@@ -120,6 +122,21 @@ void hashtable_close(hashtable_t *hashtable);
  */
 int hashtable_set(hashtable_t *hashtable, void *key, void *value);
 
+/**
+ * hashtable_set_hashed - Add/modify value in hashtable whose key hash is known
+ *
+ * @hashtable: The hashtable object
+ * @key: The key
+ * @hash: The hash of @key, as computed by the hashtable's hash_key function
+ * @value: The value
+ *
+ * Like hashtable_set(), but skips hashing the key.
+ *
+ * Returns 0 on success, -1 on failure (out of memory).
+ */
+int hashtable_set_hashed(hashtable_t *hashtable, void *key, size_t hash,
+                         void *value);
+
 /**
  * hashtable_get - Get a value associated with a key
  *
@@ -130,6 +147,19 @@ int hashtable_set(hashtable_t *hashtable, void *key, void *value);
  */
 void *hashtable_get(hashtable_t *hashtable, const void *key);
 
+/**
+ * hashtable_get_hashed - Get a value associated with a key whose hash is known
+ *
+ * @hashtable: The hashtable object
+ * @key: The key
+ * @hash: The hash of @key, as computed by the hashtable's hash_key function
+ *
+ * Like hashtable_get(), but skips hashing the key.
+ *
+ * Returns value if it is found, or NULL otherwise.
+ */
+void *hashtable_get_hashed(hashtable_t *hashtable, const void *key, size_t hash);
+
 /**
  * hashtable_del - Remove a value from the hashtable
  *
@@ -156,13 +186,14 @@ void hashtable_clear(hashtable_t *hashtable);
  *
  * Returns an opaque iterator to the first element in the hashtable.
  * The iterator should be passed to hashtable_iter_* functions.
- * The hashtable items are not iterated over in any particular order.
+ * The hashtable items are iterated over in the order they were added.
  *
  * There's no need to free the iterator in any way. The iterator is
  * valid as long as the item that is referenced by the iterator is not
- * deleted. Other values may be added or deleted. In particular,
- * hashtable_iter_next() may be called on an iterator, and after that
- * the key/value pair pointed by the old iterator may be deleted.
+ * deleted and no new key is added. Other values may be deleted or
+ * replaced. In particular, hashtable_iter_next() may be called on an
+ * iterator, and after that the key/value pair pointed by the old
+ * iterator may be deleted.
  */
 void *hashtable_iter(hashtable_t *hashtable);
 
@@ -121,6 +121,8 @@ typedef struct {
 
 size_t json_object_size(const json_t *object);
 json_t *json_object_get(const json_t *object, const char *key);
+size_t json_object_key_hash(const char *key);
+json_t *json_object_get_hashed(const json_t *object, const char *key, size_t hash);
 int json_object_set_new(json_t *object, const char *key, json_t *value);
 int json_object_set_new_nocheck(json_t *object, const char *key, json_t *value);
 int json_object_del(json_t *object, const char *key);
@@ -179,6 +181,7 @@ int json_array_insert(json_t *array, size_t index, json_t *value)
 }
 
 const char *json_string_value(const json_t *string);
+size_t json_string_length(const json_t *string);
 json_int_t json_integer_value(const json_t *integer);
 double json_real_value(const json_t *real);
 double json_number_value(const json_t *json);
@@ -218,12 +221,49 @@ json_t *json_deep_copy(json_t *value);
 
 #define JSON_REJECT_DUPLICATES 0x1
 #define JSON_DISABLE_EOF_CHECK 0x2
+#define JSON_ALLOW_NUL         0x10
 
 json_t *json_loads(const char *input, size_t flags, json_error_t *error);
 json_t *json_loadb(const char *buffer, size_t buflen, size_t flags, json_error_t *error);
 json_t *json_loadf(FILE *input, size_t flags, json_error_t *error);
 json_t *json_load_file(const char *path, size_t flags, json_error_t *error);
 
+typedef size_t (*json_load_callback_t)(void *buffer, size_t buflen, void *data);
+typedef struct json_stream_t json_stream_t;
+typedef struct json_arena_t json_arena_t;
+typedef struct json_keys_t json_keys_t;
+
+json_stream_t *json_stream_new(json_load_callback_t callback, void *data);
+json_stream_t *json_stream_file(FILE *input);
+json_stream_t *json_stream_buffer(const char *buffer, size_t buflen);
+json_t *json_stream_load(json_stream_t *stream, size_t flags, json_error_t *error);
+int json_stream_skip_line(json_stream_t *stream);
+const char *json_stream_pending(const json_stream_t *stream, size_t *len);
+size_t json_stream_tell(const json_stream_t *stream);
+int json_stream_seek(json_stream_t *stream, size_t offset);
+int json_stream_eof(const json_stream_t *stream);
+void json_stream_close(json_stream_t *stream);
+
+json_arena_t *json_arena_new(void);
+void json_arena_reset(json_arena_t *arena);
+void json_arena_free(json_arena_t *arena);
+void json_stream_set_arena(json_stream_t *stream, json_arena_t *arena);
+
+json_keys_t *json_keys_new(void);
+const char *json_keys_intern(json_keys_t *keys, const char *key);
+void json_keys_freeze(json_keys_t *keys);
+void json_keys_free(json_keys_t *keys);
+void json_stream_set_keys(json_stream_t *stream, json_keys_t *keys);
+
+#define JSON_PROJECT_SKIP   0
+#define JSON_PROJECT_KEEP   1
+#define JSON_PROJECT_ALL    2
+#define JSON_PROJECT_TEXT   3
+
+typedef int (*json_project_t)(void *data, const void *context, const char *key, const void **child);
+
+void json_stream_set_projection(json_stream_t *stream, json_project_t project, void *data, const void *root);
+
 
 /* encoding */
 
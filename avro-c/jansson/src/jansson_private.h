@@ -15,8 +15,10 @@ extern "C" {
 #endif
 
 #include <stddef.h>
+#include <stdint.h>
 #include "jansson.h"
 #include "hashtable.h"
+#include "strbuffer.h"
 
 #ifdef _WIN32
 #define snprintf _snprintf
@@ -43,8 +45,8 @@ extern "C" {
 typedef struct {
     json_t json;
     hashtable_t hashtable;
-    size_t serial;
     int visited;
+    json_arena_t *arena;
 } json_object_t;
 
 typedef struct {
@@ -53,11 +55,13 @@ typedef struct {
     size_t entries;
     json_t **table;
     int visited;
+    json_arena_t *arena;
 } json_array_t;
 
 typedef struct {
     json_t json;
     char *value;
+    size_t length;
 } json_string_t;
 
 typedef struct {
@@ -79,12 +83,34 @@ typedef struct {
 size_t jsonp_hash_str(const void *ptr);
 int jsonp_str_equal(const void *ptr1, const void *ptr2);
 
+/* Object keys are stored with a flag in front of the string that tells
+   whether the key belongs to a json_keys_t rather than to the object */
 typedef struct {
-    size_t serial;
+    char interned;
     char key[1];
 } object_key_t;
 
-const object_key_t *jsonp_object_iter_fullkey(void *iter);
+/* Adds value to object under key, whose hash is hash, and steals the
+   reference to value. key is copied unless it was interned. */
+int jsonp_object_set_key(json_t *object, const char *key, size_t hash,
+                         int interned, json_t *value);
+
+/* Returns the interned copy of key, adding key to the table unless it
+   is frozen or full, or NULL */
+const char *jsonp_keys_find(json_keys_t *keys, const char *key, size_t hash);
+
+/* Constructors for the parser. With a non-NULL arena, the value and
+   everything later added to it is allocated from the arena and the
+   value is immortal: json_decref() leaves it alone and
+   json_arena_reset() releases it. jsonp_string_own() takes ownership
+   of value, which must come from the arena in that case and from
+   jsonp_malloc() otherwise, even if it fails, and is len bytes long
+   plus a terminating NUL. */
+json_t *jsonp_object(json_arena_t *arena);
+json_t *jsonp_array(json_arena_t *arena);
+json_t *jsonp_string_own(json_arena_t *arena, char *value, size_t len);
+json_t *jsonp_integer(json_arena_t *arena, json_int_t value);
+json_t *jsonp_real(json_arena_t *arena, double value);
 
 void jsonp_error_init(json_error_t *error, const char *source);
 void jsonp_error_set_source(json_error_t *error, const char *source);
@@ -93,10 +119,16 @@ void jsonp_error_set(json_error_t *error, int line, int column,
 void jsonp_error_vset(json_error_t *error, int line, int column,
                       size_t position, const char *msg, va_list ap);
 
+/* Number conversion */
+int jsonp_strtod(strbuffer_t *strbuffer, double *out);
+int jsonp_decimal_to_double(uint64_t mantissa, int exp10, int negative,
+                            double *out);
+
 /* Wrappers for custom memory functions */
 void* jsonp_malloc(size_t size);
 void jsonp_free(void *ptr);
 char *jsonp_strdup(const char *str);
+void *jsonp_arena_alloc(json_arena_t *arena, size_t size);
 
 CLOSE_EXTERN
 #endif
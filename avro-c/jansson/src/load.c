@@ -16,6 +16,7 @@
 
 #include <jansson.h>
 #include "jansson_private.h"
+#include "scan.h"
 #include "strbuffer.h"
 #include "utf.h"
 
@@ -32,13 +33,19 @@
 #define TOKEN_FALSE          260
 #define TOKEN_NULL           261
 
-/* Read one byte from stream, convert to unsigned char, then int, and
-   return. return EOF on end of file. This corresponds to the
-   behaviour of fgetc(). */
-typedef int (*get_func)(void *data);
-
-typedef struct {
-    get_func get;
+/* Input is lexed from the byte range pos..end. When it runs out,
+   fill() is asked to point pos and end at the next block of input; it
+   returns -1 at end of input. A source that is entirely in memory has
+   no fill function. The bytes from pos up to valid are known to be
+   valid UTF-8; fill() resets valid to the new pos. */
+typedef struct stream_s stream_t;
+typedef int (*fill_func)(stream_t *stream);
+
+struct stream_s {
+    const char *pos;
+    const char *end;
+    const char *valid;
+    fill_func fill;
     void *data;
     char buffer[5];
     int buffer_pos;
@@ -46,14 +53,23 @@ typedef struct {
     int line;
     int column, last_column;
     size_t position;
-} stream_t;
+};
 
 typedef struct {
     stream_t stream;
     strbuffer_t saved_text;
+    json_arena_t *arena;  /* values are allocated from here if non-NULL */
+    json_keys_t *keys;    /* object keys are interned here if non-NULL */
+    json_project_t project;  /* see json_stream_set_projection() */
+    void *project_data;
+    const void *project_root;
+    size_t flags;
     int token;
     union {
-        char *string;
+        struct {
+            char *val;
+            size_t len;
+        } string;
         json_int_t integer;
         double real;
     } value;
@@ -61,6 +77,21 @@ typedef struct {
 
 #define stream_to_lex(stream) container_of(stream, lex_t, stream)
 
+#define JSON_STREAM_BUFFER_SIZE  65536
+
+/* How much input to validate as UTF-8 at a time */
+#define UTF8_CHUNK_SIZE  4096
+
+struct json_stream_t {
+    lex_t lex;
+    json_load_callback_t callback;
+    void *data;
+    char *buffer;       /* owned block buffer, NULL for memory streams */
+    const char *block;  /* start of the current block */
+    size_t offset;      /* input offset of the current block */
+    int eof;
+};
+
 
 /*** error reporting ***/
 
@@ -118,11 +149,8 @@ static void error_set(json_error_t *error, const lex_t *lex,
 
 /*** lexical analyzer ***/
 
-static void
-stream_init(stream_t *stream, get_func get, void *data)
+static void stream_reset(stream_t *stream)
 {
-    stream->get = get;
-    stream->data = data;
     stream->buffer[0] = '\0';
     stream->buffer_pos = 0;
 
@@ -132,6 +160,26 @@ stream_init(stream_t *stream, get_func get, void *data)
     stream->position = 0;
 }
 
+static void stream_init(stream_t *stream, const char *pos, const char *end,
+                        fill_func fill, void *data)
+{
+    stream->pos = pos;
+    stream->end = end;
+    stream->valid = pos;
+    stream->fill = fill;
+    stream->data = data;
+    stream_reset(stream);
+}
+
+/* Return the next byte of input as an unsigned char, or EOF. Only an
+   exhausted block costs a call through fill(). */
+static JSON_INLINE int stream_next(stream_t *stream)
+{
+    if(stream->pos == stream->end && (!stream->fill || stream->fill(stream)))
+        return EOF;
+    return (unsigned char)*stream->pos++;
+}
+
 static int stream_get(stream_t *stream, json_error_t *error)
 {
     int c;
@@ -141,7 +189,7 @@ static int stream_get(stream_t *stream, json_error_t *error)
 
     if(!stream->buffer[stream->buffer_pos])
     {
-        c = stream->get(stream->data);
+        c = stream_next(stream);
         if(c == EOF) {
             stream->state = STREAM_STATE_EOF;
             return STREAM_STATE_EOF;
@@ -162,7 +210,7 @@ static int stream_get(stream_t *stream, json_error_t *error)
             assert(count >= 2);
 
             for(i = 1; i < count; i++)
-                stream->buffer[i] = stream->get(stream->data);
+                stream->buffer[i] = stream_next(stream);
 
             if(!utf8_check_full(stream->buffer, count, NULL))
                 goto out;
@@ -257,6 +305,87 @@ static void lex_save_cached(lex_t *lex)
     }
 }
 
+/* True if the stream has no bytes of a UTF-8 sequence cached, so the
+   next character starts at pos and can be scanned in place */
+static JSON_INLINE int stream_at_pos(const stream_t *stream)
+{
+    return stream->state == STREAM_STATE_OK &&
+           !stream->buffer[stream->buffer_pos];
+}
+
+/* Make sure the input from p on, if any, is validated in the next
+   chunk, and return the end of the valid part */
+static const char *stream_validate(stream_t *stream, const char *p)
+{
+    if(p >= stream->valid) {
+        size_t len = stream->end - p;
+        if(len > UTF8_CHUNK_SIZE)
+            len = UTF8_CHUNK_SIZE;
+        stream->valid = p + jsonp_scan_utf8(p, len);
+    }
+    return stream->valid;
+}
+
+/* Skip whitespace with the block scanner, refilling as needed */
+static void lex_skip_space(lex_t *lex)
+{
+    stream_t *stream = &lex->stream;
+    const char *p, *run_end, *newline;
+
+    if(!stream_at_pos(stream))
+        return;
+
+    while(1) {
+        p = stream->pos;
+        run_end = p + jsonp_scan_space(p, stream->end - p);
+        stream->position += run_end - p;
+        while((newline = memchr(p, '\n', run_end - p))) {
+            stream->line++;
+            stream->last_column = stream->column + (newline - p);
+            stream->column = 0;
+            p = newline + 1;
+        }
+        stream->column += run_end - p;
+        stream->pos = run_end;
+
+        if(stream->pos != stream->end || !stream->fill || stream->fill(stream))
+            return;
+    }
+}
+
+/* Save a run of string characters in one go. ASCII is taken by the
+   block scanner, multi-byte characters as long as they are in input
+   that has been validated as UTF-8. Anything else, including an
+   invalid sequence, is left to stream_get() and its error reporting. */
+static void lex_save_string_run(lex_t *lex)
+{
+    stream_t *stream = &lex->stream;
+    const char *p;
+    size_t n;
+
+    if(!stream_at_pos(stream))
+        return;
+
+    p = stream->pos;
+    while(1) {
+        n = jsonp_scan_string(p, stream->end - p);
+        p += n;
+        stream->column += n;
+        if(p == stream->end || (unsigned char)*p < 0x80 ||
+           p >= stream_validate(stream, p))
+            break;
+        p += utf8_check_first(*p);
+        stream->column++;
+    }
+
+    n = p - stream->pos;
+    if(n) {
+        strbuffer_append_bytes(&lex->saved_text, stream->pos, n);
+        stream->pos = p;
+        stream->position += n;
+    }
+}
+
 /* assumes that str points to 'u' plus at least 4 valid hex digits */
 static int32_t decode_unicode_escape(const char *str)
 {
@@ -281,16 +410,23 @@ static int32_t decode_unicode_escape(const char *str)
     return value;
 }
 
+static void lex_free_string(lex_t *lex, char *string)
+{
+    if(!lex->arena)
+        jsonp_free(string);
+}
+
 static void lex_scan_string(lex_t *lex, json_error_t *error)
 {
     int c;
     const char *p;
     char *t;
-    int i;
+    int i, escapes = 0;
 
-    lex->value.string = NULL;
+    lex->value.string.val = NULL;
     lex->token = TOKEN_INVALID;
 
+    lex_save_string_run(lex);
     c = lex_get_save(lex, error);
 
     while(c != '"') {
@@ -313,6 +449,7 @@ static void lex_scan_string(lex_t *lex, json_error_t *error)
         }
 
         else if(c == '\\') {
+            escapes = 1;
             c = lex_get_save(lex, error);
             if(c == 'u') {
                 c = lex_get_save(lex, error);
@@ -332,8 +469,10 @@ static void lex_scan_string(lex_t *lex, json_error_t *error)
                 goto out;
             }
         }
-        else
+        else {
+            lex_save_string_run(lex);
             c = lex_get_save(lex, error);
+        }
     }
 
     /* the actual value is at most of the same length as the source
@@ -343,18 +482,30 @@ static void lex_scan_string(lex_t *lex, json_error_t *error)
          - two \uXXXX escapes (length 12) forming an UTF-16 surrogate pair
            are converted to 4 bytes
     */
-    lex->value.string = (char *) jsonp_malloc(lex->saved_text.length + 1);
-    if(!lex->value.string) {
+    if(lex->arena)
+        lex->value.string.val = (char *) jsonp_arena_alloc(lex->arena, lex->saved_text.length + 1);
+    else
+        lex->value.string.val = (char *) jsonp_malloc(lex->saved_text.length + 1);
+    if(!lex->value.string.val) {
         /* this is not very nice, since TOKEN_INVALID is returned */
         goto out;
     }
 
     /* the target */
-    t = lex->value.string;
+    t = lex->value.string.val;
 
     /* + 1 to skip the " */
     p = strbuffer_value(&lex->saved_text) + 1;
 
+    if(!escapes) {
+        /* nothing to decode, drop the quotes */
+        memcpy(t, p, lex->saved_text.length - 2);
+        t[lex->saved_text.length - 2] = '\0';
+        lex->value.string.len = lex->saved_text.length - 2;
+        lex->token = TOKEN_STRING;
+        return;
+    }
+
     while(*p != '"') {
         if(*p == '\\') {
             p++;
@@ -398,11 +549,10 @@ static void lex_scan_string(lex_t *lex, json_error_t *error)
                     error_set(error, lex, "invalid Unicode '\\u%04X'", value);
                     goto out;
                 }
-                else if(value == 0)
+                else if(value == 0 && !(lex->flags & JSON_ALLOW_NUL))
                 {
-                    value='0'; /* well, it's a workaround? */
-                    /* error_set(error, lex, "\\u0000 is not allowed"); */
-                    /* goto out; */
+                    error_set(error, lex, "\\u0000 is not allowed");
+                    goto out;
                 }
 
                 if(utf8_encode(value, buffer, &length))
@@ -430,11 +580,13 @@ static void lex_scan_string(lex_t *lex, json_error_t *error)
             *(t++) = *(p++);
     }
     *t = '\0';
+    lex->value.string.len = t - lex->value.string.val;
     lex->token = TOKEN_STRING;
     return;
 
 out:
-    jsonp_free(lex->value.string);
+    lex_free_string(lex, lex->value.string.val);
+    lex->value.string.val = NULL;
 }
 
 #if JSON_INTEGER_IS_LONG_LONG
@@ -447,14 +599,133 @@ out:
 #define json_strtoint     strtol
 #endif
 
+#if JSON_INTEGER_IS_LONG_LONG
+#define JSON_INTEGER_MAX  LLONG_MAX
+#else
+#define JSON_INTEGER_MAX  LONG_MAX
+#endif
+
+#define NUMBER_SLOW  1
+
+#define is_digit(c)  ((unsigned char)((c) - '0') < 10)
+
+/* Scan a number straight from the input block, accumulating the
+   mantissa and decimal exponent on the way, and convert it without
+   strtoll() or strtod(). c is the first character, already consumed
+   and saved. Returns NUMBER_SLOW, without consuming anything, for
+   numbers that are not well-formed, may continue in the next block or
+   are integers that do not fit; lex_scan_number() then deals with them
+   and their errors one character at a time. */
+static int lex_scan_number_fast(lex_t *lex, int c, json_error_t *error)
+{
+    stream_t *stream = &lex->stream;
+    const char *p, *end;
+    uint64_t mantissa = 0;
+    int negative = 0, real = 0, digits = 0, exp10 = 0, exp = 0, exp_negative = 0;
+    size_t len;
+
+    if(!stream_at_pos(stream))
+        return NUMBER_SLOW;
+
+    p = stream->pos;
+    end = stream->end;
+
+    if(c == '-') {
+        negative = 1;
+        if(p == end || !is_digit(*p))
+            return NUMBER_SLOW;
+        c = *p++;
+    }
+
+    if(c == '0') {
+        if(p < end && is_digit(*p))
+            return NUMBER_SLOW;
+    }
+    else {
+        mantissa = c - '0';
+        digits = 1;
+        while(p < end && is_digit(*p)) {
+            mantissa = mantissa * 10 + (*p++ - '0');
+            digits++;
+        }
+    }
+
+    if(p < end && *p == '.') {
+        real = 1;
+        p++;
+        if(p == end || !is_digit(*p))
+            return NUMBER_SLOW;
+        while(p < end && is_digit(*p)) {
+            if(mantissa || *p != '0') {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits++;
+            }
+            exp10--;
+            p++;
+        }
+    }
+
+    if(p < end && (*p == 'e' || *p == 'E')) {
+        real = 1;
+        p++;
+        if(p < end && (*p == '+' || *p == '-'))
+            exp_negative = *p++ == '-';
+        if(p == end || !is_digit(*p))
+            return NUMBER_SLOW;
+        while(p < end && is_digit(*p)) {
+            if(exp < 100000)
+                exp = exp * 10 + (*p - '0');
+            p++;
+        }
+    }
+
+    /* the number may go on in the next block */
+    if(p == end)
+        return NUMBER_SLOW;
+
+    /* past 19 digits, the mantissa may have overflowed */
+    if(!real) {
+        if(digits > 19 || mantissa > (uint64_t)JSON_INTEGER_MAX + negative)
+            return NUMBER_SLOW;
+        lex->token = TOKEN_INTEGER;
+        lex->value.integer = negative ? -(json_int_t)(mantissa - 1) - 1
+                                      : (json_int_t)mantissa;
+    }
+
+    len = p - stream->pos;
+    strbuffer_append_bytes(&lex->saved_text, stream->pos, len);
+    stream->pos = p;
+    stream->position += len;
+    stream->column += len;
+
+    if(!real)
+        return 0;
+
+    exp10 += exp_negative ? -exp : exp;
+    if(digits > 19 ||
+       jsonp_decimal_to_double(mantissa, exp10, negative, &lex->value.real)) {
+        if(jsonp_strtod(&lex->saved_text, &lex->value.real)) {
+            error_set(error, lex, "real number overflow");
+            return -1;
+        }
+    }
+    lex->token = TOKEN_REAL;
+    return 0;
+}
+
 static int lex_scan_number(lex_t *lex, int c, json_error_t *error)
 {
     const char *saved_text;
     char *end;
     double value;
+    int result;
 
     lex->token = TOKEN_INVALID;
 
+    result = lex_scan_number_fast(lex, c, error);
+    if(result != NUMBER_SLOW)
+        return result;
+
     if(c == '-')
         c = lex_get_save(lex, error);
 
@@ -529,12 +800,7 @@ static int lex_scan_number(lex_t *lex, int c, json_error_t *error)
 
     lex_unget_unsave(lex, c);
 
-    saved_text = strbuffer_value(&lex->saved_text);
-    errno = 0;
-    value = strtod(saved_text, &end);
-    assert(end == saved_text + lex->saved_text.length);
-
-    if(errno == ERANGE && value != 0) {
+    if(jsonp_strtod(&lex->saved_text, &value)) {
         error_set(error, lex, "real number overflow");
         goto out;
     }
@@ -554,10 +820,11 @@ static int lex_scan(lex_t *lex, json_error_t *error)
     strbuffer_clear(&lex->saved_text);
 
     if(lex->token == TOKEN_STRING) {
-        jsonp_free(lex->value.string);
-        lex->value.string = NULL;
+        lex_free_string(lex, lex->value.string.val);
+        lex->value.string.val = NULL;
     }
 
+    lex_skip_space(lex);
     c = lex_get(lex, error);
     while(c == ' ' || c == '\t' || c == '\n' || c == '\r')
         c = lex_get(lex, error);
@@ -617,42 +884,355 @@ out:
     return lex->token;
 }
 
-static char *lex_steal_string(lex_t *lex)
+static char *lex_steal_string(lex_t *lex, size_t *out_len)
 {
     char *result = NULL;
     if(lex->token == TOKEN_STRING)
     {
-        result = lex->value.string;
-        lex->value.string = NULL;
+        result = lex->value.string.val;
+        *out_len = lex->value.string.len;
+        lex->value.string.val = NULL;
     }
     return result;
 }
 
-static int lex_init(lex_t *lex, get_func get, void *data)
+/* Skipping objects and arrays: what the scanner expects next */
+#define SKIP_VALUE        0   /* after ':' or ',' in an array */
+#define SKIP_FIRST_VALUE  1   /* after '[' */
+#define SKIP_KEY          2   /* after ',' in an object */
+#define SKIP_FIRST_KEY    3   /* after '{' */
+#define SKIP_COLON        4
+#define SKIP_NEXT         5   /* after a value, ',' or a closing bracket */
+#define SKIP_STRING       6
+#define SKIP_ESCAPE       7
+#define SKIP_WORD         8   /* a number or literal */
+
+#define SKIP_MAX_DEPTH    2048
+
+#define is_word(c)  (isalnum(c) || (c) == '+' || (c) == '-' || (c) == '.')
+#define is_space(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+
+/* Scan past the rest of the object or array whose opening bracket is
+   the current token without decoding it, appending the bytes to text
+   if it is not NULL. Only the structure is checked: brackets, commas,
+   colons and where strings start and end. String runs go through the
+   block scanner; numbers, literals, escapes and multi-byte characters
+   are passed over as they are. */
+static int lex_skip_container(lex_t *lex, strbuffer_t *text,
+                              json_error_t *error)
+{
+    stream_t *stream = &lex->stream;
+    const char *p, *end, *string = NULL, *msg;
+    unsigned char objects[SKIP_MAX_DEPTH / 8];  /* bit set for objects */
+    int depth = 1, state, key = 0;
+    unsigned char c;
+    size_t n;
+
+    assert(stream_at_pos(stream));
+
+    objects[0] = lex->token == '{';
+    state = lex->token == '{' ? SKIP_FIRST_KEY : SKIP_FIRST_VALUE;
+
+#define in_object() \
+    (objects[(depth - 1) / 8] & (1 << ((depth - 1) % 8)))
+
+    p = stream->pos;
+    while(1) {
+        end = stream->end;
+        while(p < end) {
+            c = *p;
+            switch(state) {
+                case SKIP_STRING:
+                    n = jsonp_scan_string(p, end - p);
+                    p += n;
+                    stream->column += n;
+                    if(p == end)
+                        continue;
+                    c = *p;
+                    if(c == '"')
+                        state = key ? SKIP_COLON : SKIP_NEXT;
+                    else if(c == '\\')
+                        state = SKIP_ESCAPE;
+                    else if(c < 0x20)
+                        goto control;
+                    break;
+
+                case SKIP_ESCAPE:
+                    state = SKIP_STRING;
+                    break;
+
+                case SKIP_WORD:
+                    if(is_word(c))
+                        break;
+                    state = SKIP_NEXT;
+                    continue;
+
+                default:
+                    if(is_space(c))
+                        break;
+
+                    if(c == '{' || c == '[') {
+                        if(state != SKIP_VALUE && state != SKIP_FIRST_VALUE)
+                            goto invalid;
+                        if(depth == SKIP_MAX_DEPTH)
+                            goto invalid;
+                        if(depth % 8 == 0)
+                            objects[depth / 8] = 0;
+                        if(c == '{') {
+                            objects[depth / 8] |= 1 << (depth % 8);
+                            state = SKIP_FIRST_KEY;
+                        }
+                        else {
+                            objects[depth / 8] &= ~(1 << (depth % 8));
+                            state = SKIP_FIRST_VALUE;
+                        }
+                        depth++;
+                    }
+                    else if(c == '}' || c == ']') {
+                        if(c == '}' ? (state != SKIP_NEXT && state != SKIP_FIRST_KEY) || !in_object()
+                                    : (state != SKIP_NEXT && state != SKIP_FIRST_VALUE) || in_object())
+                            goto invalid;
+                        depth--;
+                        state = SKIP_NEXT;
+                    }
+                    else if(c == ':') {
+                        if(state != SKIP_COLON)
+                            goto invalid;
+                        state = SKIP_VALUE;
+                    }
+                    else if(c == ',') {
+                        if(state != SKIP_NEXT)
+                            goto invalid;
+                        state = in_object() ? SKIP_KEY : SKIP_VALUE;
+                    }
+                    else if(c == '"') {
+                        if(state == SKIP_KEY || state == SKIP_FIRST_KEY)
+                            key = 1;
+                        else if(state == SKIP_VALUE || state == SKIP_FIRST_VALUE)
+                            key = 0;
+                        else
+                            goto invalid;
+                        state = SKIP_STRING;
+                        string = p;
+                    }
+                    else if(is_word(c) &&
+                            (state == SKIP_VALUE || state == SKIP_FIRST_VALUE))
+                        state = SKIP_WORD;
+                    else
+                        goto invalid;
+            }
+
+            p++;
+            if(c == '\n') {
+                stream->line++;
+                stream->last_column = stream->column;
+                stream->column = 0;
+            }
+            else if((c & 0xC0) != 0x80)
+                stream->column++;
+
+            if(depth == 0)
+                goto out;
+        }
+
+        if(text)
+            strbuffer_append_bytes(text, stream->pos, p - stream->pos);
+        stream->position += p - stream->pos;
+        stream->pos = p;
+        string = NULL;
+
+        if(!stream->fill || stream->fill(stream)) {
+            strbuffer_clear(&lex->saved_text);
+            error_set(error, lex, "premature end of input");
+            lex->token = TOKEN_INVALID;
+            return -1;
+        }
+        p = stream->pos;
+    }
+
+#undef in_object
+
+out:
+    if(text)
+        strbuffer_append_bytes(text, stream->pos, p - stream->pos);
+    stream->position += p - stream->pos;
+    stream->pos = p;
+    return 0;
+
+control:
+    /* Reported as lex_scan_string() does, with the string so far as
+       context. A string that began in an earlier block is reported
+       without one. */
+    stream->position += p - stream->pos;
+    strbuffer_clear(&lex->saved_text);
+    msg = c == '\n' ? "unexpected newline" : "control character 0x%x";
+    if(string) {
+        strbuffer_append_bytes(&lex->saved_text, string, p - string);
+        error_set(error, lex, msg, c);
+    }
+    else
+        jsonp_error_set(error, stream->line, stream->column,
+                        stream->position, msg, c);
+    p++;
+    goto error;
+
+invalid:
+    /* Reported after the offending byte, as the lexer reads a token
+       before it finds it unexpected */
+    p++;
+    if((c & 0xC0) != 0x80)
+        stream->column++;
+    stream->position += p - stream->pos;
+    strbuffer_clear(&lex->saved_text);
+    lex_save(lex, c);
+    error_set(error, lex, "unexpected token");
+
+error:
+    /* The offending byte is consumed either way, like the lexer
+       consumes it, so that skipping the rest of the line after an
+       error drops the same input whichever way the document is
+       decoded */
+    stream->pos = p;
+    lex->token = TOKEN_INVALID;
+    return -1;
+}
+
+/* Skip the value that starts with the current token */
+static int lex_skip_value(lex_t *lex, json_error_t *error)
 {
-    stream_init(&lex->stream, get, data);
+    if(lex->token == '{' || lex->token == '[')
+        return lex_skip_container(lex, NULL, error);
+
+    if(lex->token == TOKEN_INVALID) {
+        error_set(error, lex, "invalid token");
+        return -1;
+    }
+    if(lex->token < TOKEN_STRING) {
+        error_set(error, lex, "unexpected token");
+        return -1;
+    }
+    return 0;
+}
+
+static int lex_init(lex_t *lex, const char *pos, const char *end,
+                    fill_func fill, void *data)
+{
+    stream_init(&lex->stream, pos, end, fill, data);
     if(strbuffer_init(&lex->saved_text))
         return -1;
 
+    lex->arena = NULL;
+    lex->keys = NULL;
+    lex->project = NULL;
+    lex->project_data = NULL;
+    lex->project_root = NULL;
+    lex->flags = 0;
     lex->token = TOKEN_INVALID;
     return 0;
 }
 
+/* Prepare a lexer for the next document of the same input, keeping
+   its buffers */
+static void lex_reset(lex_t *lex)
+{
+    stream_reset(&lex->stream);
+    if(lex->token == TOKEN_STRING) {
+        lex_free_string(lex, lex->value.string.val);
+        lex->value.string.val = NULL;
+    }
+    lex->token = TOKEN_INVALID;
+    strbuffer_clear(&lex->saved_text);
+}
+
 static void lex_close(lex_t *lex)
 {
     if(lex->token == TOKEN_STRING)
-        jsonp_free(lex->value.string);
+        lex_free_string(lex, lex->value.string.val);
     strbuffer_close(&lex->saved_text);
 }
 
 
 /*** parser ***/
 
-static json_t *parse_value(lex_t *lex, size_t flags, json_error_t *error);
+static json_t *parse_value(lex_t *lex, size_t flags, const void *ctx,
+                           json_error_t *error);
+
+/* Ask the projection callback, if any, what to do with the values
+   of a member or of the items of an array in ctx. NULL stands for a
+   value that is not projected: it is decoded in full. */
+static int parse_project(lex_t *lex, const void *ctx, const char *key,
+                         const void **child)
+{
+    int action;
+
+    *child = NULL;
+    if(!ctx)
+        return JSON_PROJECT_ALL;
+
+    action = lex->project(lex->project_data, ctx, key, child);
+    if(action != JSON_PROJECT_KEEP)
+        *child = NULL;
+    return action;
+}
+
+/* Decode the object or array at the current token as a string that
+   holds its text */
+static json_t *parse_text(lex_t *lex, json_error_t *error)
+{
+    strbuffer_t *text = &lex->saved_text;
+    size_t valid;
+    char *value;
+
+    if(lex_skip_container(lex, text, error))
+        return NULL;
+
+    valid = jsonp_scan_utf8(text->value, text->length);
+    if(valid != (size_t)text->length) {
+        int c = (unsigned char)text->value[valid];
+        lex->stream.state = STREAM_STATE_ERROR;
+        error_set(error, lex, "unable to decode byte 0x%x", c);
+        return NULL;
+    }
+
+    if(lex->arena)
+        value = (char *) jsonp_arena_alloc(lex->arena, text->length + 1);
+    else
+        value = (char *) jsonp_malloc(text->length + 1);
+    if(!value)
+        return NULL;
+    memcpy(value, text->value, text->length + 1);
+
+    return jsonp_string_own(lex->arena, value, text->length);
+}
 
-static json_t *parse_object(lex_t *lex, size_t flags, json_error_t *error)
+/* Decode the value at the current token as parse_project() said */
+static json_t *parse_projected(lex_t *lex, size_t flags, int action,
+                               const void *child, json_error_t *error)
 {
-    json_t *object = json_object();
+    if(action == JSON_PROJECT_TEXT && (lex->token == '{' || lex->token == '['))
+        return parse_text(lex, error);
+    return parse_value(lex, flags, child, error);
+}
+
+/* Steals the reference to value */
+static int parse_object_set(lex_t *lex, json_t *object, const char *key,
+                            json_t *value)
+{
+    size_t hash = jsonp_hash_str(key);
+    const char *interned = NULL;
+
+    if(lex->keys)
+        interned = jsonp_keys_find(lex->keys, key, hash);
+
+    if(interned)
+        return jsonp_object_set_key(object, interned, hash, 1, value);
+    return jsonp_object_set_key(object, key, hash, 0, value);
+}
+
+static json_t *parse_object(lex_t *lex, size_t flags, const void *ctx,
+                            json_error_t *error)
+{
+    json_t *object = jsonp_object(lex->arena);
     if(!object)
         return NULL;
 
@@ -662,20 +1242,28 @@ static json_t *parse_object(lex_t *lex, size_t flags, json_error_t *error)
 
     while(1) {
         char *key;
+        size_t len;
         json_t *value;
+        const void *child;
+        int action;
 
         if(lex->token != TOKEN_STRING) {
             error_set(error, lex, "string or '}' expected");
             goto error;
         }
 
-        key = lex_steal_string(lex);
+        key = lex_steal_string(lex, &len);
         if(!key)
             return NULL;
+        if(memchr(key, '\0', len)) {
+            lex_free_string(lex, key);
+            error_set(error, lex, "NUL byte in object key not supported");
+            goto error;
+        }
 
         if(flags & JSON_REJECT_DUPLICATES) {
             if(json_object_get(object, key)) {
-                jsonp_free(key);
+                lex_free_string(lex, key);
                 error_set(error, lex, "duplicate object key");
                 goto error;
             }
@@ -683,27 +1271,34 @@ static json_t *parse_object(lex_t *lex, size_t flags, json_error_t *error)
 
         lex_scan(lex, error);
         if(lex->token != ':') {
-            jsonp_free(key);
+            lex_free_string(lex, key);
             error_set(error, lex, "':' expected");
             goto error;
         }
 
         lex_scan(lex, error);
-        value = parse_value(lex, flags, error);
+        action = parse_project(lex, ctx, key, &child);
+        if(action == JSON_PROJECT_SKIP) {
+            lex_free_string(lex, key);
+            if(lex_skip_value(lex, error))
+                goto error;
+            goto next;
+        }
+
+        value = parse_projected(lex, flags, action, child, error);
         if(!value) {
-            jsonp_free(key);
+            lex_free_string(lex, key);
             goto error;
         }
 
-        if(json_object_set_nocheck(object, key, value)) {
-            jsonp_free(key);
-            json_decref(value);
+        if(parse_object_set(lex, object, key, value)) {
+            lex_free_string(lex, key);
             goto error;
         }
 
-        json_decref(value);
-        jsonp_free(key);
+        lex_free_string(lex, key);
 
+    next:
         lex_scan(lex, error);
         if(lex->token != ',')
             break;
@@ -723,9 +1318,13 @@ error:
     return NULL;
 }
 
-static json_t *parse_array(lex_t *lex, size_t flags, json_error_t *error)
+static json_t *parse_array(lex_t *lex, size_t flags, const void *ctx,
+                           json_error_t *error)
 {
-    json_t *array = json_array();
+    const void *child;
+    int action;
+
+    json_t *array = jsonp_array(lex->arena);
     if(!array)
         return NULL;
 
@@ -733,8 +1332,18 @@ static json_t *parse_array(lex_t *lex, size_t flags, json_error_t *error)
     if(lex->token == ']')
         return array;
 
+    action = parse_project(lex, ctx, NULL, &child);
+
     while(lex->token) {
-        json_t *elem = parse_value(lex, flags, error);
+        json_t *elem;
+
+        if(action == JSON_PROJECT_SKIP) {
+            if(lex_skip_value(lex, error))
+                goto error;
+            goto next;
+        }
+
+        elem = parse_projected(lex, flags, action, child, error);
         if(!elem)
             goto error;
 
@@ -744,6 +1353,7 @@ static json_t *parse_array(lex_t *lex, size_t flags, json_error_t *error)
         }
         json_decref(elem);
 
+    next:
         lex_scan(lex, error);
         if(lex->token != ',')
             break;
@@ -763,23 +1373,28 @@ error:
     return NULL;
 }
 
-static json_t *parse_value(lex_t *lex, size_t flags, json_error_t *error)
+static json_t *parse_value(lex_t *lex, size_t flags, const void *ctx,
+                           json_error_t *error)
 {
     json_t *json;
 
     switch(lex->token) {
         case TOKEN_STRING: {
-            json = json_string_nocheck(lex->value.string);
+            char *value;
+            size_t len;
+
+            value = lex_steal_string(lex, &len);
+            json = jsonp_string_own(lex->arena, value, len);
             break;
         }
 
         case TOKEN_INTEGER: {
-            json = json_integer(lex->value.integer);
+            json = jsonp_integer(lex->arena, lex->value.integer);
             break;
         }
 
         case TOKEN_REAL: {
-            json = json_real(lex->value.real);
+            json = jsonp_real(lex->arena, lex->value.real);
             break;
         }
 
@@ -796,11 +1411,11 @@ static json_t *parse_value(lex_t *lex, size_t flags, json_error_t *error)
             break;
 
         case '{':
-            json = parse_object(lex, flags, error);
+            json = parse_object(lex, flags, ctx, error);
             break;
 
         case '[':
-            json = parse_array(lex, flags, error);
+            json = parse_array(lex, flags, ctx, error);
             break;
 
         case TOKEN_INVALID:
@@ -822,13 +1437,16 @@ static json_t *parse_json(lex_t *lex, size_t flags, json_error_t *error)
 {
     json_t *result;
 
+    lex->flags = flags;
+
     lex_scan(lex, error);
     if(lex->token != '[' && lex->token != '{') {
         error_set(error, lex, "'[' or '{' expected");
         return NULL;
     }
 
-    result = parse_value(lex, flags, error);
+    result = parse_value(lex, flags, lex->project ? lex->project_root : NULL,
+                         error);
     if(!result)
         return NULL;
 
@@ -844,36 +1462,12 @@ static json_t *parse_json(lex_t *lex, size_t flags, json_error_t *error)
     return result;
 }
 
-typedef struct
-{
-    const char *data;
-    int pos;
-} string_data_t;
-
-static int string_get(void *data)
-{
-    char c;
-    string_data_t *stream = (string_data_t *)data;
-    c = stream->data[stream->pos];
-    if(c == '\0')
-        return EOF;
-    else
-    {
-        stream->pos++;
-        return (unsigned char)c;
-    }
-}
-
 json_t *json_loads(const char *string, size_t flags, json_error_t *error)
 {
     lex_t lex;
     json_t *result;
-    string_data_t stream_data;
-
-    stream_data.data = string;
-    stream_data.pos = 0;
 
-    if(lex_init(&lex, string_get, (void *)&stream_data))
+    if(lex_init(&lex, string, string + strlen(string), NULL, NULL))
         return NULL;
 
     jsonp_error_init(error, "<string>");
@@ -883,36 +1477,12 @@ json_t *json_loads(const char *string, size_t flags, json_error_t *error)
     return result;
 }
 
-typedef struct
-{
-    const char *data;
-    size_t len;
-    size_t pos;
-} buffer_data_t;
-
-static int buffer_get(void *data)
-{
-    char c;
-    buffer_data_t *stream = (buffer_data_t *) data;
-    if(stream->pos >= stream->len)
-      return EOF;
-
-    c = stream->data[stream->pos];
-    stream->pos++;
-    return (unsigned char)c;
-}
-
 json_t *json_loadb(const char *buffer, size_t buflen, size_t flags, json_error_t *error)
 {
     lex_t lex;
     json_t *result;
-    buffer_data_t stream_data;
-
-    stream_data.data = buffer;
-    stream_data.pos = 0;
-    stream_data.len = buflen;
 
-    if(lex_init(&lex, buffer_get, (void *)&stream_data))
+    if(lex_init(&lex, buffer, buffer + buflen, NULL, NULL))
         return NULL;
 
     jsonp_error_init(error, "<buffer>");
@@ -922,13 +1492,39 @@ json_t *json_loadb(const char *buffer, size_t buflen, size_t flags, json_error_t
     return result;
 }
 
+/* json_loadf() must not read past the end of the document, so that the
+   caller can go on reading the file, and therefore fills one byte at
+   a time. json_stream_file() is the buffered alternative. */
+typedef struct
+{
+    FILE *input;
+    char byte;
+} file_data_t;
+
+static int file_fill(stream_t *stream)
+{
+    file_data_t *data = (file_data_t *)stream->data;
+    int c = fgetc(data->input);
+
+    if(c == EOF)
+        return -1;
+
+    data->byte = c;
+    stream->pos = &data->byte;
+    stream->end = stream->pos + 1;
+    stream->valid = stream->pos;
+    return 0;
+}
+
 json_t *json_loadf(FILE *input, size_t flags, json_error_t *error)
 {
     lex_t lex;
     const char *source;
     json_t *result;
+    file_data_t data;
 
-    if(lex_init(&lex, (get_func)fgetc, input))
+    data.input = input;
+    if(lex_init(&lex, NULL, NULL, file_fill, &data))
         return NULL;
 
     if(input == stdin)
@@ -963,3 +1559,174 @@ json_t *json_load_file(const char *path, size_t flags, json_error_t *error)
     fclose(fp);
     return result;
 }
+
+
+/*** buffered streams ***/
+
+static int callback_fill(stream_t *stream)
+{
+    json_stream_t *json_stream = (json_stream_t *)stream->data;
+    size_t len;
+
+    if(json_stream->eof)
+        return -1;
+
+    len = json_stream->callback(json_stream->buffer, JSON_STREAM_BUFFER_SIZE,
+                                json_stream->data);
+    if(len == 0 || len == (size_t)-1) {
+        json_stream->eof = 1;
+        return -1;
+    }
+
+    json_stream->offset += stream->end - json_stream->block;
+    json_stream->block = json_stream->buffer;
+    stream->pos = json_stream->buffer;
+    stream->end = json_stream->buffer + len;
+    stream->valid = stream->pos;
+    return 0;
+}
+
+static int buffer_fill(stream_t *stream)
+{
+    ((json_stream_t *)stream->data)->eof = 1;
+    return -1;
+}
+
+json_stream_t *json_stream_new(json_load_callback_t callback, void *data)
+{
+    json_stream_t *stream = jsonp_malloc(sizeof(json_stream_t));
+    if(!stream)
+        return NULL;
+
+    stream->callback = callback;
+    stream->data = data;
+    stream->offset = 0;
+    stream->eof = 0;
+    stream->buffer = jsonp_malloc(JSON_STREAM_BUFFER_SIZE);
+    if(!stream->buffer)
+        goto error;
+    stream->block = stream->buffer;
+
+    if(lex_init(&stream->lex, stream->buffer, stream->buffer,
+                callback_fill, stream))
+        goto error;
+
+    return stream;
+
+error:
+    jsonp_free(stream->buffer);
+    jsonp_free(stream);
+    return NULL;
+}
+
+static size_t file_read(void *buffer, size_t buflen, void *data)
+{
+    return fread(buffer, 1, buflen, (FILE *)data);
+}
+
+json_stream_t *json_stream_file(FILE *input)
+{
+    return json_stream_new(file_read, input);
+}
+
+json_stream_t *json_stream_buffer(const char *buffer, size_t buflen)
+{
+    json_stream_t *stream = jsonp_malloc(sizeof(json_stream_t));
+    if(!stream)
+        return NULL;
+
+    stream->callback = NULL;
+    stream->data = NULL;
+    stream->buffer = NULL;
+    stream->block = buffer;
+    stream->offset = 0;
+    stream->eof = 0;
+
+    if(lex_init(&stream->lex, buffer, buffer + buflen, buffer_fill, stream)) {
+        jsonp_free(stream);
+        return NULL;
+    }
+
+    return stream;
+}
+
+json_t *json_stream_load(json_stream_t *stream, size_t flags, json_error_t *error)
+{
+    lex_reset(&stream->lex);
+    jsonp_error_init(error, stream->callback ? "<stream>" : "<buffer>");
+    return parse_json(&stream->lex, flags, error);
+}
+
+int json_stream_skip_line(json_stream_t *stream)
+{
+    stream_t *s = &stream->lex.stream;
+    const char *newline;
+
+    while(1) {
+        newline = memchr(s->pos, '\n', s->end - s->pos);
+        if(newline) {
+            s->pos = newline + 1;
+            return 0;
+        }
+        s->pos = s->end;
+        if(s->fill(s))
+            return -1;
+    }
+}
+
+const char *json_stream_pending(const json_stream_t *stream, size_t *len)
+{
+    *len = stream->lex.stream.end - stream->lex.stream.pos;
+    return stream->lex.stream.pos;
+}
+
+size_t json_stream_tell(const json_stream_t *stream)
+{
+    return stream->offset + (stream->lex.stream.pos - stream->block);
+}
+
+int json_stream_seek(json_stream_t *stream, size_t offset)
+{
+    stream_t *s = &stream->lex.stream;
+
+    if(stream->callback || offset > (size_t)(s->end - stream->block))
+        return -1;
+
+    s->pos = stream->block + offset;
+    s->valid = s->pos;
+    stream->eof = 0;
+    return 0;
+}
+
+void json_stream_set_arena(json_stream_t *stream, json_arena_t *arena)
+{
+    stream->lex.arena = arena;
+}
+
+void json_stream_set_keys(json_stream_t *stream, json_keys_t *keys)
+{
+    stream->lex.keys = keys;
+}
+
+void json_stream_set_projection(json_stream_t *stream, json_project_t project,
+                                void *data, const void *root)
+{
+    stream->lex.project = project;
+    stream->lex.project_data = data;
+    stream->lex.project_root = root;
+}
+
+int json_stream_eof(const json_stream_t *stream)
+{
+    return stream->eof;
+}
+
+void json_stream_close(json_stream_t *stream)
+{
+    if(!stream)
+        return;
+
+    lex_close(&stream->lex);
+    jsonp_free(stream->buffer);
+    jsonp_free(stream);
+}
@@ -49,3 +49,105 @@ void json_set_alloc_funcs(json_malloc_t malloc_fn, json_free_t free_fn)
     do_malloc = malloc_fn;
     do_free = free_fn;
 }
+
+
+/*** arena ***/
+
+/* Size of the blocks an arena is carved from. Larger requests get a
+   block of their own. */
+#define ARENA_BLOCK_SIZE  65536
+
+/* Alignment of the pointers handed out by jsonp_arena_alloc() */
+#define ARENA_ALIGN  16
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+};
+
+/* Blocks are chained in the order they were first used. A reset
+   rewinds to the first block and refills the chain from there, so an
+   arena that is reused for documents of similar size stops calling
+   malloc after the first few. */
+struct json_arena_t {
+    struct arena_block *first;
+    struct arena_block *current;
+    char *pos;
+    char *end;
+};
+
+/* the block header, rounded up so the data after it is aligned */
+#define ARENA_HEADER_SIZE \
+    ((sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static void arena_use(json_arena_t *arena, struct arena_block *block)
+{
+    arena->current = block;
+    arena->pos = (char *)block + ARENA_HEADER_SIZE;
+    arena->end = arena->pos + block->size;
+}
+
+json_arena_t *json_arena_new(void)
+{
+    json_arena_t *arena = jsonp_malloc(sizeof(json_arena_t));
+    if(!arena)
+        return NULL;
+
+    arena->first = arena->current = NULL;
+    arena->pos = arena->end = NULL;
+    return arena;
+}
+
+void *jsonp_arena_alloc(json_arena_t *arena, size_t size)
+{
+    struct arena_block *block, *next;
+    char *result;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if(size > (size_t)(arena->end - arena->pos)) {
+        /* move on to the next block of the chain if it is big
+           enough, or put a new one in front of it */
+        next = arena->current ? arena->current->next : arena->first;
+        if(next && next->size >= size)
+            block = next;
+        else {
+            size_t block_size = max(size, ARENA_BLOCK_SIZE);
+            block = jsonp_malloc(ARENA_HEADER_SIZE + block_size);
+            if(!block)
+                return NULL;
+            block->size = block_size;
+            block->next = next;
+            if(arena->current)
+                arena->current->next = block;
+            else
+                arena->first = block;
+        }
+        arena_use(arena, block);
+    }
+
+    result = arena->pos;
+    arena->pos += size;
+    return result;
+}
+
+void json_arena_reset(json_arena_t *arena)
+{
+    if(!arena || !arena->first)
+        return;
+
+    arena_use(arena, arena->first);
+}
+
+void json_arena_free(json_arena_t *arena)
+{
+    struct arena_block *block, *next;
+
+    if(!arena)
+        return;
+
+    for(block = arena->first; block; block = next) {
+        next = block->next;
+        jsonp_free(block);
+    }
+    jsonp_free(arena);
+}
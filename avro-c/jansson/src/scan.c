@@ -0,0 +1,540 @@
+/*
+ * Copyright (c) 2009-2011 Petri Lehtinen <petri@digip.org>
+ *
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <jansson.h>
+#include "scan.h"
+#include "utf.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SCAN_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_AVX2
+#include <immintrin.h>
+#endif
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define SCAN_NEON
+#include <arm_neon.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static JSON_INLINE int scan_ctz(unsigned int x)
+{
+    unsigned long i;
+    _BitScanForward(&i, x);
+    return (int)i;
+}
+#else
+#define scan_ctz(x) __builtin_ctz(x)
+#endif
+
+typedef size_t (*scan_func)(const char *data, size_t len);
+
+
+/*** UTF-8 lookup tables ***/
+
+/* The vector UTF-8 validators classify each byte together with the one
+   before it, by looking up the high and low nibble of the first and
+   the high nibble of the second in three tables. The pair is an error
+   if all three results have a bit in common, except that a
+   continuation after a continuation is fine where a 3- or 4-byte
+   sequence expects it (Keiser and Lemire, "Validating UTF-8 In Less
+   Than One Instruction Per Byte"). */
+
+#define TOO_SHORT       (1 << 0)  /* lead byte without its continuation */
+#define TOO_LONG        (1 << 1)  /* continuation after an ASCII byte */
+#define OVERLONG_3      (1 << 2)
+#define TOO_LARGE       (1 << 3)
+#define SURROGATE       (1 << 4)
+#define OVERLONG_2      (1 << 5)
+#define TOO_LARGE_1000  (1 << 6)
+#define OVERLONG_4      (1 << 6)
+#define TWO_CONTS       (1 << 7)  /* continuation after a continuation */
+#define CARRY           (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#if defined(SCAN_AVX2) || defined(SCAN_NEON)
+static const unsigned char utf8_byte1_high[16] = {
+    /* 0_______ ASCII */
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    /* 10______ continuation */
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    /* 1100____ and 1101____, two byte lead */
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    /* 1110____, three byte lead */
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    /* 1111____, four byte lead */
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+};
+
+static const unsigned char utf8_byte1_low[16] = {
+    /* ____0000 */
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    /* ____0001 */
+    CARRY | OVERLONG_2,
+    /* ____001_ */
+    CARRY,
+    CARRY,
+    /* ____0100 */
+    CARRY | TOO_LARGE,
+    /* ____0101 to ____1100 */
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    /* ____1101 */
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    /* ____111_ */
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000
+};
+
+static const unsigned char utf8_byte2_high[16] = {
+    /* 0_______ */
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    /* 1000____ */
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    /* 1001____ */
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    /* 101_____ */
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    /* 11______ */
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+};
+
+/* A block ends inside a sequence if one of its last three bytes
+   exceeds these */
+static const unsigned char utf8_incomplete_max[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1
+};
+#endif
+
+
+/*** plain C ***/
+
+static size_t scan_string_c(const char *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    size_t i;
+
+    for(i = 0; i < len; i++) {
+        unsigned char c = p[i];
+        if(c < 0x20 || c >= 0x80 || c == '"' || c == '\\')
+            break;
+    }
+    return i;
+}
+
+static size_t scan_space_c(const char *data, size_t len)
+{
+    size_t i;
+
+    for(i = 0; i < len; i++) {
+        char c = data[i];
+        if(c != ' ' && c != '\t' && c != '\n' && c != '\r')
+            break;
+    }
+    return i;
+}
+
+/* Length of the valid UTF-8 sequence at data[i], or 0 */
+static JSON_INLINE size_t scan_utf8_seq(const char *data, size_t len, size_t i)
+{
+    int count = utf8_check_first(data[i]);
+
+    if(count == 1)
+        return 1;
+    if(!count || (size_t)count > len - i ||
+       !utf8_check_full(data + i, count, NULL))
+        return 0;
+    return count;
+}
+
+/* Check the sequences that start in data[i..stop) */
+static size_t scan_utf8_from(const char *data, size_t len, size_t i, size_t stop)
+{
+    size_t n;
+
+    while(i < stop && (n = scan_utf8_seq(data, len, i)))
+        i += n;
+    return i;
+}
+
+/* The vector validators check whole blocks and stop at the first one
+   with an error in it. The blocks before data[i] are fine, apart from
+   a sequence that may run into the failed block, so back up to its
+   start and find the exact stop from there. */
+static size_t scan_utf8_resume(const char *data, size_t len, size_t i)
+{
+    if(i > 0) {
+        i--;
+        while(i > 0 && ((unsigned char)data[i] & 0xC0) == 0x80)
+            i--;
+    }
+    return scan_utf8_from(data, len, i, len);
+}
+
+static size_t scan_utf8_c(const char *data, size_t len)
+{
+    const size_t high_bits = (size_t)-1 / 0xFF * 0x80;
+    size_t i = 0, n, word;
+
+    while(i < len) {
+        if(i + sizeof(word) <= len) {
+            memcpy(&word, data + i, sizeof(word));
+            if(!(word & high_bits)) {
+                i += sizeof(word);
+                continue;
+            }
+        }
+        n = scan_utf8_seq(data, len, i);
+        if(!n)
+            break;
+        i += n;
+    }
+    return i;
+}
+
+
+/*** SSE2 and AVX2 ***/
+
+#ifdef SCAN_SSE2
+static size_t scan_string_sse2(const char *data, size_t len)
+{
+    const __m128i ctrl = _mm_set1_epi8(0x20);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    size_t i;
+
+    for(i = 0; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        /* a signed compare also catches bytes >= 0x80 */
+        __m128i stop = _mm_or_si128(_mm_cmplt_epi8(v, ctrl),
+                                    _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                                 _mm_cmpeq_epi8(v, backslash)));
+        int mask = _mm_movemask_epi8(stop);
+        if(mask)
+            return i + scan_ctz(mask);
+    }
+    return i + scan_string_c(data + i, len - i);
+}
+
+static size_t scan_space_sse2(const char *data, size_t len)
+{
+    size_t i;
+
+    for(i = 0; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i space = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+        int mask = _mm_movemask_epi8(space);
+        if(mask != 0xFFFF)
+            return i + scan_ctz(~mask);
+    }
+    return i + scan_space_c(data + i, len - i);
+}
+
+/* SSE2 has no byte shuffle for the lookup tables, so it only skips
+   ASCII blocks and checks the rest like the C version */
+static size_t scan_utf8_sse2(const char *data, size_t len)
+{
+    size_t i = 0, end;
+
+    while(i + 16 <= len) {
+        if(!_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(data + i)))) {
+            i += 16;
+            continue;
+        }
+        end = scan_utf8_from(data, len, i, i + 16);
+        if(end < i + 16)
+            return end;
+        i = end;
+    }
+    return scan_utf8_from(data, len, i, len);
+}
+#endif
+
+#ifdef SCAN_AVX2
+__attribute__((target("avx2")))
+static size_t scan_string_avx2(const char *data, size_t len)
+{
+    const __m256i ctrl = _mm256_set1_epi8(0x20);
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    size_t i;
+
+    for(i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i stop = _mm256_or_si256(_mm256_cmpgt_epi8(ctrl, v),
+                                       _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                                       _mm256_cmpeq_epi8(v, backslash)));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(stop);
+        if(mask)
+            return i + scan_ctz(mask);
+    }
+    return i + scan_string_sse2(data + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_space_avx2(const char *data, size_t len)
+{
+    size_t i;
+
+    for(i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i space = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(space);
+        if(mask != 0xFFFFFFFFu)
+            return i + scan_ctz(~mask);
+    }
+    return i + scan_space_sse2(data + i, len - i);
+}
+
+/* the 32 bytes that end n bytes into in, following prev */
+#define AVX2_PREV(in, prev, n) \
+    _mm256_alignr_epi8(in, _mm256_permute2x128_si256(prev, in, 0x21), 16 - (n))
+
+__attribute__((target("avx2")))
+static size_t scan_utf8_avx2(const char *data, size_t len)
+{
+    const __m256i byte1_high = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)utf8_byte1_high));
+    const __m256i byte1_low = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)utf8_byte1_low));
+    const __m256i byte2_high = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)utf8_byte2_high));
+    const __m256i incomplete_max =
+        _mm256_loadu_si256((const __m256i *)utf8_incomplete_max);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i prev = zero, prev_incomplete = zero, error;
+    size_t i;
+
+    for(i = 0; i + 32 <= len; i += 32) {
+        __m256i in = _mm256_loadu_si256((const __m256i *)(data + i));
+
+        if(!_mm256_movemask_epi8(in))
+            error = prev_incomplete;
+        else {
+            __m256i prev1 = AVX2_PREV(in, prev, 1);
+            __m256i special = _mm256_and_si256(
+                _mm256_and_si256(
+                    _mm256_shuffle_epi8(byte1_high,
+                        _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+                    _mm256_shuffle_epi8(byte1_low,
+                        _mm256_and_si256(prev1, nibble))),
+                _mm256_shuffle_epi8(byte2_high,
+                    _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble)));
+            /* positions that must hold the 3rd or 4th byte of a sequence */
+            __m256i third = _mm256_subs_epu8(AVX2_PREV(in, prev, 2),
+                                             _mm256_set1_epi8((char)(0xE0 - 1)));
+            __m256i fourth = _mm256_subs_epu8(AVX2_PREV(in, prev, 3),
+                                              _mm256_set1_epi8((char)(0xF0 - 1)));
+            __m256i must23 = _mm256_and_si256(
+                _mm256_cmpgt_epi8(_mm256_or_si256(third, fourth), zero),
+                _mm256_set1_epi8((char)0x80));
+
+            error = _mm256_xor_si256(must23, special);
+            prev_incomplete = _mm256_subs_epu8(in, incomplete_max);
+        }
+        if(!_mm256_testz_si256(error, error))
+            break;
+        prev = in;
+    }
+    return scan_utf8_resume(data, len, i);
+}
+#endif
+
+
+/*** NEON ***/
+
+#ifdef SCAN_NEON
+/* index of the first nonzero byte of a compare result, or 16 */
+static JSON_INLINE size_t scan_neon_first(uint8x16_t stop)
+{
+    uint64_t mask;
+
+    if(!vmaxvq_u8(stop))
+        return 16;
+    /* narrow every byte to a nibble */
+    mask = vget_lane_u64(vreinterpret_u64_u8(
+               vshrn_n_u16(vreinterpretq_u16_u8(stop), 4)), 0);
+    return __builtin_ctzll(mask) >> 2;
+}
+
+static size_t scan_string_neon(const char *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    size_t i, n;
+
+    for(i = 0; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8(p + i);
+        uint8x16_t stop = vorrq_u8(
+            vorrq_u8(vcltq_u8(v, vdupq_n_u8(0x20)),
+                     vcgeq_u8(v, vdupq_n_u8(0x80))),
+            vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')),
+                     vceqq_u8(v, vdupq_n_u8('\\'))));
+        n = scan_neon_first(stop);
+        if(n < 16)
+            return i + n;
+    }
+    return i + scan_string_c(data + i, len - i);
+}
+
+static size_t scan_space_neon(const char *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    size_t i, n;
+
+    for(i = 0; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8(p + i);
+        uint8x16_t space = vorrq_u8(
+            vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')),
+                     vceqq_u8(v, vdupq_n_u8('\t'))),
+            vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')),
+                     vceqq_u8(v, vdupq_n_u8('\r'))));
+        n = scan_neon_first(vmvnq_u8(space));
+        if(n < 16)
+            return i + n;
+    }
+    return i + scan_space_c(data + i, len - i);
+}
+
+static size_t scan_utf8_neon(const char *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8x16_t byte1_high = vld1q_u8(utf8_byte1_high);
+    const uint8x16_t byte1_low = vld1q_u8(utf8_byte1_low);
+    const uint8x16_t byte2_high = vld1q_u8(utf8_byte2_high);
+    const uint8x16_t incomplete_max = vld1q_u8(utf8_incomplete_max + 16);
+    uint8x16_t prev = vdupq_n_u8(0), prev_incomplete = vdupq_n_u8(0), error;
+    size_t i;
+
+    for(i = 0; i + 16 <= len; i += 16) {
+        uint8x16_t in = vld1q_u8(p + i);
+
+        if(vmaxvq_u8(in) < 0x80)
+            error = prev_incomplete;
+        else {
+            uint8x16_t prev1 = vextq_u8(prev, in, 15);
+            uint8x16_t special = vandq_u8(
+                vandq_u8(vqtbl1q_u8(byte1_high, vshrq_n_u8(prev1, 4)),
+                         vqtbl1q_u8(byte1_low, vandq_u8(prev1, vdupq_n_u8(0x0F)))),
+                vqtbl1q_u8(byte2_high, vshrq_n_u8(in, 4)));
+            /* positions that must hold the 3rd or 4th byte of a sequence */
+            uint8x16_t third = vqsubq_u8(vextq_u8(prev, in, 14),
+                                         vdupq_n_u8(0xE0 - 1));
+            uint8x16_t fourth = vqsubq_u8(vextq_u8(prev, in, 13),
+                                          vdupq_n_u8(0xF0 - 1));
+            uint8x16_t must23 = vandq_u8(
+                vcgtq_u8(vorrq_u8(third, fourth), vdupq_n_u8(0)),
+                vdupq_n_u8(0x80));
+
+            error = veorq_u8(must23, special);
+            prev_incomplete = vqsubq_u8(in, incomplete_max);
+        }
+        if(vmaxvq_u8(error))
+            break;
+        prev = in;
+    }
+    return scan_utf8_resume(data, len, i);
+}
+#endif
+
+
+/*** dispatch ***/
+
+static size_t scan_string_first(const char *data, size_t len);
+static size_t scan_space_first(const char *data, size_t len);
+static size_t scan_utf8_first(const char *data, size_t len);
+
+static scan_func scan_string = scan_string_first;
+static scan_func scan_space = scan_space_first;
+static scan_func scan_utf8 = scan_utf8_first;
+
+/* Every thread that gets here stores the same pointers, so there is
+   nothing to lock */
+static void scan_select(void)
+{
+    scan_func string = scan_string_c, space = scan_space_c;
+    scan_func utf8 = scan_utf8_c;
+
+#if defined(SCAN_SSE2)
+    string = scan_string_sse2;
+    space = scan_space_sse2;
+    utf8 = scan_utf8_sse2;
+#if defined(SCAN_AVX2)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        string = scan_string_avx2;
+        space = scan_space_avx2;
+        utf8 = scan_utf8_avx2;
+    }
+#endif
+#elif defined(SCAN_NEON)
+    string = scan_string_neon;
+    space = scan_space_neon;
+    utf8 = scan_utf8_neon;
+#endif
+
+    scan_string = string;
+    scan_space = space;
+    scan_utf8 = utf8;
+}
+
+static size_t scan_string_first(const char *data, size_t len)
+{
+    scan_select();
+    return scan_string(data, len);
+}
+
+static size_t scan_space_first(const char *data, size_t len)
+{
+    scan_select();
+    return scan_space(data, len);
+}
+
+static size_t scan_utf8_first(const char *data, size_t len)
+{
+    scan_select();
+    return scan_utf8(data, len);
+}
+
+size_t jsonp_scan_string(const char *data, size_t len)
+{
+    return scan_string(data, len);
+}
+
+size_t jsonp_scan_space(const char *data, size_t len)
+{
+    return scan_space(data, len);
+}
+
+size_t jsonp_scan_utf8(const char *data, size_t len)
+{
+    return scan_utf8(data, len);
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2009-2011 Petri Lehtinen <petri@digip.org>
+ *
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef SCAN_H
+#define SCAN_H
+#ifdef __cplusplus
+extern "C" {
+#define CLOSE_EXTERN }
+#else
+#define CLOSE_EXTERN
+#endif
+
+#include <stddef.h>
+
+/* Block scanners for the lexer. Each returns the length of the run of
+   bytes at the start of data[0..len) that it accepts. The SSE2, AVX2 or
+   NEON version is picked on first use, with a plain C fallback. */
+
+/* printable ASCII other than '"' and '\\' */
+size_t jsonp_scan_string(const char *data, size_t len);
+
+/* ' ', '\t', '\n' and '\r' */
+size_t jsonp_scan_space(const char *data, size_t len);
+
+/* complete, valid UTF-8 sequences; stops at the first invalid or
+   truncated one */
+size_t jsonp_scan_utf8(const char *data, size_t len);
+
+CLOSE_EXTERN
+#endif
@@ -136,16 +136,16 @@ int utf8_check_full(const char *buffer, int size, int32_t *codepoint)
     return 1;
 }
 
-const char *utf8_iterate(const char *buffer, int32_t *codepoint)
+const char *utf8_iterate(const char *buffer, size_t size, int32_t *codepoint)
 {
     int count;
     int32_t value;
 
-    if(!*buffer)
+    if(!size)
         return buffer;
 
     count = utf8_check_first(buffer[0]);
-    if(count <= 0)
+    if(count <= 0 || (size_t)count > size)
         return NULL;
 
     if(count == 1)
@@ -17,10 +17,26 @@
 #include "utf.h"
 
 
-static JSON_INLINE void json_init(json_t *json, json_type type)
+/* Values in an arena are immortal, like true, false and null: they
+   go away all at once when the arena is reset or freed. */
+static JSON_INLINE void json_init(json_t *json, json_type type,
+                                  json_arena_t *arena)
 {
     json->type = type;
-    json->refcount = 1;
+    json->refcount = arena ? (size_t)-1 : 1;
+}
+
+static JSON_INLINE void *value_alloc(json_arena_t *arena, size_t size)
+{
+    if(arena)
+        return jsonp_arena_alloc(arena, size);
+    return jsonp_malloc(size);
+}
+
+static JSON_INLINE void value_free(json_arena_t *arena, void *ptr)
+{
+    if(!arena)
+        jsonp_free(ptr);
 }
 
 
@@ -48,49 +64,46 @@ int jsonp_str_equal(const void *ptr1, const void *ptr2)
     return strcmp((const char *)ptr1, (const char *)ptr2) == 0;
 }
 
-/* This macro just returns a pointer that's a few bytes backwards from
-   string. This makes it possible to pass a pointer to object_key_t
-   when only the string inside it is used, without actually creating
-   an object_key_t instance. */
-#define string_to_key(string)  container_of(string, object_key_t, key)
-
-static size_t hash_key(const void *ptr)
+static void value_decref(void *value)
 {
-    return jsonp_hash_str(((const object_key_t *)ptr)->key);
+    json_decref((json_t *)value);
 }
 
-static int key_equal(const void *ptr1, const void *ptr2)
-{
-    return jsonp_str_equal(((const object_key_t *)ptr1)->key,
-                           ((const object_key_t *)ptr2)->key);
-}
+#define string_to_key(string)  container_of(string, object_key_t, key)
 
-static void value_decref(void *value)
+static void object_key_free(void *key)
 {
-    json_decref((json_t *)value);
+    object_key_t *k = string_to_key(key);
+    if(!k->interned)
+        jsonp_free(k);
 }
 
-json_t *json_object(void)
+json_t *jsonp_object(json_arena_t *arena)
 {
-    json_object_t *object = (json_object_t *) jsonp_malloc(sizeof(json_object_t));
+    json_object_t *object = (json_object_t *) value_alloc(arena, sizeof(json_object_t));
     if(!object)
         return NULL;
-    json_init(&object->json, JSON_OBJECT);
+    json_init(&object->json, JSON_OBJECT, arena);
 
-    if(hashtable_init(&object->hashtable,
-                      hash_key, key_equal,
-                      jsonp_free, value_decref))
+    if(hashtable_init(&object->hashtable, arena,
+                      jsonp_hash_str, jsonp_str_equal,
+                      arena ? NULL : object_key_free, value_decref))
     {
-        jsonp_free(object);
+        value_free(arena, object);
         return NULL;
     }
 
-    object->serial = 0;
     object->visited = 0;
+    object->arena = arena;
 
     return &object->json;
 }
 
+json_t *json_object(void)
+{
+    return jsonp_object(NULL);
+}
+
 static void json_delete_object(json_object_t *object)
 {
     hashtable_close(&object->hashtable);
@@ -116,44 +129,72 @@ json_t *json_object_get(const json_t *json, const char *key)
         return NULL;
 
     object = json_to_object(json);
-    return (json_t *) hashtable_get(&object->hashtable, string_to_key(key));
+    return (json_t *) hashtable_get(&object->hashtable, key);
 }
 
-int json_object_set_new_nocheck(json_t *json, const char *key, json_t *value)
+size_t json_object_key_hash(const char *key)
+{
+    return jsonp_hash_str(key);
+}
+
+json_t *json_object_get_hashed(const json_t *json, const char *key, size_t hash)
 {
     json_object_t *object;
-    object_key_t *k;
 
-    if(!key || !value)
-        return -1;
+    if(!json_is_object(json))
+        return NULL;
 
-    if(!json_is_object(json) || json == value)
+    object = json_to_object(json);
+    return (json_t *) hashtable_get_hashed(&object->hashtable, key, hash);
+}
+
+int jsonp_object_set_key(json_t *json, const char *key, size_t hash,
+                         int interned, json_t *value)
+{
+    json_object_t *object = json_to_object(json);
+    object_key_t *k = NULL;
+
+    if(!interned)
     {
-        json_decref(value);
-        return -1;
+        /* offsetof(...) returns the size of object_key_t without the
+           last, flexible member. This way, the correct amount is
+           allocated. */
+        size_t len = strlen(key) + 1;
+        k = (object_key_t *) value_alloc(object->arena,
+                                         offsetof(object_key_t, key) + len);
+        if(!k)
+        {
+            json_decref(value);
+            return -1;
+        }
+
+        k->interned = 0;
+        memcpy(k->key, key, len);
+        key = k->key;
     }
-    object = json_to_object(json);
 
-    /* offsetof(...) returns the size of object_key_t without the
-       last, flexible member. This way, the correct amount is
-       allocated. */
-    k = (object_key_t *) jsonp_malloc(offsetof(object_key_t, key) + strlen(key) + 1);
-    if(!k)
+    if(hashtable_set_hashed(&object->hashtable, (void *)key, hash, value))
     {
+        value_free(object->arena, k);
         json_decref(value);
         return -1;
     }
 
-    k->serial = object->serial++;
-    strcpy(k->key, key);
+    return 0;
+}
+
+int json_object_set_new_nocheck(json_t *json, const char *key, json_t *value)
+{
+    if(!key || !value)
+        return -1;
 
-    if(hashtable_set(&object->hashtable, k, value))
+    if(!json_is_object(json) || json == value)
     {
         json_decref(value);
         return -1;
     }
 
-    return 0;
+    return jsonp_object_set_key(json, key, jsonp_hash_str(key), 0, value);
 }
 
 int json_object_set_new(json_t *json, const char *key, json_t *value)
@@ -175,7 +216,7 @@ int json_object_del(json_t *json, const char *key)
         return -1;
 
     object = json_to_object(json);
-    return hashtable_del(&object->hashtable, string_to_key(key));
+    return hashtable_del(&object->hashtable, key);
 }
 
 int json_object_clear(json_t *json)
@@ -234,7 +275,7 @@ void *json_object_iter_at(json_t *json, const char *key)
         return NULL;
 
     object = json_to_object(json);
-    return hashtable_iter_at(&object->hashtable, string_to_key(key));
+    return hashtable_iter_at(&object->hashtable, key);
 }
 
 void *json_object_iter_next(json_t *json, void *iter)
@@ -248,20 +289,12 @@ void *json_object_iter_next(json_t *json, void *iter)
     return hashtable_iter_next(&object->hashtable, iter);
 }
 
-const object_key_t *jsonp_object_iter_fullkey(void *iter)
-{
-    if(!iter)
-        return NULL;
-
-    return (const object_key_t *) hashtable_iter_key(iter);
-}
-
 const char *json_object_iter_key(void *iter)
 {
     if(!iter)
         return NULL;
 
-    return jsonp_object_iter_fullkey(iter)->key;
+    return (const char *) hashtable_iter_key(iter);
 }
 
 json_t *json_object_iter_value(void *iter)
@@ -362,29 +395,132 @@ static json_t *json_object_deep_copy(json_t *object)
 }
 
 
+/*** key table ***/
+
+/* How many keys a stream adds to a table by itself. Inputs with
+   unbounded sets of keys (e.g. maps keyed by ID) stop growing the
+   table here and get their keys copied as usual. */
+#define JSON_KEYS_MAX  4096
+
+struct json_keys_t {
+    hashtable_t hashtable;  /* maps every interned key to itself */
+    int frozen;
+};
+
+static void interned_key_free(void *key)
+{
+    jsonp_free(string_to_key(key));
+}
+
+json_keys_t *json_keys_new(void)
+{
+    json_keys_t *keys = (json_keys_t *) jsonp_malloc(sizeof(json_keys_t));
+    if(!keys)
+        return NULL;
+
+    if(hashtable_init(&keys->hashtable, NULL, jsonp_hash_str, jsonp_str_equal,
+                      interned_key_free, NULL))
+    {
+        jsonp_free(keys);
+        return NULL;
+    }
+
+    keys->frozen = 0;
+    return keys;
+}
+
+static const char *keys_add(json_keys_t *keys, const char *key, size_t hash)
+{
+    size_t len = strlen(key) + 1;
+    object_key_t *k;
+
+    k = (object_key_t *) jsonp_malloc(offsetof(object_key_t, key) + len);
+    if(!k)
+        return NULL;
+
+    k->interned = 1;
+    memcpy(k->key, key, len);
+
+    if(hashtable_set_hashed(&keys->hashtable, k->key, hash, k->key))
+    {
+        jsonp_free(k);
+        return NULL;
+    }
+
+    return k->key;
+}
+
+const char *jsonp_keys_find(json_keys_t *keys, const char *key, size_t hash)
+{
+    const char *interned;
+
+    interned = (const char *) hashtable_get_hashed(&keys->hashtable, key, hash);
+    if(interned || keys->frozen || keys->hashtable.size >= JSON_KEYS_MAX)
+        return interned;
+
+    return keys_add(keys, key, hash);
+}
+
+const char *json_keys_intern(json_keys_t *keys, const char *key)
+{
+    const char *interned;
+    size_t hash;
+
+    if(!keys || !key || !utf8_check_string(key, -1))
+        return NULL;
+
+    hash = jsonp_hash_str(key);
+    interned = (const char *) hashtable_get_hashed(&keys->hashtable, key, hash);
+    if(interned)
+        return interned;
+
+    return keys_add(keys, key, hash);
+}
+
+void json_keys_freeze(json_keys_t *keys)
+{
+    keys->frozen = 1;
+}
+
+void json_keys_free(json_keys_t *keys)
+{
+    if(!keys)
+        return;
+
+    hashtable_close(&keys->hashtable);
+    jsonp_free(keys);
+}
+
+
 /*** array ***/
 
-json_t *json_array(void)
+json_t *jsonp_array(json_arena_t *arena)
 {
-    json_array_t *array = (json_array_t *) jsonp_malloc(sizeof(json_array_t));
+    json_array_t *array = (json_array_t *) value_alloc(arena, sizeof(json_array_t));
     if(!array)
         return NULL;
-    json_init(&array->json, JSON_ARRAY);
+    json_init(&array->json, JSON_ARRAY, arena);
 
     array->entries = 0;
     array->size = 8;
 
-    array->table = (json_t **) jsonp_malloc(array->size * sizeof(json_t *));
+    array->table = (json_t **) value_alloc(arena, array->size * sizeof(json_t *));
     if(!array->table) {
-        jsonp_free(array);
+        value_free(arena, array);
         return NULL;
     }
 
     array->visited = 0;
+    array->arena = arena;
 
     return &array->json;
 }
 
+json_t *json_array(void)
+{
+    return jsonp_array(NULL);
+}
+
 static void json_delete_array(json_array_t *array)
 {
     size_t i;
@@ -469,7 +605,7 @@ static json_t **json_array_grow(json_array_t *array,
     old_table = array->table;
 
     new_size = max(array->size + amount, array->size * 2);
-    new_table = (json_t **) jsonp_malloc(new_size * sizeof(json_t *));
+    new_table = (json_t **) value_alloc(array->arena, new_size * sizeof(json_t *));
     if(!new_table)
         return NULL;
 
@@ -478,7 +614,7 @@ static json_t **json_array_grow(json_array_t *array,
 
     if(copy) {
         array_copy(array->table, 0, old_table, 0, array->entries);
-        jsonp_free(old_table);
+        value_free(array->arena, old_table);
         return array->table;
     }
 
@@ -539,7 +675,7 @@ int json_array_insert_new(json_t *json, size_t index, json_t *value)
         array_copy(array->table, 0, old_table, 0, index);
         array_copy(array->table, index + 1, old_table, index,
                    array->entries - index);
-        jsonp_free(old_table);
+        value_free(array->arena, old_table);
     }
     else
         array_move(array, index + 1, index, array->entries - index);
@@ -661,27 +797,48 @@ static json_t *json_array_deep_copy(json_t *array)
 
 /*** string ***/
 
-json_t *json_string_nocheck(const char *value)
+json_t *jsonp_string_own(json_arena_t *arena, char *value, size_t len)
 {
     json_string_t *string;
 
     if(!value)
         return NULL;
 
-    string = (json_string_t *) jsonp_malloc(sizeof(json_string_t));
-    if(!string)
-        return NULL;
-    json_init(&string->json, JSON_STRING);
-
-    string->value = jsonp_strdup(value);
-    if(!string->value) {
-        jsonp_free(string);
+    string = (json_string_t *) value_alloc(arena, sizeof(json_string_t));
+    if(!string) {
+        value_free(arena, value);
         return NULL;
     }
+    json_init(&string->json, JSON_STRING, arena);
 
+    string->value = value;
+    string->length = len;
     return &string->json;
 }
 
+/* Copy len bytes of value, which may include NULs, and terminate them */
+static char *string_dup(const char *value, size_t len)
+{
+    char *dup = (char *) jsonp_malloc(len + 1);
+    if(!dup)
+        return NULL;
+
+    memcpy(dup, value, len);
+    dup[len] = '\0';
+    return dup;
+}
+
+json_t *json_string_nocheck(const char *value)
+{
+    size_t len;
+
+    if(!value)
+        return NULL;
+
+    len = strlen(value);
+    return jsonp_string_own(NULL, string_dup(value, len), len);
+}
+
 json_t *json_string(const char *value)
 {
     if(!value || !utf8_check_string(value, -1))
@@ -698,18 +855,33 @@ const char *json_string_value(const json_t *json)
     return json_to_string(json)->value;
 }
 
+size_t json_string_length(const json_t *json)
+{
+    if(!json_is_string(json))
+        return 0;
+
+    return json_to_string(json)->length;
+}
+
 int json_string_set_nocheck(json_t *json, const char *value)
 {
     char *dup;
+    size_t len;
     json_string_t *string;
 
-    dup = jsonp_strdup(value);
+    /* the value of a string in an arena isn't ours to free */
+    if(json->refcount == (size_t)-1)
+        return -1;
+
+    len = strlen(value);
+    dup = string_dup(value, len);
     if(!dup)
         return -1;
 
     string = json_to_string(json);
     jsonp_free(string->value);
     string->value = dup;
+    string->length = len;
 
     return 0;
 }
@@ -730,28 +902,39 @@ static void json_delete_string(json_string_t *string)
 
 static int json_string_equal(json_t *string1, json_t *string2)
 {
-    return strcmp(json_string_value(string1), json_string_value(string2)) == 0;
+    json_string_t *s1 = json_to_string(string1);
+    json_string_t *s2 = json_to_string(string2);
+
+    return s1->length == s2->length &&
+           memcmp(s1->value, s2->value, s1->length) == 0;
 }
 
 static json_t *json_string_copy(json_t *string)
 {
-    return json_string_nocheck(json_string_value(string));
+    json_string_t *s = json_to_string(string);
+
+    return jsonp_string_own(NULL, string_dup(s->value, s->length), s->length);
 }
 
 
 /*** integer ***/
 
-json_t *json_integer(json_int_t value)
+json_t *jsonp_integer(json_arena_t *arena, json_int_t value)
 {
-    json_integer_t *integer = (json_integer_t *) jsonp_malloc(sizeof(json_integer_t));
+    json_integer_t *integer = (json_integer_t *) value_alloc(arena, sizeof(json_integer_t));
     if(!integer)
         return NULL;
-    json_init(&integer->json, JSON_INTEGER);
+    json_init(&integer->json, JSON_INTEGER, arena);
 
     integer->value = value;
     return &integer->json;
 }
 
+json_t *json_integer(json_int_t value)
+{
+    return jsonp_integer(NULL, value);
+}
+
 json_int_t json_integer_value(const json_t *json)
 {
     if(!json_is_integer(json))
@@ -788,17 +971,22 @@ static json_t *json_integer_copy(json_t *integer)
 
 /*** real ***/
 
-json_t *json_real(double value)
+json_t *jsonp_real(json_arena_t *arena, double value)
 {
-    json_real_t *real = (json_real_t *) jsonp_malloc(sizeof(json_real_t));
+    json_real_t *real = (json_real_t *) value_alloc(arena, sizeof(json_real_t));
     if(!real)
         return NULL;
-    json_init(&real->json, JSON_REAL);
+    json_init(&real->json, JSON_REAL, arena);
 
     real->value = value;
     return &real->json;
 }
 
+json_t *json_real(double value)
+{
+    return jsonp_real(NULL, value);
+}
+
 double json_real_value(const json_t *json)
 {
     if(!json_is_real(json))
@@ -51,6 +51,7 @@ int main(int argc, char *argv[])
 {
     int indent = 0;
     size_t flags = 0;
+    size_t load_flags = 0;
 
     json_t *json;
     json_error_t error;
@@ -81,6 +82,9 @@ int main(int argc, char *argv[])
     if(getenv_int("JSON_SORT_KEYS"))
         flags |= JSON_SORT_KEYS;
 
+    if(getenv_int("JSON_ALLOW_NUL"))
+        load_flags |= JSON_ALLOW_NUL;
+
     if(getenv_int("STRIP")) {
         /* Load to memory, strip leading and trailing whitespace */
         size_t size = 0, used = 0;
@@ -104,11 +108,11 @@ int main(int argc, char *argv[])
             used += count;
         }
 
-        json = json_loads(strip(buffer), 0, &error);
+        json = json_loads(strip(buffer), load_flags, &error);
         free(buffer);
     }
     else
-        json = json_loadf(stdin, 0, &error);
+        json = json_loadf(stdin, load_flags, &error);
 
     if(!json) {
         fprintf(stderr, "%d %d %d\n%s\n",
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2009-2011 Petri Lehtinen <petri@digip.org>
+ *
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <jansson.h>
+#include <string.h>
+#include "util.h"
+
+static int malloc_called = 0;
+static int free_called = 0;
+
+static void *my_malloc(size_t size)
+{
+    malloc_called += 1;
+    return malloc(size);
+}
+
+static void my_free(void *ptr)
+{
+    free_called += 1;
+    free(ptr);
+}
+
+/* Builds a text with more items and longer strings than a single
+   arena block holds, so that decoding it chains several blocks */
+static char *big_text(int n)
+{
+    char *text, *p;
+    int i;
+
+    text = malloc(n * 64 + 16);
+    if(!text)
+        fail("malloc failed");
+
+    p = text;
+    p += sprintf(p, "{\"n\": %d, \"items\": [", n);
+    for(i = 0; i < n; i++)
+        p += sprintf(p, "%s{\"i\": %d, \"s\": \"item %d\"}", i ? ", " : "", i, i);
+    strcpy(p, "]}\n");
+    return text;
+}
+
+static void check_big(json_t *json, int n)
+{
+    json_t *items, *item;
+    char expected[32];
+    int i;
+
+    if(!json)
+        fail("json_stream_load failed with an arena");
+    if(json_integer_value(json_object_get(json, "n")) != n)
+        fail("wrong value decoded into an arena");
+
+    items = json_object_get(json, "items");
+    if(json_array_size(items) != (size_t)n)
+        fail("wrong array size decoded into an arena");
+    for(i = 0; i < n; i++) {
+        item = json_array_get(items, i);
+        sprintf(expected, "item %d", i);
+        if(json_integer_value(json_object_get(item, "i")) != i ||
+           strcmp(json_string_value(json_object_get(item, "s")), expected))
+            fail("wrong item decoded into an arena");
+    }
+}
+
+static void test_reset()
+{
+    const int sizes[] = {3000, 10, 3000, 2500, 3000, 3000};
+    json_arena_t *arena;
+    json_error_t error;
+    json_t *json;
+    int i, mallocs = 0;
+
+    arena = json_arena_new();
+    if(!arena)
+        fail("json_arena_new failed");
+
+    for(i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        char *text = big_text(sizes[i]);
+        json_stream_t *stream = json_stream_buffer(text, strlen(text));
+
+        json_stream_set_arena(stream, arena);
+        json_arena_reset(arena);
+
+        malloc_called = 0;
+        json = json_stream_load(stream, 0, &error);
+        check_big(json, sizes[i]);
+        if(i == 0)
+            mallocs = malloc_called;
+
+        /* the blocks of the first, largest text are reused */
+        else if(malloc_called != 0)
+            fail("decoding into a reset arena allocated memory");
+
+        json_stream_close(stream);
+        free(text);
+    }
+
+    if(mallocs == 0)
+        fail("decoding into an empty arena did not allocate");
+
+    json_arena_free(arena);
+}
+
+static void test_several_documents()
+{
+    const char text[] =
+        "{\"a\": [1, 2.5, \"x\"]}\n"
+        "{\"b\": {\"c\": null, \"d\": true}}\n"
+        "[\"e\", {}]\n";
+    json_arena_t *arena;
+    json_stream_t *stream;
+    json_error_t error;
+    json_t *first, *second, *third;
+
+    arena = json_arena_new();
+    stream = json_stream_buffer(text, strlen(text));
+    json_stream_set_arena(stream, arena);
+
+    /* texts decoded without a reset in between stay valid together */
+    first = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    second = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    third = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(!first || !second || !third)
+        fail("json_stream_load failed with an arena");
+
+    if(json_real_value(json_array_get(json_object_get(first, "a"), 1)) != 2.5 ||
+       strcmp(json_string_value(json_array_get(json_object_get(first, "a"), 2)), "x") ||
+       !json_is_null(json_object_get(json_object_get(second, "b"), "c")) ||
+       !json_is_true(json_object_get(json_object_get(second, "b"), "d")) ||
+       strcmp(json_string_value(json_array_get(third, 0)), "e") ||
+       json_object_size(json_array_get(third, 1)) != 0)
+        fail("wrong values decoded into an arena");
+
+    json_stream_close(stream);
+    json_arena_free(arena);
+}
+
+static void test_refcount()
+{
+    const char text[] = "{\"s\": \"arena\", \"a\": [1, {\"b\": 2}], \"o\": {\"c\": \"d\"}}";
+    json_arena_t *arena;
+    json_stream_t *stream;
+    json_error_t error;
+    json_t *json, *string, *inner;
+
+    arena = json_arena_new();
+    stream = json_stream_buffer(text, strlen(text));
+    json_stream_set_arena(stream, arena);
+
+    json = json_stream_load(stream, 0, &error);
+    if(!json)
+        fail("json_stream_load failed with an arena");
+    string = json_object_get(json, "s");
+    inner = json_object_get(json, "o");
+
+    free_called = 0;
+    if(json_incref(json) != json)
+        fail("json_incref failed on an arena value");
+    json_decref(json);
+    json_decref(json);
+    json_decref(inner);
+    json_decref(string);
+    if(free_called != 0)
+        fail("json_decref freed memory of an arena value");
+
+    /* still there after json_decref() */
+    if(strcmp(json_string_value(string), "arena") ||
+       strcmp(json_string_value(json_object_get(inner, "c")), "d") ||
+       json_integer_value(json_object_get(json_array_get(json_object_get(json, "a"), 1), "b")) != 2)
+        fail("json_decref changed an arena value");
+
+    if(json_string_set(string, "heap") != -1)
+        fail("json_string_set succeeded on an arena string");
+    if(strcmp(json_string_value(string), "arena"))
+        fail("a refused json_string_set changed an arena string");
+
+    json_stream_close(stream);
+    json_arena_free(arena);
+}
+
+static void test_without_arena()
+{
+    const char text[] = "{\"a\": \"b\"}{\"c\": \"d\"}";
+    json_arena_t *arena;
+    json_stream_t *stream;
+    json_error_t error;
+    json_t *json;
+
+    arena = json_arena_new();
+    stream = json_stream_buffer(text, strlen(text));
+    json_stream_set_arena(stream, arena);
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(!json)
+        fail("json_stream_load failed with an arena");
+
+    /* back to values that are freed one by one */
+    json_stream_set_arena(stream, NULL);
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(!json)
+        fail("json_stream_load failed after dropping the arena");
+    if(json_string_set(json_object_get(json, "c"), "e"))
+        fail("json_string_set failed on a value not in an arena");
+
+    free_called = 0;
+    json_decref(json);
+    if(free_called == 0)
+        fail("json_decref did not free a value decoded without an arena");
+
+    json_stream_close(stream);
+    json_arena_free(arena);
+
+    /* an arena that was never used */
+    json_arena_reset(NULL);
+    json_arena_free(NULL);
+    arena = json_arena_new();
+    json_arena_reset(arena);
+    json_arena_free(arena);
+}
+
+int main()
+{
+    json_set_alloc_funcs(my_malloc, my_free);
+
+    test_reset();
+    test_several_documents();
+    test_refcount();
+    test_without_arena();
+
+    return 0;
+}
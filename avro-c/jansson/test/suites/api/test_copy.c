@@ -307,6 +307,33 @@ static void test_deep_copy_object(void)
     json_decref(copy);
 }
 
+static void test_copy_nul(void)
+{
+    json_t *array, *copy;
+    json_t *string;
+
+    array = json_loads("[\"a\\u0000b\"]", JSON_ALLOW_NUL, NULL);
+    if(!array)
+        fail("unable to decode a string with a null byte");
+    string = json_array_get(array, 0);
+
+    copy = json_copy(string);
+    if(!copy || json_string_length(copy) != 3)
+        fail("copying a string loses the part after a null byte");
+    if(!json_equal(copy, string))
+        fail("copying a string with a null byte doesn't work");
+    json_decref(copy);
+
+    copy = json_deep_copy(array);
+    if(!copy || json_string_length(json_array_get(copy, 0)) != 3)
+        fail("deep copying a string loses the part after a null byte");
+    if(!json_equal(copy, array))
+        fail("deep copying a string with a null byte doesn't work");
+    json_decref(copy);
+
+    json_decref(array);
+}
+
 int main()
 {
     test_copy_simple();
@@ -315,5 +342,6 @@ int main()
     test_deep_copy_array();
     test_copy_object();
     test_deep_copy_object();
+    test_copy_nul();
     return 0;
 }
@@ -133,10 +133,28 @@ static void encode_other_than_array_or_object()
 
 }
 
+static void encode_nul()
+{
+    json_t *json;
+    char *result;
+
+    json = json_loads("[\"a\\u0000b\"]", JSON_ALLOW_NUL, NULL);
+    if(!json)
+        fail("unable to decode a string with a null byte");
+
+    result = json_dumps(json, 0);
+    if(!result || strcmp(result, "[\"a\\u0000b\"]"))
+        fail("json_dumps stops at a null byte in a string");
+    free(result);
+
+    json_decref(json);
+}
+
 int main()
 {
     encode_twice();
     circular_references();
     encode_other_than_array_or_object();
+    encode_nul();
     return 0;
 }
@@ -180,11 +180,39 @@ static void test_equal_complex()
     /* TODO: There's no negative test case here */
 }
 
+static void test_equal_nul()
+{
+    json_t *value1, *value2;
+
+    /* strings that only differ after a null byte */
+    value1 = json_loads("[\"a\\u0000b\", \"a\\u0000b\", \"a\\u0000c\", \"a\", \"a\\u0000\"]",
+                        JSON_ALLOW_NUL, NULL);
+    if(!value1)
+        fail("unable to decode strings with null bytes");
+
+    if(!json_equal(json_array_get(value1, 0), json_array_get(value1, 1)))
+        fail("json_equal fails for equal strings with null bytes");
+    if(json_equal(json_array_get(value1, 0), json_array_get(value1, 2)))
+        fail("json_equal fails for strings that differ after a null byte");
+    if(json_equal(json_array_get(value1, 3), json_array_get(value1, 4)))
+        fail("json_equal fails for a string and its prefix");
+
+    value2 = json_string("a");
+    if(!json_equal(json_array_get(value1, 3), value2))
+        fail("json_equal fails for equal strings");
+    if(json_equal(json_array_get(value1, 4), value2))
+        fail("json_equal ignores a trailing null byte");
+
+    json_decref(value1);
+    json_decref(value2);
+}
+
 int main()
 {
     test_equal_simple();
     test_equal_array();
     test_equal_object();
     test_equal_complex();
+    test_equal_nul();
     return 0;
 }
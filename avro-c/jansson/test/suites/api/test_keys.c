@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2009-2011 Petri Lehtinen <petri@digip.org>
+ *
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <jansson.h>
+#include <string.h>
+#include "util.h"
+
+/* How many keys a stream adds to a table by itself */
+#define KEYS_MAX  4096
+
+static json_t *load(json_keys_t *keys, const char *text)
+{
+    json_stream_t *stream;
+    json_error_t error;
+    json_t *json;
+
+    stream = json_stream_buffer(text, strlen(text));
+    if(!stream)
+        fail("json_stream_buffer failed");
+    json_stream_set_keys(stream, keys);
+
+    json = json_stream_load(stream, 0, &error);
+    if(!json)
+        fail("json_stream_load failed with a key table");
+
+    json_stream_close(stream);
+    return json;
+}
+
+static const char *first_key(json_t *object)
+{
+    return json_object_iter_key(json_object_iter(object));
+}
+
+static void test_intern()
+{
+    json_keys_t *keys;
+    const char *foo, *bar;
+    char key[] = "foo";
+
+    keys = json_keys_new();
+    if(!keys)
+        fail("json_keys_new failed");
+
+    foo = json_keys_intern(keys, key);
+    if(!foo || foo == key || strcmp(foo, "foo"))
+        fail("json_keys_intern did not return a copy of the key");
+    if(json_keys_intern(keys, "foo") != foo)
+        fail("json_keys_intern returned another copy of an interned key");
+
+    bar = json_keys_intern(keys, "bar");
+    if(!bar || bar == foo)
+        fail("json_keys_intern failed on a second key");
+
+    if(json_keys_intern(keys, "\xff") != NULL)
+        fail("json_keys_intern accepted invalid UTF-8");
+    if(json_keys_intern(keys, NULL) != NULL)
+        fail("json_keys_intern accepted a NULL key");
+    if(json_keys_intern(NULL, "foo") != NULL)
+        fail("json_keys_intern accepted a NULL table");
+
+    json_keys_free(keys);
+    json_keys_free(NULL);
+}
+
+static void test_stream_keys()
+{
+    json_keys_t *keys;
+    json_t *first, *second;
+    const char *foo;
+
+    keys = json_keys_new();
+    foo = json_keys_intern(keys, "foo");
+
+    first = load(keys, "{\"foo\": 1, \"bar\": {\"foo\": 2}}");
+    second = load(keys, "{\"bar\": 3}");
+
+    /* interned before and while decoding */
+    if(first_key(first) != foo)
+        fail("an object key was not interned");
+    if(first_key(json_object_get(first, "bar")) != foo)
+        fail("a nested object key was not interned");
+    if(first_key(second) != json_keys_intern(keys, "bar"))
+        fail("a stream did not intern a new key");
+
+    /* an interned key finds its member by pointer, a copy by value */
+    if(json_integer_value(json_object_get(first, foo)) != 1 ||
+       json_integer_value(json_object_get(first, "foo")) != 1)
+        fail("json_object_get failed with an interned key");
+
+    json_decref(first);
+    json_decref(second);
+
+    /* without a table, keys are copied into every object */
+    first = load(NULL, "{\"foo\": 1}");
+    if(first_key(first) == foo || strcmp(first_key(first), "foo"))
+        fail("a key was interned without a key table");
+    json_decref(first);
+
+    json_keys_free(keys);
+}
+
+static void test_frozen()
+{
+    json_keys_t *keys;
+    json_t *first, *second;
+    const char *foo;
+
+    keys = json_keys_new();
+    foo = json_keys_intern(keys, "foo");
+    json_keys_freeze(keys);
+
+    first = load(keys, "{\"foo\": 1, \"new\": 2}");
+    second = load(keys, "{\"new\": 3, \"foo\": 4}");
+
+    if(json_object_iter_key(json_object_iter_at(first, "foo")) != foo ||
+       json_object_iter_key(json_object_iter_at(second, "foo")) != foo)
+        fail("a frozen table was not used for decoding");
+
+    /* "new" was copied into both objects, not added to the table */
+    if(json_object_iter_key(json_object_iter_at(first, "new")) ==
+       json_object_iter_key(json_object_iter_at(second, "new")))
+        fail("a stream added a key to a frozen table");
+    if(json_integer_value(json_object_get(second, "new")) != 3)
+        fail("a key missing from a frozen table was not decoded");
+
+    json_decref(first);
+    json_decref(second);
+    json_keys_free(keys);
+}
+
+static void test_cap()
+{
+    json_keys_t *keys;
+    json_t *object, *copy;
+    void *iter;
+    char *text, *p;
+    char key[16];
+    int i, n = KEYS_MAX + 100;
+
+    text = malloc(n * 16 + 2);
+    if(!text)
+        fail("malloc failed");
+    p = text;
+    *p++ = '{';
+    for(i = 0; i < n; i++)
+        p += sprintf(p, "%s\"k%d\": %d", i ? ", " : "", i, i);
+    strcpy(p, "}");
+
+    keys = json_keys_new();
+    object = load(keys, text);
+    if(json_object_size(object) != (size_t)n)
+        fail("wrong number of members decoded with a key table");
+
+    /* a stream stops adding keys once the table is full, but they
+       are still decoded, and can be interned explicitly */
+    iter = json_object_iter(object);
+    for(i = 0; i < n; i++) {
+        const char *interned;
+
+        sprintf(key, "k%d", i);
+        if(strcmp(json_object_iter_key(iter), key))
+            fail("members decoded out of order");
+        interned = json_keys_intern(keys, key);
+        if(!interned)
+            fail("json_keys_intern failed on a full table");
+        if(i < KEYS_MAX && json_object_iter_key(iter) != interned)
+            fail("a key was not interned before the table was full");
+        if(i >= KEYS_MAX && json_object_iter_key(iter) == interned)
+            fail("a key was interned after the table was full");
+        iter = json_object_iter_next(object, iter);
+    }
+
+    /* the explicitly interned keys are used from now on */
+    copy = load(keys, text);
+    if(json_object_iter_key(json_object_iter_at(copy, "k4195")) !=
+       json_keys_intern(keys, "k4195"))
+        fail("a stream did not use a key interned after the table was full");
+    if(!json_equal(object, copy))
+        fail("objects decoded with a full key table differ");
+
+    json_decref(copy);
+    json_decref(object);
+    json_keys_free(keys);
+    free(text);
+}
+
+/* An object frees the key it's given when the key is already there;
+   an interned one belongs to the table and must be left alone. Run
+   under valgrind or ASan to catch a double free. */
+static void test_replace()
+{
+    json_keys_t *keys;
+    json_t *object;
+    const char *foo;
+
+    keys = json_keys_new();
+    foo = json_keys_intern(keys, "foo");
+
+    /* a duplicate key in the input replaces the first value */
+    object = load(keys, "{\"foo\": 1, \"bar\": 2, \"foo\": 3}");
+    if(json_object_size(object) != 2 ||
+       json_integer_value(json_object_get(object, "foo")) != 3)
+        fail("a duplicate interned key did not replace the value");
+
+    /* a copied key replaces the value of an interned one */
+    if(json_object_set_new(object, "foo", json_integer(4)))
+        fail("json_object_set_new failed on an interned key");
+    if(first_key(object) != foo ||
+       json_integer_value(json_object_get(object, "foo")) != 4)
+        fail("json_object_set_new did not keep the interned key");
+
+    /* interned keys are not freed with the members */
+    if(json_object_del(object, "foo"))
+        fail("json_object_del failed on an interned key");
+    if(strcmp(foo, "foo") || json_keys_intern(keys, "foo") != foo)
+        fail("json_object_del freed an interned key");
+    if(json_object_set_new(object, "foo", json_integer(5)) ||
+       json_integer_value(json_object_get(object, foo)) != 5)
+        fail("json_object_set_new failed after deleting an interned key");
+    json_decref(object);
+
+    object = load(keys, "{\"foo\": 1, \"bar\": 2}");
+    json_object_clear(object);
+    json_decref(object);
+
+    /* a key replaced in an object from an arena */
+    {
+        const char text[] = "{\"foo\": 1, \"foo\": 2}";
+        json_arena_t *arena = json_arena_new();
+        json_stream_t *stream = json_stream_buffer(text, strlen(text));
+        json_error_t error;
+
+        json_stream_set_arena(stream, arena);
+        json_stream_set_keys(stream, keys);
+        object = json_stream_load(stream, 0, &error);
+        if(!object || first_key(object) != foo ||
+           json_integer_value(json_object_get(object, "foo")) != 2)
+            fail("a duplicate interned key failed with an arena");
+        json_stream_close(stream);
+        json_arena_free(arena);
+    }
+
+    if(strcmp(foo, "foo") || json_keys_intern(keys, "bar") == NULL)
+        fail("the key table was damaged by freeing objects");
+    json_keys_free(keys);
+}
+
+int main()
+{
+    test_intern();
+    test_stream_keys();
+    test_frozen();
+    test_cap();
+    test_replace();
+
+    return 0;
+}
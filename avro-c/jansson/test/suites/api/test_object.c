@@ -437,6 +437,203 @@ static void test_preserve_order()
     json_decref(object);
 }
 
+/* checks that iterating object gives exactly keys[0..n) in order, and
+   that each of them can be looked up */
+static void check_keys(json_t *object, const char **keys, int n)
+{
+    void *iter;
+    int i = 0;
+
+    if(json_object_size(object) != (size_t)n)
+        fail("wrong object size");
+
+    for(iter = json_object_iter(object); iter;
+        iter = json_object_iter_next(object, iter), i++)
+    {
+        if(i == n || strcmp(json_object_iter_key(iter), keys[i]))
+            fail("keys not iterated in insertion order");
+        if(json_object_get(object, keys[i]) != json_object_iter_value(iter))
+            fail("json_object_get() disagrees with the iterator");
+    }
+    if(i != n)
+        fail("iteration ended early");
+}
+
+#define MANY_KEYS 200
+
+static void test_many_keys()
+{
+    json_t *object;
+    char names[MANY_KEYS][8];
+    const char *keys[MANY_KEYS];
+    int i;
+
+    object = json_object();
+    if(!object)
+        fail("unable to create object");
+
+    /* past 8 keys the object is indexed rather than searched */
+    for(i = 0; i < MANY_KEYS; i++)
+    {
+        sprintf(names[i], "k%d", (i * 37) % MANY_KEYS);
+        keys[i] = names[i];
+        if(json_object_set_new(object, keys[i], json_integer(i)))
+            fail("unable to set value");
+        if(json_integer_value(json_object_get(object, keys[i])) != i)
+            fail("unable to get a value just set");
+        check_keys(object, keys, i + 1);
+    }
+
+    if(json_object_get(object, "k200") || json_object_get(object, "k-1"))
+        fail("got a value for a key that was never set");
+
+    /* replacing a value keeps its place */
+    if(json_object_set_new(object, keys[5], json_integer(-5)))
+        fail("unable to replace value");
+    if(json_integer_value(json_object_get(object, keys[5])) != -5)
+        fail("replaced value not found");
+    check_keys(object, keys, MANY_KEYS);
+
+    json_decref(object);
+}
+
+static void test_delete_and_compact()
+{
+    json_t *object;
+    char names[2 * MANY_KEYS][8];
+    const char *keys[2 * MANY_KEYS];
+    int i, j, n;
+
+    object = json_object();
+    if(!object)
+        fail("unable to create object");
+
+    for(i = 0; i < 2 * MANY_KEYS; i++)
+        sprintf(names[i], "%c%d", i % 2 ? 'b' : 'a', i);
+
+    /* a sliding window of live keys: add one, delete the oldest but
+       one, so that deleted pairs pile up and get squeezed out again */
+    n = 0;
+    for(i = 0; i < 2 * MANY_KEYS; i++)
+    {
+        if(json_object_set_new(object, names[i], json_integer(i)))
+            fail("unable to set value");
+        keys[n++] = names[i];
+
+        if(n > 12)
+        {
+            if(json_object_del(object, keys[1]))
+                fail("unable to delete key");
+            if(json_object_get(object, keys[1]))
+                fail("deleted key still found");
+            if(json_object_del(object, keys[1]) == 0)
+                fail("able to delete a key twice");
+            for(j = 1; j < n - 1; j++)
+                keys[j] = keys[j + 1];
+            n--;
+        }
+        check_keys(object, keys, n);
+    }
+
+    /* a deleted key comes back at the end */
+    if(json_object_del(object, keys[0]) ||
+       json_object_set_new(object, keys[0], json_integer(0)))
+        fail("unable to delete and re-add key");
+    keys[n] = keys[0];
+    check_keys(object, keys + 1, n);
+
+    json_decref(object);
+}
+
+static void test_iter_at_after_delete()
+{
+    json_t *object;
+    char names[20][8];
+    const char *keys[20];
+    void *iter;
+    int i;
+
+    object = json_object();
+    if(!object)
+        fail("unable to create object");
+
+    for(i = 0; i < 20; i++)
+    {
+        sprintf(names[i], "key%d", i);
+        keys[i] = names[i];
+        json_object_set_new(object, keys[i], json_integer(i));
+    }
+
+    /* remove key5 to key9 */
+    for(i = 5; i < 10; i++)
+        if(json_object_del(object, keys[i]))
+            fail("unable to delete key");
+
+    if(json_object_iter_at(object, keys[7]))
+        fail("json_object_iter_at() finds a deleted key");
+
+    iter = json_object_iter_at(object, keys[4]);
+    if(!iter || strcmp(json_object_iter_key(iter), keys[4]))
+        fail("json_object_iter_at() fails for an existing key");
+
+    /* the deleted pairs are skipped */
+    iter = json_object_iter_next(object, iter);
+    if(!iter || strcmp(json_object_iter_key(iter), keys[10]))
+        fail("iterating failed after deleted keys");
+    if(json_integer_value(json_object_iter_value(iter)) != 10)
+        fail("iterating failed: wrong value");
+
+    for(i = 11; i < 20; i++)
+    {
+        iter = json_object_iter_next(object, iter);
+        if(!iter || strcmp(json_object_iter_key(iter), keys[i]))
+            fail("iterating failed: wrong key");
+    }
+    if(json_object_iter_next(object, iter))
+        fail("able to iterate over the end");
+
+    json_decref(object);
+}
+
+static void test_clear_and_reuse()
+{
+    json_t *object;
+    char names[30][8];
+    const char *keys[30];
+    int i;
+
+    object = json_object();
+    if(!object)
+        fail("unable to create object");
+
+    for(i = 0; i < 30; i++)
+    {
+        sprintf(names[i], "c%d", i);
+        keys[i] = names[i];
+    }
+
+    for(i = 0; i < 20; i++)
+        json_object_set_new(object, keys[i], json_integer(i));
+    json_object_del(object, keys[3]);
+
+    json_object_clear(object);
+    if(json_object_size(object) != 0)
+        fail("invalid size after clear");
+    if(json_object_iter(object))
+        fail("able to iterate over a cleared object");
+    for(i = 0; i < 20; i++)
+        if(json_object_get(object, keys[i]))
+            fail("cleared key still found");
+
+    /* old and new keys alike go in afresh */
+    for(i = 10; i < 30; i++)
+        if(json_object_set_new(object, keys[i], json_integer(i)))
+            fail("unable to set value after clear");
+    check_keys(object, keys + 10, 20);
+
+    json_decref(object);
+}
+
 int main()
 {
     test_misc();
@@ -446,6 +643,10 @@ int main()
     test_set_nocheck();
     test_iterators();
     test_preserve_order();
+    test_many_keys();
+    test_delete_and_compact();
+    test_iter_at_after_delete();
+    test_clear_and_reuse();
 
     return 0;
 }
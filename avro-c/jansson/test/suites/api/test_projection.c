@@ -0,0 +1,480 @@
+/*
+ * Copyright (c) 2009-2011 Petri Lehtinen <petri@digip.org>
+ *
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <jansson.h>
+#include <string.h>
+#include "util.h"
+
+/* A projection is a tree of these, each level ending with a NULL
+   key. The items of an array go by the key "[]", and keys that are
+   not listed are skipped. */
+struct field {
+    const char *key;
+    int action;
+    const struct field *child;
+};
+
+static int calls;
+
+static int project(void *data, const void *context, const char *key,
+                   const void **child)
+{
+    const struct field *field = (const struct field *)context;
+
+    if(data != &calls)
+        fail("the projection callback got the wrong data");
+    calls++;
+
+    for(; field->key; field++) {
+        if(key ? strcmp(field->key, key) == 0 : strcmp(field->key, "[]") == 0) {
+            *child = field->child;
+            return field->action;
+        }
+    }
+    return JSON_PROJECT_SKIP;
+}
+
+static json_t *load_projected(const char *text, const struct field *root,
+                              json_error_t *error)
+{
+    json_stream_t *stream;
+    json_t *json;
+
+    stream = json_stream_buffer(text, strlen(text));
+    if(!stream)
+        fail("json_stream_buffer failed");
+    json_stream_set_projection(stream, project, &calls, root);
+
+    json = json_stream_load(stream, 0, error);
+    json_stream_close(stream);
+    return json;
+}
+
+static void check_projected(const char *text, const struct field *root,
+                            const char *expected)
+{
+    json_error_t error;
+    json_t *json, *wanted;
+
+    json = load_projected(text, root, &error);
+    if(!json) {
+        failhdr;
+        fprintf(stderr, "%s: %s\n", text, error.text);
+        exit(1);
+    }
+
+    wanted = json_loads(expected, 0, &error);
+    if(!wanted)
+        fail("invalid expected value");
+    if(!json_equal(json, wanted)) {
+        char *dump = json_dumps(json, JSON_SORT_KEYS);
+        failhdr;
+        fprintf(stderr, "%s: got %s, expected %s\n", text, dump, expected);
+        exit(1);
+    }
+
+    json_decref(wanted);
+    json_decref(json);
+}
+
+static const struct field keep_only[] = {
+    {"keep", JSON_PROJECT_ALL, NULL},
+    {NULL, 0, NULL}
+};
+
+static void test_skip()
+{
+    /* objects, arrays, strings with escaped quotes and brackets */
+    check_projected(
+        "{\"a\": {\"x\": [1, {\"y\": \"z\"}], \"e\": {}, \"f\": []},"
+        " \"keep\": 1,"
+        " \"b\": [[], [true, false, null], -1.5e+3, {\"]\": \"[\"}],"
+        " \"c\": \"str \\\" with ] and } and \\\\\","
+        " \"d\": [\"[{\\\"\", \"\\\\\", \"\\u005d\"],"
+        " \"n\": 42, \"s\": \"x\", \"t\": true, \"u\": null}",
+        keep_only, "{\"keep\": 1}");
+
+    /* words and escapes are not checked in a skipped container */
+    check_projected(
+        "{\"d\": [nulll, 1.2.3, +-x, \"\\q\", {\"k\\x\": truee}], \"keep\": [2]}",
+        keep_only, "{\"keep\": [2]}");
+
+    /* whitespace and line breaks in between, multi-byte characters */
+    check_projected(
+        "{\"a\" :\n [ 1 ,\r\n\t{ \"\xc3\xa4\" : \"\xe2\x82\xac\" } ] ,\n \"keep\" : \"\xc3\xa4\" }",
+        keep_only, "{\"keep\": \"\xc3\xa4\"}");
+
+    /* everything is skipped */
+    check_projected("{\"a\": [1], \"b\": {\"c\": 2}}", keep_only, "{}");
+}
+
+static const struct field item[] = {
+    {"id", JSON_PROJECT_ALL, NULL},
+    {"tags", JSON_PROJECT_KEEP, NULL},
+    {NULL, 0, NULL}
+};
+
+static const struct field items[] = {
+    {"[]", JSON_PROJECT_KEEP, item},
+    {NULL, 0, NULL}
+};
+
+static const struct field skip_items[] = {
+    {"[]", JSON_PROJECT_SKIP, NULL},
+    {NULL, 0, NULL}
+};
+
+static const struct field nested[] = {
+    {"list", JSON_PROJECT_KEEP, items},
+    {"none", JSON_PROJECT_KEEP, skip_items},
+    {"all", JSON_PROJECT_ALL, NULL},
+    {NULL, 0, NULL}
+};
+
+static void test_keep()
+{
+    calls = 0;
+    check_projected(
+        "{\"list\": [{\"id\": 1, \"junk\": {\"a\": [1]}, \"tags\": [\"x\", {\"y\": 2}]},"
+        " {\"junk\": 3, \"id\": 2}],"
+        " \"none\": [1, [2], {\"3\": 4}],"
+        " \"all\": {\"deep\": {\"er\": [1, 2]}},"
+        " \"other\": {\"list\": [1]}}",
+        nested,
+        "{\"list\": [{\"id\": 1, \"tags\": [\"x\", {\"y\": 2}]}, {\"id\": 2}],"
+        " \"none\": [],"
+        " \"all\": {\"deep\": {\"er\": [1, 2]}}}");
+
+    /* asked once per member and once per array, but not below a
+       value that is decoded in full */
+    if(calls != 4 + 1 + 3 + 2 + 1)
+        fail("the projection callback was called a wrong number of times");
+
+    /* a projected array can still hold anything */
+    check_projected("{\"list\": [], \"none\": []}", nested,
+                    "{\"list\": [], \"none\": []}");
+}
+
+static const struct field text_fields[] = {
+    {"raw", JSON_PROJECT_TEXT, NULL},
+    {"rawarr", JSON_PROJECT_TEXT, NULL},
+    {"num", JSON_PROJECT_TEXT, NULL},
+    {"str", JSON_PROJECT_TEXT, NULL},
+    {NULL, 0, NULL}
+};
+
+static void test_text()
+{
+    const char text[] =
+        "{\"raw\": { \"a\" : [1,  2] ,\"b\":\"}\\\"\\u00e4\" ,\"c\":{}},"
+        " \"rawarr\": [ nul, \"]\" ]\n,"
+        " \"num\": 12, \"str\": \"s\", \"skipped\": [1]}";
+    json_error_t error;
+    json_t *json;
+
+    json = load_projected(text, text_fields, &error);
+    if(!json)
+        fail("json_stream_load failed with a TEXT projection");
+
+    /* the exact text of objects and arrays, as in the input */
+    if(strcmp(json_string_value(json_object_get(json, "raw")),
+              "{ \"a\" : [1,  2] ,\"b\":\"}\\\"\\u00e4\" ,\"c\":{}}"))
+        fail("TEXT did not capture the text of an object");
+    if(strcmp(json_string_value(json_object_get(json, "rawarr")),
+              "[ nul, \"]\" ]"))
+        fail("TEXT did not capture the text of an array");
+    if(json_string_length(json_object_get(json, "rawarr")) != strlen("[ nul, \"]\" ]"))
+        fail("TEXT returned the wrong length");
+
+    /* other values are decoded as usual */
+    if(json_integer_value(json_object_get(json, "num")) != 12 ||
+       strcmp(json_string_value(json_object_get(json, "str")), "s"))
+        fail("TEXT changed the decoding of a scalar");
+    if(json_object_size(json) != 4)
+        fail("TEXT decoded a member that was skipped");
+
+    json_decref(json);
+}
+
+struct source {
+    const char *text;
+    size_t len;
+    size_t pos;
+};
+
+static size_t source_read(void *buffer, size_t buflen, void *data)
+{
+    struct source *source = (struct source *)data;
+    size_t len = source->len - source->pos;
+
+    /* odd sized chunks, so that tokens are split between them */
+    if(len > buflen)
+        len = buflen;
+    if(len > 997)
+        len = 997;
+
+    memcpy(buffer, source->text + source->pos, len);
+    source->pos += len;
+    return len;
+}
+
+/* A raw span longer than a block of a callback stream */
+static void test_text_blocks()
+{
+    struct source source;
+    json_stream_t *stream;
+    json_error_t error;
+    json_t *json;
+    char *text, *p, *raw;
+    size_t raw_len;
+    int i;
+
+    text = malloc(200000);
+    if(!text)
+        fail("malloc failed");
+
+    p = text;
+    p += sprintf(p, "{\"num\": 1, \"raw\": ");
+    raw = p;
+    *p++ = '[';
+    for(i = 0; i < 10000; i++)
+        p += sprintf(p, "%s{\"k\": \"v\\\"%d]\"}", i ? ", " : "", i);
+    *p++ = ']';
+    raw_len = p - raw;
+    p += sprintf(p, ", \"skipped\": [%s]}", "1, 2, 3");
+
+    source.text = text;
+    source.len = p - text;
+    source.pos = 0;
+
+    stream = json_stream_new(source_read, &source);
+    json_stream_set_projection(stream, project, &calls, text_fields);
+    json = json_stream_load(stream, 0, &error);
+    if(!json)
+        fail("json_stream_load failed on a TEXT span across blocks");
+
+    if(json_string_length(json_object_get(json, "raw")) != raw_len ||
+       memcmp(json_string_value(json_object_get(json, "raw")), raw, raw_len))
+        fail("TEXT did not capture a span across blocks");
+    if(json_integer_value(json_object_get(json, "num")) != 1)
+        fail("wrong value decoded before a TEXT span across blocks");
+
+    json_decref(json);
+    json_stream_close(stream);
+    free(text);
+}
+
+static const struct field skip_s[] = {
+    {"t", JSON_PROJECT_TEXT, NULL},
+    {NULL, 0, NULL}
+};
+
+static void check_invalid(const char *text, const char *message)
+{
+    json_error_t error;
+    json_t *json;
+
+    json = load_projected(text, skip_s, &error);
+    if(json) {
+        failhdr;
+        fprintf(stderr, "%s: accepted malformed structure\n", text);
+        exit(1);
+    }
+    if(strncmp(error.text, message, strlen(message))) {
+        failhdr;
+        fprintf(stderr, "%s: \"%s\" does not start with \"%s\"\n",
+                text, error.text, message);
+        exit(1);
+    }
+}
+
+static void test_invalid()
+{
+    const char *invalid[] = {
+        "[1 2]",
+        "[1,]",
+        "[,1]",
+        "[}",
+        "{\"a\" 1}",
+        "{\"a\": 1,}",
+        "{1: 2}",
+        "{\"a\": 1 \"b\": 2}",
+        "{\"a\"}",
+        "{\"a\": ]}",
+        "[\"a\" \"b\"]",
+        "[\"a\":1]",
+        "{\"a\": [1}]",
+        "[{\"a\": 1]}",
+        "[1]]",
+        NULL
+    };
+    char text[64];
+    int i;
+
+    for(i = 0; invalid[i]; i++) {
+        /* in a skipped member and in a TEXT one */
+        sprintf(text, "{\"s\": %s, \"x\": 1}", invalid[i]);
+        check_invalid(text, strcmp(invalid[i], "[1]]") ? "unexpected token" : "'}' expected");
+        sprintf(text, "{\"t\": %s, \"x\": 1}", invalid[i]);
+        check_invalid(text, strcmp(invalid[i], "[1]]") ? "unexpected token" : "'}' expected");
+    }
+
+    /* a control character in a skipped string, as the lexer reports it */
+    check_invalid("{\"s\": [\"a\x01\"], \"x\": 1}", "control character 0x1 near '\"a'");
+
+    /* input that ends inside a skipped container */
+    check_invalid("{\"s\": [1, {\"a\": 2}", "premature end of input");
+    check_invalid("{\"s\": [\"]}", "premature end of input");
+    check_invalid("{\"t\": {\"a\": \"\\", "premature end of input");
+
+    /* a skipped scalar is still checked by the lexer */
+    check_invalid("{\"s\": nul}", "invalid token");
+}
+
+static void test_depth()
+{
+    char *text;
+    json_error_t error;
+    json_t *json;
+    int i, depth;
+
+    text = malloc(2 * 4096 + 32);
+    for(depth = 2047; depth <= 2049; depth++) {
+        char *p = text + sprintf(text, "{\"s\": ");
+        for(i = 0; i < depth; i++)
+            *p++ = '[';
+        for(i = 0; i < depth; i++)
+            *p++ = ']';
+        strcpy(p, "}");
+
+        json = load_projected(text, skip_s, &error);
+        if(depth <= 2048 && !json)
+            fail("a deeply nested skipped value was rejected");
+        if(depth > 2048 && json)
+            fail("a skipped value nested too deeply was accepted");
+        json_decref(json);
+    }
+    free(text);
+}
+
+/* Decode the first text of a broken line, then skip the rest of the
+   line and decode the next one, with or without a projection */
+static json_t *resync(const char *text, const struct field *root,
+                      json_error_t *error)
+{
+    json_stream_t *stream;
+    json_error_t next_error;
+    json_t *json;
+
+    stream = json_stream_buffer(text, strlen(text));
+    if(root)
+        json_stream_set_projection(stream, project, &calls, root);
+
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, error);
+    if(json)
+        fail("json_stream_load accepted a broken line");
+    if(json_stream_skip_line(stream))
+        fail("json_stream_skip_line failed");
+
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &next_error);
+    if(!json)
+        fail("json_stream_load failed after a broken line");
+
+    json_stream_close(stream);
+    return json;
+}
+
+static void check_resync(const char *text, const char *message, int line)
+{
+    json_error_t error, full_error;
+    json_t *json, *full;
+
+    json = resync(text, keep_only, &error);
+    full = resync(text, NULL, &full_error);
+
+    if(strcmp(error.text, message) || error.line != line) {
+        failhdr;
+        fprintf(stderr, "%s: reported \"%s\" on line %d\n",
+                text, error.text, error.line);
+        exit(1);
+    }
+    if(full_error.line != line || full_error.column != error.column ||
+       full_error.position != error.position)
+        fail("a projection reported an error at another place");
+
+    /* the same line is lost either way */
+    if(json_integer_value(json_object_get(json, "keep")) != 3 ||
+       json_object_size(json) != 1 ||
+       json_integer_value(json_object_get(full, "keep")) != 3)
+        fail("a projection resynchronized at another line");
+
+    json_decref(json);
+    json_decref(full);
+}
+
+static void test_resync()
+{
+    /* a truncated line followed by a complete one and by another one
+       that is truncated, the way the lexer sees it */
+    check_resync("{\"s\": [1, 2\n"
+                 "{\"s\": {\"a\": [\"b\"]}, \"keep\": 2}\n"
+                 "{\"s\": 3, \"keep\": 3}\n",
+                 "unexpected token near '{'", 2);
+    check_resync("{\"s\": {\"a\": [1]\n"
+                 "{\"s\": [], \"keep\": 2}\n"
+                 "{\"keep\": 3}\n",
+                 "unexpected token near '{'", 2);
+
+    /* cut off inside a skipped string */
+    check_resync("{\"s\": [\"abc\n"
+                 "{\"keep\": 2}\n"
+                 "{\"keep\": 3}\n",
+                 "unexpected newline near '\"abc'", 1);
+    check_resync("{\"s\": {\"a\": \"b\", \"some key\n"
+                 "{\"keep\": 2}\n"
+                 "{\"keep\": 3, \"s\": [\"x\"]}\n",
+                 "unexpected newline near '\"some key'", 1);
+}
+
+static void test_projection_reset()
+{
+    const char text[] = "{\"s\": {\"a\": [\"b\"]}, \"keep\": 2}\n";
+    json_stream_t *stream;
+    json_error_t error;
+    json_t *json;
+
+    stream = json_stream_buffer(text, strlen(text));
+    json_stream_set_projection(stream, project, &calls, keep_only);
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(!json || json_object_size(json) != 1)
+        fail("json_stream_load failed with a projection");
+    json_decref(json);
+
+    /* without a projection, everything is decoded again */
+    json_stream_seek(stream, 0);
+    json_stream_set_projection(stream, NULL, NULL, NULL);
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(!json || json_object_size(json) != 2)
+        fail("json_stream_set_projection did not go back to full decoding");
+    json_decref(json);
+
+    json_stream_close(stream);
+}
+
+int main()
+{
+    test_skip();
+    test_keep();
+    test_text();
+    test_text_blocks();
+    test_invalid();
+    test_depth();
+    test_resync();
+    test_projection_reset();
+
+    return 0;
+}
@@ -57,13 +57,40 @@ int main()
     if(strcmp(json_string_value(value), "foo"))
         fail("invalid string value");
 
+    if(json_string_length(value) != 3)
+        fail("invalid string length");
+
     if(json_string_set(value, "bar"))
         fail("json_string_set failed");
     if(strcmp(json_string_value(value), "bar"))
         fail("invalid string value");
 
+    if(json_string_set(value, "quux!"))
+        fail("json_string_set failed");
+    if(json_string_length(value) != 5)
+        fail("json_string_set didn't update the length");
+
+    json_decref(value);
+
+    value = json_integer(1);
+    if(json_string_length(value) != 0)
+        fail("json_string_length of a non-string isn't 0");
     json_decref(value);
 
+    /* \u0000 only gets through the decoder with JSON_ALLOW_NUL */
+    value = json_loads("[\"a\\u0000b\\u0000\"]", JSON_ALLOW_NUL, NULL);
+    if(!value)
+        fail("unable to decode a string with a null byte");
+    if(json_string_length(json_array_get(value, 0)) != 4)
+        fail("json_string_length doesn't count null bytes");
+    if(memcmp(json_string_value(json_array_get(value, 0)), "a\0b\0", 5))
+        fail("invalid string value with null bytes");
+    json_decref(value);
+
+    value = json_loads("[\"a\\u0000b\"]", 0, NULL);
+    if(value)
+        fail("decoded \\u0000 without JSON_ALLOW_NUL");
+
     value = json_string(NULL);
     if(value)
         fail("json_string(NULL) failed");
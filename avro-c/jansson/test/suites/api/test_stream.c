@@ -0,0 +1,481 @@
+/*
+ * Copyright (c) 2009-2011 Petri Lehtinen <petri@digip.org>
+ *
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <jansson.h>
+#include <string.h>
+#include "util.h"
+
+/* The size of the blocks a callback stream reads at a time */
+#define BLOCK_SIZE     65536
+#define BIG_TEXT_SIZE  (3 * BLOCK_SIZE + 1000)
+
+struct source {
+    const char *text;
+    size_t len;
+    size_t pos;
+    size_t chunk;
+};
+
+static size_t source_read(void *buffer, size_t buflen, void *data)
+{
+    struct source *source = (struct source *)data;
+    size_t len = source->len - source->pos;
+
+    if(len > buflen)
+        len = buflen;
+    if(source->chunk && len > source->chunk)
+        len = source->chunk;
+
+    memcpy(buffer, source->text + source->pos, len);
+    source->pos += len;
+    return len;
+}
+
+static json_int_t member_integer(json_t *json, const char *key)
+{
+    return json_integer_value(json_object_get(json, key));
+}
+
+static void test_buffer_documents()
+{
+    const char text[] = "{\"a\": 1}\n[2, 3]\n  {\"b\": {}}";
+    json_stream_t *stream;
+    json_error_t error;
+    json_t *json;
+
+    stream = json_stream_buffer(text, strlen(text));
+    if(!stream)
+        fail("json_stream_buffer failed");
+
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(!json || member_integer(json, "a") != 1)
+        fail("json_stream_load failed on the first document");
+    json_decref(json);
+    if(json_stream_tell(stream) != strlen("{\"a\": 1}"))
+        fail("json_stream_tell is not at the end of the first document");
+    if(json_stream_eof(stream))
+        fail("json_stream_eof is true after the first document");
+
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(!json || !json_is_array(json) || json_array_size(json) != 2)
+        fail("json_stream_load failed on the second document");
+    json_decref(json);
+
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(!json || !json_is_object(json_object_get(json, "b")))
+        fail("json_stream_load failed on the third document");
+    json_decref(json);
+    if(json_stream_tell(stream) != strlen(text))
+        fail("json_stream_tell is not at the end of the buffer");
+
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(json)
+        fail("json_stream_load succeeded past the last document");
+    check_error("'[' or '{' expected near end of file", "<buffer>", 1, 0, 0);
+    if(!json_stream_eof(stream))
+        fail("json_stream_eof is false at the end of the buffer");
+
+    json_stream_close(stream);
+}
+
+static void test_eof_check()
+{
+    const char text[] = "{\"a\": 1} {\"b\": 2}";
+    json_stream_t *stream;
+    json_error_t error;
+    json_t *json;
+
+    /* Without JSON_DISABLE_EOF_CHECK, a document must end the input */
+    stream = json_stream_buffer(text, strlen(text));
+    json = json_stream_load(stream, 0, &error);
+    if(json)
+        fail("json_stream_load accepted two documents without JSON_DISABLE_EOF_CHECK");
+    check_error("end of file expected near '{'", "<buffer>", 1, 10, 10);
+    json_stream_close(stream);
+
+    stream = json_stream_buffer(text, strlen("{\"a\": 1} "));
+    json = json_stream_load(stream, 0, &error);
+    if(!json)
+        fail("json_stream_load failed on a document followed by whitespace");
+    json_decref(json);
+    if(!json_stream_eof(stream))
+        fail("json_stream_eof is false after the end of file check");
+    json_stream_close(stream);
+}
+
+static void test_tell_seek()
+{
+    const char text[] = "{\"n\": 1}{\"n\": 2}\n{\"n\": 3}";
+    json_stream_t *stream;
+    json_error_t error;
+    json_t *json;
+    size_t second, third;
+
+    stream = json_stream_buffer(text, strlen(text));
+    if(json_stream_tell(stream) != 0)
+        fail("json_stream_tell is not 0 on a new stream");
+
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    json_decref(json);
+    second = json_stream_tell(stream);
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    json_decref(json);
+    third = json_stream_tell(stream);
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(member_integer(json, "n") != 3)
+        fail("json_stream_load failed on the third document");
+    json_decref(json);
+
+    if(json_stream_seek(stream, second))
+        fail("json_stream_seek failed");
+    if(json_stream_tell(stream) != second)
+        fail("json_stream_tell does not return the offset seeked to");
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(!json || member_integer(json, "n") != 2)
+        fail("json_stream_load did not decode the document seeked to");
+    json_decref(json);
+    if(json_stream_tell(stream) != third)
+        fail("json_stream_tell differs after decoding a document again");
+
+    if(json_stream_seek(stream, 0))
+        fail("json_stream_seek to the start failed");
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(!json || member_integer(json, "n") != 1)
+        fail("json_stream_load did not decode the first document again");
+    json_decref(json);
+
+    /* Seeking back clears the end of input */
+    if(json_stream_seek(stream, strlen(text)))
+        fail("json_stream_seek to the end failed");
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(json || !json_stream_eof(stream))
+        fail("json_stream_load did not reach the end of input");
+    if(json_stream_seek(stream, third))
+        fail("json_stream_seek failed at the end of input");
+    if(json_stream_eof(stream))
+        fail("json_stream_seek did not clear the end of input");
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(!json || member_integer(json, "n") != 3)
+        fail("json_stream_load failed after seeking from the end of input");
+    json_decref(json);
+
+    if(json_stream_seek(stream, strlen(text) + 1) != -1)
+        fail("json_stream_seek past the end of the buffer succeeded");
+    if(json_stream_tell(stream) != strlen(text))
+        fail("a failed json_stream_seek moved the stream");
+
+    json_stream_close(stream);
+}
+
+static void test_pending()
+{
+    const char text[] = "[1]\n[2, 3]\n";
+    json_stream_t *stream;
+    json_error_t error;
+    json_t *json;
+    const char *pending;
+    size_t len;
+
+    stream = json_stream_buffer(text, strlen(text));
+    pending = json_stream_pending(stream, &len);
+    if(pending != text || len != strlen(text))
+        fail("json_stream_pending is not the whole buffer on a new stream");
+
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    json_decref(json);
+    pending = json_stream_pending(stream, &len);
+    if(len != strlen("\n[2, 3]\n") || memcmp(pending, "\n[2, 3]\n", len))
+        fail("json_stream_pending is not the input after the first document");
+
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    json_decref(json);
+    json_stream_pending(stream, &len);
+    if(len != 1)
+        fail("json_stream_pending is not the trailing newline");
+
+    json_stream_close(stream);
+}
+
+static void test_skip_line()
+{
+    const char text[] =
+        "{\"n\": 1}\n"
+        "{\"n\": oops, \"m\": [1, 2]}\n"
+        "{\"n\": 3} trailing garbage\n"
+        "{\"n\": 4}";
+    json_stream_t *stream;
+    json_error_t error;
+    json_t *json;
+
+    stream = json_stream_buffer(text, strlen(text));
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(!json || member_integer(json, "n") != 1)
+        fail("json_stream_load failed on the first document");
+    json_decref(json);
+
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(json)
+        fail("json_stream_load succeeded on an invalid document");
+    check_error("invalid token near 'oops'", "<buffer>", 2, 10, 11);
+
+    if(json_stream_skip_line(stream))
+        fail("json_stream_skip_line failed after an invalid document");
+    if(json_stream_tell(stream) != strlen("{\"n\": 1}\n{\"n\": oops, \"m\": [1, 2]}\n"))
+        fail("json_stream_skip_line did not stop after the newline");
+
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(!json || member_integer(json, "n") != 3)
+        fail("json_stream_load failed after json_stream_skip_line");
+    json_decref(json);
+
+    /* The rest of a line can be dropped after a valid document, too */
+    if(json_stream_skip_line(stream))
+        fail("json_stream_skip_line failed after a valid document");
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(!json || member_integer(json, "n") != 4)
+        fail("json_stream_load failed on the last document");
+    json_decref(json);
+
+    if(json_stream_skip_line(stream) != -1)
+        fail("json_stream_skip_line succeeded without a newline");
+    if(!json_stream_eof(stream))
+        fail("json_stream_eof is false after skipping to the end");
+
+    json_stream_close(stream);
+}
+
+static void test_file()
+{
+    const char text[] = "{\"n\": 1}\n{\"n\": 2}\n";
+    json_stream_t *stream;
+    json_error_t error;
+    json_t *json;
+    FILE *file;
+
+    file = tmpfile();
+    if(!file)
+        fail("unable to create a temporary file");
+    fputs(text, file);
+    rewind(file);
+
+    stream = json_stream_file(file);
+    if(!stream)
+        fail("json_stream_file failed");
+
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(!json || member_integer(json, "n") != 1)
+        fail("json_stream_load failed on the first document of a file");
+    json_decref(json);
+    if(json_stream_tell(stream) != strlen("{\"n\": 1}"))
+        fail("json_stream_tell is wrong for a file");
+    if(json_stream_seek(stream, 0) != -1)
+        fail("json_stream_seek succeeded on a file");
+
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(!json || member_integer(json, "n") != 2)
+        fail("json_stream_load failed on the second document of a file");
+    json_decref(json);
+
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(json)
+        fail("json_stream_load succeeded at the end of a file");
+    check_error("'[' or '{' expected near end of file", "<stream>", 2, 0, 1);
+    if(!json_stream_eof(stream))
+        fail("json_stream_eof is false at the end of a file");
+    if(json_stream_tell(stream) != strlen(text))
+        fail("json_stream_tell is not at the end of the file");
+
+    json_stream_close(stream);
+    fclose(file);
+}
+
+/* Documents and a string longer than a block cross block boundaries */
+static void test_callback_blocks(size_t chunk)
+{
+    char *text, *p;
+    char *long_string;
+    struct source source;
+    json_stream_t *stream;
+    json_error_t error;
+    json_t *json;
+    size_t ends[BIG_TEXT_SIZE / 16];
+    size_t count, i;
+
+    text = malloc(BIG_TEXT_SIZE + 70000);
+    long_string = malloc(70000);
+    if(!text || !long_string)
+        fail("malloc failed");
+
+    memset(long_string, 'x', 69999);
+    long_string[69999] = '\0';
+
+    p = text;
+    count = 0;
+    while(p - text < BIG_TEXT_SIZE) {
+        if(count == 7)
+            p += sprintf(p, "{\"n\": %d, \"s\": \"%s\"}\n", (int)count, long_string);
+        else
+            p += sprintf(p, "{\"n\": %d, \"a\": [true, \"\\u00e4\"]}\n", (int)count);
+        ends[count++] = p - text - 1;
+    }
+
+    source.text = text;
+    source.len = p - text;
+    source.pos = 0;
+    source.chunk = chunk;
+
+    stream = json_stream_new(source_read, &source);
+    if(!stream)
+        fail("json_stream_new failed");
+
+    for(i = 0; i < count; i++) {
+        json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+        if(!json)
+            fail("json_stream_load failed on a callback source");
+        if(member_integer(json, "n") != (json_int_t)i)
+            fail("json_stream_load returned the documents out of order");
+        if(i == 7 &&
+           strcmp(json_string_value(json_object_get(json, "s")), long_string))
+            fail("a string longer than a block was not decoded whole");
+        if(i != 7 &&
+           strcmp(json_string_value(json_array_get(json_object_get(json, "a"), 1)),
+                  "\xc3\xa4"))
+            fail("a string was not decoded across a block boundary");
+        json_decref(json);
+
+        if(json_stream_tell(stream) != ends[i])
+            fail("json_stream_tell is wrong across a block boundary");
+    }
+
+    if(json_stream_skip_line(stream))
+        fail("json_stream_skip_line failed on the last newline");
+    if(json_stream_eof(stream))
+        fail("json_stream_eof is true before the callback ended the input");
+    json = json_stream_load(stream, JSON_DISABLE_EOF_CHECK, &error);
+    if(json)
+        fail("json_stream_load succeeded past the end of a callback source");
+    if(!json_stream_eof(stream))
+        fail("json_stream_eof is false after the callback ended the input");
+    if(json_stream_tell(stream) != source.len)
+        fail("json_stream_tell is not at the end of a callback source");
+
+    json_stream_close(stream);
+    free(long_string);
+    free(text);
+}
+
+/* Multi-byte characters split between the blocks of a callback
+   source decode as if they were not, and invalid ones are reported
+   as by json_loadb() */
+static void test_utf8_blocks(size_t chunk)
+{
+    const char *valid[] = {
+        "\xc3\xa4", "\xe2\x82\xac", "\xf0\x9f\x98\x80", NULL
+    };
+    const char *invalid[] = {
+        "\xe2\x82\"",             /* truncated by the closing quote */
+        "\xf0\x9f\x98",           /* truncated by the end of input */
+        "\xe2\x28\xa1",           /* bad continuation byte */
+        "\xf0\x9f\x28\x80",
+        "\xc0\xaf",               /* overlong */
+        "\xed\xa0\x80",           /* surrogate */
+        "\xf4\x90\x80\x80",       /* above U+10FFFF */
+        "\x80\x80",               /* continuation without a lead byte */
+        "\xf8\x88\x80\x80\x80",   /* five bytes */
+        NULL
+    };
+    struct source source;
+    json_stream_t *stream;
+    json_error_t error, expected;
+    json_t *json;
+    char *text;
+    size_t len, start;
+    int i;
+
+    text = malloc(BLOCK_SIZE + 64);
+    if(!text)
+        fail("malloc failed");
+
+    for(start = BLOCK_SIZE - 4; start < BLOCK_SIZE; start++) {
+        /* pad the string so that the sequence starts at start */
+        text[0] = '[';
+        text[1] = '"';
+        memset(text + 2, 'a', start - 2);
+
+        for(i = 0; valid[i]; i++) {
+            len = sprintf(text + start, "%s\"]", valid[i]) + start;
+            source.text = text;
+            source.len = len;
+            source.pos = 0;
+            source.chunk = chunk;
+
+            stream = json_stream_new(source_read, &source);
+            json = json_stream_load(stream, 0, &error);
+            if(!json)
+                fail("json_stream_load failed on a character across blocks");
+            if(json_string_length(json_array_get(json, 0)) != len - 4 ||
+               strcmp(json_string_value(json_array_get(json, 0)) + start - 2,
+                      valid[i]))
+                fail("a character across blocks was not decoded whole");
+            json_decref(json);
+            json_stream_close(stream);
+        }
+
+        for(i = 0; invalid[i]; i++) {
+            len = sprintf(text + start, "%s\"]", invalid[i]) + start;
+            if(i == 1)
+                len = start + strlen(invalid[i]);
+
+            json = json_loadb(text, len, 0, &expected);
+            if(json)
+                fail("json_loadb accepted invalid UTF-8");
+
+            source.text = text;
+            source.len = len;
+            source.pos = 0;
+            source.chunk = chunk;
+
+            stream = json_stream_new(source_read, &source);
+            json = json_stream_load(stream, 0, &error);
+            if(json)
+                fail("json_stream_load accepted invalid UTF-8 across blocks");
+            if(strcmp(error.text, expected.text) ||
+               error.line != expected.line ||
+               error.column != expected.column ||
+               error.position != expected.position) {
+                failhdr;
+                fprintf(stderr, "invalid UTF-8 %d at %d: \"%s\" %d:%d:%d,"
+                        " expected \"%s\" %d:%d:%d\n", i, (int)start,
+                        error.text, error.line, error.column, error.position,
+                        expected.text, expected.line, expected.column,
+                        expected.position);
+                exit(1);
+            }
+            json_stream_close(stream);
+        }
+    }
+
+    free(text);
+}
+
+int main()
+{
+    test_buffer_documents();
+    test_eof_check();
+    test_tell_seek();
+    test_pending();
+    test_skip_line();
+    test_file();
+    test_callback_blocks(0);
+    test_callback_blocks(4093);
+    test_callback_blocks(1);
+    test_utf8_blocks(0);
+    test_utf8_blocks(1);
+    test_utf8_blocks(3);
+
+    return 0;
+}
@@ -52,6 +52,29 @@ avro_reader_memory_set_source(avro_reader_t reader, const char *buf, int64_t len
 void
 avro_writer_memory_set_dest(avro_writer_t writer, const char *buf, int64_t len);
 
+/*
+ * A growable memory writer reallocates its buffer with avro_realloc()
+ * when a write doesn't fit, instead of failing with ENOSPC.  The
+ * buffer must then have come from avro_malloc() with the length given
+ * to the writer, and since growing moves it, the caller gets the
+ * current buffer and length back with avro_writer_memory_get_dest().
+ * The caller still owns the buffer and frees it.
+ */
+
+void
+avro_writer_memory_set_growable(avro_writer_t writer, int growable);
+
+void
+avro_writer_memory_get_dest(avro_writer_t writer, char **buf, int64_t *len);
+
+/*
+ * Moves the write position of a memory writer, to drop what was
+ * written after it or to keep data placed in the buffer directly.
+ */
+
+void
+avro_writer_memory_seek(avro_writer_t writer, int64_t offset);
+
 int avro_read(avro_reader_t reader, void *buf, int64_t len);
 int avro_skip(avro_reader_t reader, int64_t len);
 int avro_write(avro_writer_t writer, void *buf, int64_t len);
@@ -107,6 +130,33 @@ int avro_file_writer_create_with_codec(const char *path,
 int avro_file_writer_create_with_codec_fp(FILE *fp, const char *path, int should_close,
 				avro_schema_t schema, avro_file_writer_t * writer,
 				const char *codec, size_t block_size);
+
+/*
+ * Tuning for a writer's codec.  A field left at zero keeps the codec's
+ * default, and a codec ignores the fields it has no use for.
+ *
+ * level     deflate 1-9 (default 9), lzma preset 1-9 (default 6),
+ *           zstandard any level the library accepts, negative ones
+ *           included (default 3)
+ * window    log2 of the window or dictionary size: deflate 9-15
+ *           (default 15), lzma 12-23 and zstandard 10-27, which keep
+ *           within what readers decode with by default
+ * strategy  deflate: a zlib strategy, e.g. Z_FILTERED or Z_RLE;
+ *           lzma: 1 for the fast mode, 2 for the normal one;
+ *           zstandard: a ZSTD_strategy from ZSTD_fast (1) up
+ */
+
+struct avro_codec_options {
+	int level;
+	int window;
+	int strategy;
+};
+
+int avro_file_writer_create_with_codec_options_fp(FILE *fp, const char *path,
+				int should_close, avro_schema_t schema,
+				avro_file_writer_t * writer, const char *codec,
+				const struct avro_codec_options *options,
+				size_t block_size);
 int avro_file_writer_open(const char *path, avro_file_writer_t * writer);
 int avro_file_writer_open_bs(const char *path, avro_file_writer_t * writer, size_t block_size);
 int avro_file_reader(const char *path, avro_file_reader_t * reader);
@@ -116,6 +166,36 @@ int avro_file_reader_fp(FILE *fp, const char *path, int should_close,
 avro_schema_t
 avro_file_reader_get_writer_schema(avro_file_reader_t reader);
 
+/*
+ * Compresses filled blocks on a pool of thread_count threads instead
+ * of in the appending thread.  Blocks still go to the file in the
+ * order they were filled.  Has no effect with the null codec, and
+ * fails with ENOSYS unless the library was built with THREADSAFE.
+ * Call it right after creating or opening the writer.
+ */
+
+int avro_file_writer_set_codec_threads(avro_file_writer_t writer,
+				       int thread_count);
+
+/*
+ * Sizes blocks by what they compress to rather than by a fixed
+ * uncompressed size.  Starting from the writer's block size, the
+ * writer learns the codec's compression ratio from the blocks it
+ * writes and grows or shrinks the next ones to come out at about
+ * compressed_size bytes, between 1 KB and 1 GB uncompressed.  0 keeps
+ * the block size fixed.
+ *
+ * With max_latency_ms above 0, a block is also ended once it has been
+ * open that long.  This is checked as values are appended, so an idle
+ * writer still needs avro_file_writer_flush().
+ *
+ * Call it right after creating or opening the writer.
+ */
+
+int avro_file_writer_set_block_target(avro_file_writer_t writer,
+				      size_t compressed_size,
+				      int max_latency_ms);
+
 int avro_file_writer_sync(avro_file_writer_t writer);
 int avro_file_writer_flush(avro_file_writer_t writer);
 int avro_file_writer_close(avro_file_writer_t writer);
@@ -128,6 +208,16 @@ avro_file_reader_read_value(avro_file_reader_t reader, avro_value_t *dest);
 int
 avro_file_writer_append_value(avro_file_writer_t writer, avro_value_t *src);
 
+/*
+ * Appends a single value that has already been serialized with the
+ * binary encoding of the writer's schema, for instance by
+ * avro_value_write() into a memory writer on another thread.
+ */
+
+int
+avro_file_writer_append_encoded(avro_file_writer_t writer,
+				const void *buf, int64_t len);
+
 /*
  * Legacy avro_datum_t API
  */
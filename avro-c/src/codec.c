@@ -31,9 +31,14 @@
 #ifdef LZMA_CODEC
 #include <lzma.h>
 #endif
+#ifdef ZSTD_CODEC
+#include <stdlib.h>
+#include <zstd.h>
+#endif
 #include "avro/errors.h"
 #include "avro/allocation.h"
 #include "codec.h"
+#include "crc32.h"
 
 #define DEFAULT_BLOCK_SIZE	(16 * 1024)
 
@@ -121,7 +126,7 @@ static int encode_snappy(avro_codec_t c, void * data, int64_t len)
 		return 1;
 	}
 
-        crc = __bswap_32(crc32(0, data, len));
+        crc = __bswap_32(avro_crc32(0, data, len));
         memcpy(c->block_data+outlen, &crc, 4);
         c->used_size = outlen+4;
 
@@ -158,7 +163,7 @@ static int decode_snappy(avro_codec_t c, void * data, int64_t len)
 		return 1;
 	}
 
-        crc = __bswap_32(crc32(0, c->block_data, outlen));
+        crc = __bswap_32(avro_crc32(0, c->block_data, outlen));
         if (memcmp(&crc, (char*)data+len-4, 4))
         {
                 avro_set_error("CRC32 check failure uncompressing block with Snappy");
@@ -206,6 +211,22 @@ codec_deflate(avro_codec_t codec)
 	codec->block_size = 0;
 	codec->used_size = 0;
 	codec->block_data = NULL;
+
+	struct avro_codec_options *o = &codec->options;
+	if (!o->level) {
+		o->level = Z_BEST_COMPRESSION;
+	}
+	if (!o->window) {
+		o->window = 15;
+	}
+	if (o->level < 1 || o->level > 9 || o->window < 9 || o->window > 15 ||
+	    o->strategy < 0 || o->strategy > Z_FIXED) {
+		codec->codec_data = NULL;
+		avro_set_error("Invalid deflate options: level %d, window %d, strategy %d",
+			       o->level, o->window, o->strategy);
+		return 1;
+	}
+
 	codec->codec_data = avro_new(struct codec_data_deflate);
 
 	if (!codec->codec_data) {
@@ -223,7 +244,7 @@ codec_deflate(avro_codec_t codec)
 	ds->zfree  = is->zfree  = Z_NULL;
 	ds->opaque = is->opaque = Z_NULL;
 
-	if (deflateInit2(ds, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+	if (deflateInit2(ds, o->level, Z_DEFLATED, -o->window, 8, o->strategy) != Z_OK) {
 		avro_freet(struct codec_data_deflate, codec->codec_data);
 		codec->codec_data = NULL;
 		avro_set_error("Cannot initialize zlib deflate");
@@ -391,6 +412,10 @@ struct codec_data_lzma {
 #define codec_data_lzma_filters(cd)	((struct codec_data_lzma *)cd)->filters
 #define codec_data_lzma_options(cd)	&((struct codec_data_lzma *)cd)->options
 
+/* Readers decode with the default preset's dictionary, so the writer
+ * keeps to that */
+#define LZMA_READER_DICT_SIZE	(UINT32_C(1) << 23)
+
 static int
 codec_lzma(avro_codec_t codec)
 {
@@ -399,6 +424,19 @@ codec_lzma(avro_codec_t codec)
 	codec->block_size = 0;
 	codec->used_size = 0;
 	codec->block_data = NULL;
+
+	struct avro_codec_options *o = &codec->options;
+	if (!o->level) {
+		o->level = LZMA_PRESET_DEFAULT;
+	}
+	if (o->level < 1 || o->level > 9 || (o->window && (o->window < 12 || o->window > 23)) ||
+	    o->strategy < 0 || o->strategy > LZMA_MODE_NORMAL) {
+		codec->codec_data = NULL;
+		avro_set_error("Invalid lzma options: level %d, window %d, strategy %d",
+			       o->level, o->window, o->strategy);
+		return 1;
+	}
+
 	codec->codec_data = avro_new(struct codec_data_lzma);
 
 	if (!codec->codec_data) {
@@ -407,7 +445,15 @@ codec_lzma(avro_codec_t codec)
 	}
 
 	lzma_options_lzma* opt = codec_data_lzma_options(codec->codec_data);
-	lzma_lzma_preset(opt, LZMA_PRESET_DEFAULT);
+	lzma_lzma_preset(opt, o->level);
+	if (o->window) {
+		opt->dict_size = UINT32_C(1) << o->window;
+	} else if (opt->dict_size > LZMA_READER_DICT_SIZE) {
+		opt->dict_size = LZMA_READER_DICT_SIZE;
+	}
+	if (o->strategy) {
+		opt->mode = (lzma_mode) o->strategy;
+	}
 
 	lzma_filter* filters = codec_data_lzma_filters(codec->codec_data);
 	filters[0].id = LZMA_FILTER_LZMA2;
@@ -510,10 +556,206 @@ static int reset_lzma(avro_codec_t c)
 
 #endif // LZMA_CODEC
 
+/* Zstandard codec */
+
+#ifdef ZSTD_CODEC
+
+#define ZSTD_DEFAULT_LEVEL	3
+
+/* The contexts are kept for the life of the codec, so every block
+ * after the first reuses their tables and windows. */
+struct codec_data_zstd {
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+};
+
+static int
+codec_zstd(avro_codec_t codec)
+{
+	struct avro_codec_options *o = &codec->options;
+	struct codec_data_zstd *cd;
+
+	codec->name = "zstandard";
+	codec->type = AVRO_CODEC_ZSTD;
+	codec->block_size = 0;
+	codec->used_size = 0;
+	codec->block_data = NULL;
+
+	if (!o->level) {
+		o->level = ZSTD_DEFAULT_LEVEL;
+	}
+	if (o->level < ZSTD_minCLevel() || o->level > ZSTD_maxCLevel() ||
+	    (o->window && (o->window < 10 || o->window > 27)) ||
+	    o->strategy < 0 || o->strategy > ZSTD_btultra2) {
+		codec->codec_data = NULL;
+		avro_set_error("Invalid zstd options: level %d, window %d, strategy %d",
+			       o->level, o->window, o->strategy);
+		return 1;
+	}
+
+	codec->codec_data = cd = avro_new(struct codec_data_zstd);
+
+	if (!cd) {
+		avro_set_error("Cannot allocate memory for zstd");
+		return 1;
+	}
+
+	cd->cctx = ZSTD_createCCtx();
+	cd->dctx = ZSTD_createDCtx();
+	if (!cd->cctx || !cd->dctx ||
+	    ZSTD_isError(ZSTD_CCtx_setParameter(cd->cctx, ZSTD_c_compressionLevel, o->level)) ||
+	    ZSTD_isError(ZSTD_CCtx_setParameter(cd->cctx, ZSTD_c_windowLog, o->window)) ||
+	    ZSTD_isError(ZSTD_CCtx_setParameter(cd->cctx, ZSTD_c_strategy, o->strategy))) {
+		ZSTD_freeCCtx(cd->cctx);
+		ZSTD_freeDCtx(cd->dctx);
+		avro_freet(struct codec_data_zstd, cd);
+		codec->codec_data = NULL;
+		avro_set_error("Cannot initialize zstd");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int encode_zstd(avro_codec_t c, void * data, int64_t len)
+{
+	struct codec_data_zstd *cd = (struct codec_data_zstd *) c->codec_data;
+	int64_t zstd_len = ZSTD_compressBound(len);
+	size_t rval;
+
+	if (!c->block_data) {
+		c->block_data = avro_malloc(zstd_len);
+		c->block_size = zstd_len;
+	} else if (c->block_size < zstd_len) {
+		c->block_data = avro_realloc(c->block_data, c->block_size, zstd_len);
+		c->block_size = zstd_len;
+	}
+
+	if (!c->block_data) {
+		avro_set_error("Cannot allocate memory for zstd");
+		return 1;
+	}
+
+	rval = ZSTD_compress2(cd->cctx, c->block_data, c->block_size, data, len);
+	if (ZSTD_isError(rval)) {
+		avro_set_error("Error compressing block with zstd: %s",
+			       ZSTD_getErrorName(rval));
+		return 1;
+	}
+	c->used_size = rval;
+
+	return 0;
+}
+
+/* Other writers don't always record the content size in the frame, so
+ * this streams into a buffer that grows as needed. */
+static int decode_zstd(avro_codec_t c, void * data, int64_t len)
+{
+	struct codec_data_zstd *cd = (struct codec_data_zstd *) c->codec_data;
+	unsigned long long content_len = ZSTD_getFrameContentSize(data, len);
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	size_t rval;
+
+	if (content_len == ZSTD_CONTENTSIZE_ERROR) {
+		avro_set_error("Error decompressing block with zstd, not a zstd frame");
+		return 1;
+	}
+	if (content_len == ZSTD_CONTENTSIZE_UNKNOWN || content_len == 0) {
+		content_len = DEFAULT_BLOCK_SIZE;
+	}
+
+	if (!c->block_data) {
+		c->block_data = avro_malloc(content_len);
+		c->block_size = content_len;
+	} else if ((unsigned long long) c->block_size < content_len) {
+		c->block_data = avro_realloc(c->block_data, c->block_size, content_len);
+		c->block_size = content_len;
+	}
+
+	if (!c->block_data) {
+		avro_set_error("Cannot allocate memory for zstd");
+		return 1;
+	}
+
+	ZSTD_DCtx_reset(cd->dctx, ZSTD_reset_session_only);
+	in.src = data;
+	in.size = len;
+	in.pos = 0;
+	out.dst = c->block_data;
+	out.size = c->block_size;
+	out.pos = 0;
+
+	for (;;) {
+		rval = ZSTD_decompressStream(cd->dctx, &out, &in);
+		if (ZSTD_isError(rval)) {
+			avro_set_error("Error decompressing block with zstd: %s",
+				       ZSTD_getErrorName(rval));
+			return 1;
+		}
+		if (rval == 0) {
+			break;
+		}
+		if (out.pos == out.size) {
+			c->block_data = avro_realloc(c->block_data, c->block_size, c->block_size * 2);
+			if (!c->block_data) {
+				c->block_size = 0;
+				avro_set_error("Cannot allocate memory for zstd");
+				return 1;
+			}
+			c->block_size = c->block_size * 2;
+			out.dst = c->block_data;
+			out.size = c->block_size;
+		} else if (in.pos == in.size) {
+			avro_set_error("Error decompressing block with zstd, truncated frame");
+			return 1;
+		}
+	}
+
+	c->used_size = out.pos;
+
+	return 0;
+}
+
+static int reset_zstd(avro_codec_t c)
+{
+	struct codec_data_zstd *cd = (struct codec_data_zstd *) c->codec_data;
+
+	if (c->block_data) {
+		avro_free(c->block_data, c->block_size);
+	}
+	if (cd) {
+		ZSTD_freeCCtx(cd->cctx);
+		ZSTD_freeDCtx(cd->dctx);
+		avro_freet(struct codec_data_zstd, cd);
+	}
+
+	c->block_data = NULL;
+	c->block_size = 0;
+	c->used_size = 0;
+	c->codec_data = NULL;
+
+	return 0;
+}
+
+#endif // ZSTD_CODEC
+
 /* Common interface */
 
 int avro_codec(avro_codec_t codec, const char *type)
 {
+	return avro_codec_with_options(codec, type, NULL);
+}
+
+int avro_codec_with_options(avro_codec_t codec, const char *type,
+			    const struct avro_codec_options *options)
+{
+	if (options) {
+		codec->options = *options;
+	} else {
+		memset(&codec->options, 0, sizeof(codec->options));
+	}
+
 	if (type == NULL) {
 		return codec_null(codec);
 	}
@@ -536,6 +778,12 @@ int avro_codec(avro_codec_t codec, const char *type)
 	}
 #endif
 
+#ifdef ZSTD_CODEC
+	if (strcmp("zstandard", type) == 0 || strcmp("zstd", type) == 0) {
+		return codec_zstd(codec);
+	}
+#endif
+
 	if (strcmp("null", type) == 0) {
 		return codec_null(codec);
 	}
@@ -561,6 +809,10 @@ int avro_codec_encode(avro_codec_t c, void * data, int64_t len)
 #ifdef LZMA_CODEC
 	case AVRO_CODEC_LZMA:
 		return encode_lzma(c, data, len);
+#endif
+#ifdef ZSTD_CODEC
+	case AVRO_CODEC_ZSTD:
+		return encode_zstd(c, data, len);
 #endif
 	default:
 		return 1;
@@ -584,6 +836,10 @@ int avro_codec_decode(avro_codec_t c, void * data, int64_t len)
 #ifdef LZMA_CODEC
 	case AVRO_CODEC_LZMA:
 		return decode_lzma(c, data, len);
+#endif
+#ifdef ZSTD_CODEC
+	case AVRO_CODEC_ZSTD:
+		return decode_zstd(c, data, len);
 #endif
 	default:
 		return 1;
@@ -607,6 +863,10 @@ int avro_codec_reset(avro_codec_t c)
 #ifdef LZMA_CODEC
 	case AVRO_CODEC_LZMA:
 		return reset_lzma(c);
+#endif
+#ifdef ZSTD_CODEC
+	case AVRO_CODEC_ZSTD:
+		return reset_zstd(c);
 #endif
 	default:
 		return 1;
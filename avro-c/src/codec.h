@@ -25,12 +25,14 @@ extern "C" {
 #endif
 
 #include <avro/platform.h>
+#include <avro/io.h>
 
 enum avro_codec_type_t {
 	AVRO_CODEC_NULL,
 	AVRO_CODEC_DEFLATE,
 	AVRO_CODEC_LZMA,
-	AVRO_CODEC_SNAPPY
+	AVRO_CODEC_SNAPPY,
+	AVRO_CODEC_ZSTD
 };
 typedef enum avro_codec_type_t avro_codec_type_t;
 
@@ -41,10 +43,14 @@ struct avro_codec_t_ {
 	int64_t used_size;
 	void * block_data;
 	void * codec_data;
+	/* What the codec was set up with, defaults filled in */
+	struct avro_codec_options options;
 };
 typedef struct avro_codec_t_* avro_codec_t;
 
 int avro_codec(avro_codec_t c, const char *type);
+int avro_codec_with_options(avro_codec_t c, const char *type,
+			    const struct avro_codec_options *options);
 int avro_codec_reset(avro_codec_t c);
 int avro_codec_encode(avro_codec_t c, void * data, int64_t len);
 int avro_codec_decode(avro_codec_t c, void * data, int64_t len);
@@ -0,0 +1,41 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to you under the Apache License, Version 2.0 
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.  See the License for the specific language governing
+ * permissions and limitations under the License. 
+ */
+
+#ifndef AVRO_CRC32_H
+#define AVRO_CRC32_H
+#ifdef __cplusplus
+extern "C" {
+#define CLOSE_EXTERN }
+#else
+#define CLOSE_EXTERN
+#endif
+
+#include <avro/platform.h>
+#include <stddef.h>
+
+/*
+ * The IEEE CRC-32 used by the snappy codec's block checksum.  Like
+ * zlib's crc32(), pass 0 to start and the previous result to continue.
+ * A carry-less multiply (x86 PCLMULQDQ) or ARMv8 CRC32 version is
+ * picked on first use when the CPU has one, with a slice-by-8 table
+ * fallback.
+ */
+
+uint32_t avro_crc32(uint32_t crc, const void *data, size_t len);
+
+CLOSE_EXTERN
+#endif
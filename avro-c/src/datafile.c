@@ -29,6 +29,11 @@
 #include <time.h>
 #include <string.h>
 
+#if defined THREADSAFE && (defined __unix__ || defined __unix)
+#define AVRO_CODEC_THREADS
+#include <pthread.h>
+#endif
+
 struct avro_file_reader_t_ {
 	avro_schema_t writers_schema;
 	avro_reader_t reader;
@@ -48,14 +53,25 @@ struct avro_file_writer_t_ {
 	char sync[16];
 	int block_count;
 	size_t block_size;
+	size_t block_target;
+	size_t compressed_target;
+	double ratio_in;
+	double ratio_out;
+	int max_latency;
+	int64_t block_opened;
 	avro_writer_t datum_writer;
 	char* datum_buffer;
 	size_t datum_buffer_size;
 	char schema_buf[64 * 1024];
+	struct avro_codec_pool_t_ *pool;
 };
 
 #define DEFAULT_BLOCK_SIZE 16 * 1024
 
+/* Bounds on the uncompressed size of blocks sized by compressed size */
+#define ADAPTIVE_MIN_BLOCK_SIZE 1024
+#define ADAPTIVE_MAX_BLOCK_SIZE ((size_t) 1024 * 1024 * 1024)
+
 /* Note: We should not just read /dev/random here, because it may not
  * exist on all platforms e.g. Win32.
  */
@@ -145,6 +161,7 @@ file_writer_create(FILE *fp, const char *path, int should_close, avro_schema_t s
 	int rval;
 
 	w->block_count = 0;
+	w->pool = NULL;
 	rval = file_writer_init_fp(fp, path, should_close, EXCLUSIVE_WRITE_MODE, w);
 	if (rval) {
 		check(rval, file_writer_init_fp(fp, path, should_close, "wb", w));
@@ -167,6 +184,10 @@ file_writer_create(FILE *fp, const char *path, int should_close, avro_schema_t s
 		avro_free(w->datum_buffer, w->datum_buffer_size);
 		return ENOMEM;
 	}
+	avro_writer_memory_set_growable(w->datum_writer, 1);
+	w->block_target = block_size;
+	w->compressed_target = 0;
+	w->max_latency = 0;
 
 	w->writers_schema = avro_schema_incref(schema);
 	return write_header(w);
@@ -196,6 +217,16 @@ int avro_file_writer_create_with_codec(const char *path,
 int avro_file_writer_create_with_codec_fp(FILE *fp, const char *path, int should_close,
 			avro_schema_t schema, avro_file_writer_t * writer,
 			const char *codec, size_t block_size)
+{
+	return avro_file_writer_create_with_codec_options_fp(fp, path, should_close,
+			schema, writer, codec, NULL, block_size);
+}
+
+int avro_file_writer_create_with_codec_options_fp(FILE *fp, const char *path,
+			int should_close, avro_schema_t schema,
+			avro_file_writer_t * writer, const char *codec,
+			const struct avro_codec_options *options,
+			size_t block_size)
 {
 	avro_file_writer_t w;
 	int rval;
@@ -219,7 +250,7 @@ int avro_file_writer_create_with_codec_fp(FILE *fp, const char *path, int should
 		avro_freet(struct avro_file_writer_t_, w);
 		return ENOMEM;
 	}
-	rval = avro_codec(w->codec, codec);
+	rval = avro_codec_with_options(w->codec, codec, options);
 	if (rval) {
 		avro_codec_reset(w->codec);
 		avro_freet(struct avro_codec_t_, w->codec);
@@ -357,6 +388,7 @@ file_writer_open(const char *path, avro_file_writer_t w, size_t block_size)
 	}
 
 	w->block_count = 0;
+	w->pool = NULL;
 
 	/* Position to end of file and get ready to write */
 	fseek(fp, 0, SEEK_END);
@@ -389,6 +421,10 @@ file_writer_open(const char *path, avro_file_writer_t w, size_t block_size)
 		avro_free(w->datum_buffer, w->datum_buffer_size);
 		return ENOMEM;
 	}
+	avro_writer_memory_set_growable(w->datum_writer, 1);
+	w->block_target = block_size;
+	w->compressed_target = 0;
+	w->max_latency = 0;
 
 	return 0;
 }
@@ -546,11 +582,345 @@ avro_file_reader_get_writer_schema(avro_file_reader_t r)
 	return avro_schema_incref(r->writers_schema);
 }
 
+static int64_t clock_ms(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+	return (int64_t) time(NULL) * 1000;
+#endif
+}
+
+/*
+ * With a compressed block target, each block that goes out adds to
+ * running totals of bytes in and out of the codec, which lose an
+ * eighth of their weight per block.  The ratio so follows the data,
+ * while a short block, such as one ended by the latency limit, barely
+ * moves it.  The next blocks are then sized to compress to about the
+ * target.
+ */
+static void block_target_update(avro_file_writer_t w, size_t block_size,
+				int64_t compressed_size)
+{
+	double target;
+
+	if (!w->compressed_target || !block_size || compressed_size <= 0) {
+		return;
+	}
+	w->ratio_in = w->ratio_in * 7 / 8 + block_size;
+	w->ratio_out = w->ratio_out * 7 / 8 + compressed_size;
+
+	target = w->compressed_target * (w->ratio_in / w->ratio_out);
+	if (target < ADAPTIVE_MIN_BLOCK_SIZE) {
+		target = ADAPTIVE_MIN_BLOCK_SIZE;
+	} else if (target > ADAPTIVE_MAX_BLOCK_SIZE) {
+		target = ADAPTIVE_MAX_BLOCK_SIZE;
+	}
+	w->block_target = (size_t) target;
+}
+
+int avro_file_writer_set_block_target(avro_file_writer_t w,
+				      size_t compressed_size, int max_latency_ms)
+{
+	check_param(EINVAL, w, "writer");
+	check_param(EINVAL, max_latency_ms >= 0, "latency");
+
+	w->compressed_target = compressed_size;
+	w->ratio_in = 0;
+	w->ratio_out = 0;
+	w->max_latency = max_latency_ms;
+	w->block_opened = clock_ms();
+	return 0;
+}
+
+#ifdef AVRO_CODEC_THREADS
+
+/*
+ * With codec threads, a filled datum buffer is handed to a pool of
+ * compression threads as a numbered block, and the writer carries on
+ * with the buffer of the next free block.  Each block has its own
+ * codec instance.  Blocks are written to the file strictly in the
+ * order in which they were handed off, by the thread that appends
+ * values, so the container looks exactly as if it had been written
+ * synchronously.
+ */
+
+enum codec_block_state {
+	CODEC_BLOCK_FREE,
+	CODEC_BLOCK_QUEUED,
+	CODEC_BLOCK_DONE
+};
+
+struct codec_block {
+	enum codec_block_state state;
+	int rval;
+	char error[256];
+	int block_count;
+	size_t block_size;
+	char *data;
+	size_t data_size;
+	avro_codec_t codec;
+};
+
+struct avro_codec_pool_t_ {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t *threads;
+	int thread_count;
+	int stop;
+	struct codec_block *blocks;
+	int block_total;
+	int64_t next_queue;
+	int64_t next_encode;
+	int64_t next_write;
+};
+
+static void *codec_pool_thread(void *arg)
+{
+	struct avro_codec_pool_t_ *pool = (struct avro_codec_pool_t_ *) arg;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->stop && pool->next_encode == pool->next_queue) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		}
+		if (pool->next_encode == pool->next_queue) {
+			break;
+		}
+		struct codec_block *b =
+		    &pool->blocks[pool->next_encode++ % pool->block_total];
+		pthread_mutex_unlock(&pool->lock);
+
+		int rval = avro_codec_encode(b->codec, b->data, b->block_size);
+		if (rval) {
+			strncpy(b->error, avro_strerror(), sizeof(b->error) - 1);
+			b->error[sizeof(b->error) - 1] = '\0';
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		b->rval = rval;
+		b->state = CODEC_BLOCK_DONE;
+		pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void codec_pool_free(avro_file_writer_t w)
+{
+	struct avro_codec_pool_t_ *pool = w->pool;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->thread_count; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	for (i = 0; i < pool->block_total; i++) {
+		struct codec_block *b = &pool->blocks[i];
+		/* The current datum buffer is freed along with the writer */
+		if (b->data && b->data != w->datum_buffer) {
+			avro_free(b->data, b->data_size);
+		}
+		if (b->codec) {
+			avro_codec_reset(b->codec);
+			avro_freet(struct avro_codec_t_, b->codec);
+		}
+	}
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	avro_free(pool->threads, sizeof(pthread_t) * pool->thread_count);
+	avro_free(pool->blocks, sizeof(struct codec_block) * pool->block_total);
+	avro_freet(struct avro_codec_pool_t_, pool);
+	w->pool = NULL;
+}
+
+/*
+ * Writes out compressed blocks in order, up to (but not including)
+ * block number "upto".  If "wait" is false, stops at the first block
+ * that is still being compressed.
+ */
+static int codec_pool_drain(avro_file_writer_t w, int64_t upto, int wait)
+{
+	const avro_encoding_t *enc = &avro_binary_encoding;
+	struct avro_codec_pool_t_ *pool = w->pool;
+	int rval;
+
+	while (pool->next_write < upto) {
+		struct codec_block *b =
+		    &pool->blocks[pool->next_write % pool->block_total];
+
+		enum codec_block_state state;
+
+		pthread_mutex_lock(&pool->lock);
+		while (wait && b->state != CODEC_BLOCK_DONE) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		}
+		state = b->state;
+		pthread_mutex_unlock(&pool->lock);
+		if (state != CODEC_BLOCK_DONE) {
+			return 0;
+		}
+
+		if (b->rval) {
+			avro_set_error("Cannot encode file block: %s", b->error);
+			return b->rval;
+		}
+		check_prefix(rval, enc->write_long(w->writer, b->block_count),
+			     "Cannot write file block count: ");
+		check_prefix(rval, enc->write_long(w->writer, b->codec->used_size),
+			     "Cannot write file block size: ");
+		check_prefix(rval, avro_write(w->writer, b->codec->block_data, b->codec->used_size),
+			     "Cannot write file block: ");
+		check_prefix(rval, write_sync(w),
+			     "Cannot write sync marker: ");
+		block_target_update(w, b->block_size, b->codec->used_size);
+
+		b->state = CODEC_BLOCK_FREE;
+		pool->next_write++;
+	}
+	return 0;
+}
+
+static int codec_pool_write_block(avro_file_writer_t w)
+{
+	struct avro_codec_pool_t_ *pool = w->pool;
+	struct codec_block *b;
+	int rval;
+
+	if (!w->block_count) {
+		return 0;
+	}
+
+	b = &pool->blocks[pool->next_queue % pool->block_total];
+	b->block_count = w->block_count;
+	b->block_size = w->block_size;
+
+	pthread_mutex_lock(&pool->lock);
+	b->state = CODEC_BLOCK_QUEUED;
+	pool->next_queue++;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	/* The next block's buffer must have been written out before
+	 * we can fill it again; anything else that is ready can go
+	 * out now too. */
+	check(rval, codec_pool_drain(w, pool->next_queue - pool->block_total + 1, 1));
+	check(rval, codec_pool_drain(w, pool->next_queue, 0));
+
+	b = &pool->blocks[pool->next_queue % pool->block_total];
+	if (!b->data) {
+		b->data = (char *) avro_malloc(w->block_target);
+		if (!b->data) {
+			avro_set_error("Could not allocate datum buffer");
+			return ENOMEM;
+		}
+		b->data_size = w->block_target;
+	}
+	w->datum_buffer = b->data;
+	w->datum_buffer_size = b->data_size;
+	avro_writer_memory_set_dest(w->datum_writer, w->datum_buffer, w->datum_buffer_size);
+	w->block_count = 0;
+	w->block_size = 0;
+	return 0;
+}
+
+int avro_file_writer_set_codec_threads(avro_file_writer_t w, int thread_count)
+{
+	struct avro_codec_pool_t_ *pool;
+	int i;
+
+	check_param(EINVAL, w, "writer");
+	check_param(EINVAL, !w->pool, "writer without codec threads");
+
+	/* Nothing to gain without compression */
+	if (thread_count <= 0 || w->codec->type == AVRO_CODEC_NULL) {
+		return 0;
+	}
+
+	pool = (struct avro_codec_pool_t_ *) avro_new(struct avro_codec_pool_t_);
+	if (!pool) {
+		avro_set_error("Cannot allocate codec thread pool");
+		return ENOMEM;
+	}
+	memset(pool, 0, sizeof(struct avro_codec_pool_t_));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	w->pool = pool;
+
+	pool->block_total = 2 * thread_count;
+	pool->blocks = (struct codec_block *)
+	    avro_calloc(pool->block_total, sizeof(struct codec_block));
+	pool->threads = (pthread_t *) avro_calloc(thread_count, sizeof(pthread_t));
+	if (!pool->blocks || !pool->threads) {
+		avro_set_error("Cannot allocate codec thread pool");
+		codec_pool_free(w);
+		return ENOMEM;
+	}
+
+	for (i = 0; i < pool->block_total; i++) {
+		pool->blocks[i].codec = (avro_codec_t) avro_new(struct avro_codec_t_);
+		if (!pool->blocks[i].codec) {
+			avro_set_error("Cannot allocate new codec");
+			codec_pool_free(w);
+			return ENOMEM;
+		}
+		if (avro_codec_with_options(pool->blocks[i].codec, w->codec->name,
+					    &w->codec->options)) {
+			avro_freet(struct avro_codec_t_, pool->blocks[i].codec);
+			pool->blocks[i].codec = NULL;
+			codec_pool_free(w);
+			return EINVAL;
+		}
+	}
+
+	/* The current datum buffer becomes the first block */
+	pool->blocks[0].data = w->datum_buffer;
+	pool->blocks[0].data_size = w->datum_buffer_size;
+
+	for (i = 0; i < thread_count; i++) {
+		if (pthread_create(&pool->threads[i], NULL, codec_pool_thread, pool)) {
+			avro_set_error("Cannot start codec thread");
+			codec_pool_free(w);
+			return EAGAIN;
+		}
+		pool->thread_count++;
+	}
+	return 0;
+}
+
+#else
+
+int avro_file_writer_set_codec_threads(avro_file_writer_t w, int thread_count)
+{
+	check_param(EINVAL, w, "writer");
+	if (thread_count <= 0) {
+		return 0;
+	}
+	avro_set_error("Codec threads require a THREADSAFE build");
+	return ENOSYS;
+}
+
+#endif
+
 static int file_write_block(avro_file_writer_t w)
 {
 	const avro_encoding_t *enc = &avro_binary_encoding;
 	int rval;
 
+#ifdef AVRO_CODEC_THREADS
+	if (w->pool) {
+		return codec_pool_write_block(w);
+	}
+#endif
+
 	if (w->block_count) {
 		/* Write the block count */
 		check_prefix(rval, enc->write_long(w->writer, w->block_count),
@@ -567,6 +937,7 @@ static int file_write_block(avro_file_writer_t w)
 		/* Write the sync marker */
 		check_prefix(rval, write_sync(w),
 			     "Cannot write sync marker: ");
+		block_target_update(w, w->block_size, w->codec->used_size);
 		/* Reset the datum writer */
 		avro_writer_reset(w->datum_writer);
 		w->block_count = 0;
@@ -575,61 +946,144 @@ static int file_write_block(avro_file_writer_t w)
 	return 0;
 }
 
-int avro_file_writer_append(avro_file_writer_t w, avro_datum_t datum)
+/* Picks up the datum buffer again after the datum writer has grown
+ * it. */
+static void datum_buffer_update(avro_file_writer_t w)
 {
-	int rval;
-	check_param(EINVAL, w, "writer");
-	check_param(EINVAL, datum, "datum");
+	char *buf;
+	int64_t len;
+
+	avro_writer_memory_get_dest(w->datum_writer, &buf, &len);
+	w->datum_buffer = buf;
+	w->datum_buffer_size = len;
+#ifdef AVRO_CODEC_THREADS
+	if (w->pool) {
+		struct codec_block *b =
+		    &w->pool->blocks[w->pool->next_queue % w->pool->block_total];
+		b->data = buf;
+		b->data_size = len;
+	}
+#endif
+}
 
-	rval = avro_write_data(w->datum_writer, w->writers_schema, datum);
+/*
+ * Each value is encoded once, straight after the current block in the
+ * datum buffer, which grows if it has to.  Only then do we decide where
+ * it goes: if it took the block past its target size, the block is
+ * written out without it and the value is moved to the start of the
+ * next one.  A value that is bigger than the target by itself is
+ * written out as a block of its own.
+ */
+static int file_append_finish(avro_file_writer_t w, int64_t start, int rval)
+{
+	int64_t end;
+
+	datum_buffer_update(w);
 	if (rval) {
+		/* Drop whatever part of the value got written */
+		avro_writer_memory_seek(w->datum_writer, start);
+		return rval;
+	}
+
+	end = avro_writer_tell(w->datum_writer);
+	if (start > 0 && (size_t) end > w->block_target) {
+		const char *value = w->datum_buffer + start;
+		int64_t len = end - start;
+
+		/* The value stays where it is in this buffer; with codec
+		 * threads, nothing past the block is read by the thread
+		 * compressing it. */
 		check(rval, file_write_block(w));
-		rval =
-		    avro_write_data(w->datum_writer, w->writers_schema, datum);
-		if (rval) {
-			avro_set_error("Datum too large for file block size");
-			/* TODO: if the datum encoder larger than our buffer,
-			   just write a single large datum */
-			return rval;
+		if (w->datum_buffer_size < (size_t) len) {
+			char *buf = (char *) avro_realloc(w->datum_buffer,
+							  w->datum_buffer_size, len);
+			if (!buf) {
+				avro_set_error("Could not allocate datum buffer");
+				return ENOMEM;
+			}
+			avro_writer_memory_set_dest(w->datum_writer, buf, len);
+			datum_buffer_update(w);
 		}
+		memmove(w->datum_buffer, value, len);
+		avro_writer_memory_seek(w->datum_writer, len);
+		end = len;
 	}
+
 	w->block_count++;
-	w->block_size = avro_writer_tell(w->datum_writer);
+	w->block_size = end;
+	if ((size_t) end > w->block_target) {
+		check(rval, file_write_block(w));
+	} else if (w->max_latency) {
+		/* The clock starts with a block's first value */
+		int64_t now = clock_ms();
+		if (w->block_count == 1) {
+			w->block_opened = now;
+		} else if (now - w->block_opened >= w->max_latency) {
+			check(rval, file_write_block(w));
+		}
+	}
 	return 0;
 }
 
+int avro_file_writer_append(avro_file_writer_t w, avro_datum_t datum)
+{
+	int64_t start;
+	check_param(EINVAL, w, "writer");
+	check_param(EINVAL, datum, "datum");
+
+	start = avro_writer_tell(w->datum_writer);
+	return file_append_finish(w, start,
+	    avro_write_data(w->datum_writer, w->writers_schema, datum));
+}
+
 int
 avro_file_writer_append_value(avro_file_writer_t w, avro_value_t *value)
 {
-	int rval;
+	int64_t start;
 	check_param(EINVAL, w, "writer");
 	check_param(EINVAL, value, "value");
 
-	rval = avro_value_write(w->datum_writer, value);
-	if (rval) {
-		check(rval, file_write_block(w));
-		rval = avro_value_write(w->datum_writer, value);
-		if (rval) {
-			avro_set_error("Value too large for file block size");
-			/* TODO: if the value encoder larger than our buffer,
-			   just write a single large datum */
-			return rval;
-		}
+	start = avro_writer_tell(w->datum_writer);
+	return file_append_finish(w, start,
+	    avro_value_write(w->datum_writer, value));
+}
+
+int
+avro_file_writer_append_encoded(avro_file_writer_t w,
+				const void *buf, int64_t len)
+{
+	int64_t start;
+	check_param(EINVAL, w, "writer");
+	check_param(EINVAL, buf, "buf");
+
+	start = avro_writer_tell(w->datum_writer);
+	return file_append_finish(w, start,
+	    avro_write(w->datum_writer, (void *) buf, len));
+}
+
+/* Ends the current block and waits until every block handed to the
+ * codec threads is in the file. */
+static int file_write_pending(avro_file_writer_t w)
+{
+	int rval;
+	check(rval, file_write_block(w));
+#ifdef AVRO_CODEC_THREADS
+	if (w->pool) {
+		check(rval, codec_pool_drain(w, w->pool->next_queue, 1));
 	}
-	w->block_count++;
-	w->block_size = avro_writer_tell(w->datum_writer);
+#endif
 	return 0;
 }
 
 int avro_file_writer_sync(avro_file_writer_t w)
 {
-	return file_write_block(w);
+	return file_write_pending(w);
 }
 
 int avro_file_writer_flush(avro_file_writer_t w)
 {
 	int rval;
-	check(rval, file_write_block(w));
+	check(rval, file_write_pending(w));
 	avro_writer_flush(w->writer);
 	return 0;
 }
@@ -638,6 +1092,11 @@ int avro_file_writer_close(avro_file_writer_t w)
 {
 	int rval;
 	check(rval, avro_file_writer_flush(w));
+#ifdef AVRO_CODEC_THREADS
+	if (w->pool) {
+		codec_pool_free(w);
+	}
+#endif
 	avro_schema_decref(w->writers_schema);
 	avro_writer_free(w->datum_writer);
 	avro_writer_free(w->writer);
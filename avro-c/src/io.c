@@ -69,6 +69,7 @@ struct _avro_writer_memory_t {
 	const char *buf;
 	int64_t len;
 	int64_t written;
+	int growable;
 };
 
 #define avro_io_typeof(obj)      ((obj)->type)
@@ -168,6 +169,7 @@ avro_writer_t avro_writer_memory(const char *buf, int64_t len)
 	mem_writer->buf = buf;
 	mem_writer->len = len;
 	mem_writer->written = 0;
+	mem_writer->growable = 0;
 	writer_init(&mem_writer->writer, AVRO_MEMORY_IO);
 	return &mem_writer->writer;
 }
@@ -183,6 +185,35 @@ avro_writer_memory_set_dest(avro_writer_t writer, const char *buf, int64_t len)
 	}
 }
 
+void
+avro_writer_memory_set_growable(avro_writer_t writer, int growable)
+{
+	if (is_memory_io(writer)) {
+		avro_writer_to_memory(writer)->growable = growable;
+	}
+}
+
+void
+avro_writer_memory_get_dest(avro_writer_t writer, char **buf, int64_t *len)
+{
+	if (is_memory_io(writer)) {
+		struct _avro_writer_memory_t *mem_writer = avro_writer_to_memory(writer);
+		*buf = (char *) mem_writer->buf;
+		*len = mem_writer->len;
+	}
+}
+
+void
+avro_writer_memory_seek(avro_writer_t writer, int64_t offset)
+{
+	if (is_memory_io(writer)) {
+		struct _avro_writer_memory_t *mem_writer = avro_writer_to_memory(writer);
+		if (offset >= 0 && offset <= mem_writer->len) {
+			mem_writer->written = offset;
+		}
+	}
+}
+
 static int
 avro_read_memory(struct _avro_reader_memory_t *reader, void *buf, int64_t len)
 {
@@ -323,10 +354,37 @@ int avro_skip(avro_reader_t reader, int64_t len)
 	return 0;
 }
 
+static int
+avro_grow_memory(struct _avro_writer_memory_t *writer, int64_t len)
+{
+	int64_t new_len = writer->len * 2;
+	char *new_buf;
+
+	if (new_len < writer->written + len) {
+		new_len = writer->written + len;
+	}
+	new_buf = (char *) avro_realloc((void *) writer->buf,
+					writer->len, new_len);
+	if (!new_buf) {
+		avro_set_error("Cannot grow memory buffer to %" PRIsz " bytes",
+			       (size_t) new_len);
+		return ENOMEM;
+	}
+	writer->buf = new_buf;
+	writer->len = new_len;
+	return 0;
+}
+
 static int
 avro_write_memory(struct _avro_writer_memory_t *writer, void *buf, int64_t len)
 {
 	if (len) {
+		if ((writer->len - writer->written) < len && writer->growable) {
+			int rval = avro_grow_memory(writer, len);
+			if (rval) {
+				return rval;
+			}
+		}
 		if ((writer->len - writer->written) < len) {
 			avro_set_error("Cannot write %" PRIsz " bytes in memory buffer",
 				       (size_t) len);
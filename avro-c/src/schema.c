@@ -494,6 +494,14 @@ int avro_schema_enum_get_by_name(const avro_schema_t enump,
 	}
 }
 
+int avro_schema_enum_number_of_symbols(const avro_schema_t enump)
+{
+	check_param(EINVAL, is_avro_schema(enump), "enum schema");
+	check_param(EINVAL, is_avro_enum(enump), "enum schema");
+
+	return avro_schema_to_enum(enump)->symbols->num_entries;
+}
+
 int
 avro_schema_enum_symbol_append(const avro_schema_t enum_schema,
 			       const char *symbol)
@@ -0,0 +1,82 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to you under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.  See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "crc32.h"
+
+/* Checks avro_crc32() against a bit-at-a-time CRC over every length up
+ * to a few folding blocks, at every alignment, and in pieces. */
+
+#define BUF_SIZE 1100
+
+static uint32_t
+crc32_bitwise(uint32_t crc, const unsigned char *p, size_t len)
+{
+	int  i;
+
+	crc = ~crc;
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++) {
+			crc = (crc >> 1) ^ (0xedb88320U & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+int main(void)
+{
+	static unsigned char  buf[BUF_SIZE + 16];
+	size_t  i, off, len;
+	uint32_t  expected, crc;
+
+	srand(1165);
+	for (i = 0; i < sizeof(buf); i++) {
+		buf[i] = (unsigned char) rand();
+	}
+
+	if (avro_crc32(0, "123456789", 9) != 0xcbf43926U) {
+		fprintf(stderr, "Wrong CRC-32 of \"123456789\"\n");
+		return EXIT_FAILURE;
+	}
+
+	for (off = 0; off < 16; off++) {
+		for (len = 0; len <= BUF_SIZE; len++) {
+			expected = crc32_bitwise(0, buf + off, len);
+			crc = avro_crc32(0, buf + off, len);
+			if (crc != expected) {
+				fprintf(stderr, "CRC-32 mismatch at offset %lu, "
+					"length %lu: %08lx, expected %08lx\n",
+					(unsigned long) off, (unsigned long) len,
+					(unsigned long) crc, (unsigned long) expected);
+				return EXIT_FAILURE;
+			}
+			crc = avro_crc32(avro_crc32(0, buf + off, len / 3),
+					 buf + off + len / 3, len - len / 3);
+			if (crc != expected) {
+				fprintf(stderr, "Split CRC-32 mismatch at offset %lu, "
+					"length %lu\n",
+					(unsigned long) off, (unsigned long) len);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,434 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to you under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.  See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <avro.h>
+#include "codec.h"
+#include "encoding.h"
+
+/* Round-trips records through the container file writer with each
+ * available codec, a small block size, codec threads and values that
+ * were encoded up front, with default and tuned codec options, and
+ * with blocks sized by their compressed size, which must settle at
+ * about the target.  Now and then a record is bigger than a whole
+ * block.  Also checks that a latency limit ends blocks. */
+
+#define RECORD_COUNT 5000
+#define BIG_NAME_SIZE 5000
+
+/* Enough records for blocks sized by their compressed size to settle */
+#define TARGET_RECORD_COUNT 20000
+#define BLOCK_TARGET 2048
+
+static const char  *dbname = "test_avro_datafile.db";
+
+static const char  SCHEMA[] =
+"{\"type\":\"record\",\
+  \"name\":\"Event\",\
+  \"fields\":[\
+     {\"name\": \"id\", \"type\": \"long\"},\
+     {\"name\": \"name\", \"type\": \"string\"}]}";
+
+static avro_schema_t  schema;
+static avro_value_iface_t  *iface;
+
+#define try(call, msg) \
+	do { \
+		if (call) { \
+			fprintf(stderr, msg ":\n  %s\n", avro_strerror()); \
+			exit(EXIT_FAILURE); \
+		} \
+	} while (0)
+
+static void
+fill_record(avro_value_t *record, int64_t i)
+{
+	static char  name[BIG_NAME_SIZE + 64];
+	avro_value_t  field;
+
+	snprintf(name, sizeof(name), "event number %" PRId64, i);
+	if (i % 700 == 699) {
+		/* Bigger than the block size */
+		size_t  len = strlen(name);
+		memset(name + len, 'x', BIG_NAME_SIZE);
+		name[len + BIG_NAME_SIZE] = '\0';
+	}
+	try(avro_value_get_by_index(record, 0, &field, NULL),
+	    "Cannot get id field");
+	try(avro_value_set_long(&field, i), "Cannot set id");
+	try(avro_value_get_by_index(record, 1, &field, NULL),
+	    "Cannot get name field");
+	try(avro_value_set_string(&field, name), "Cannot set name");
+}
+
+/* Whether the library was built with codec */
+static int
+codec_available(const char *codec)
+{
+	struct avro_codec_t_  c;
+
+	if (avro_codec(&c, codec)) {
+		return 0;
+	}
+	avro_codec_reset(&c);
+	return 1;
+}
+
+static int
+write_file(const char *codec, const struct avro_codec_options *options,
+	   int thread_count, size_t compressed_size, int64_t record_count)
+{
+	avro_file_writer_t  writer;
+	avro_writer_t  encoder;
+	avro_value_t  record;
+	char  buf[BIG_NAME_SIZE + 256];
+	int64_t  i;
+	int  rval;
+
+	if (!codec_available(codec)) {
+		return 0;
+	}
+
+	remove(dbname);
+	try(avro_file_writer_create_with_codec_options_fp(NULL, dbname, 1,
+							  schema, &writer,
+							  codec, options, 1024),
+	    "Cannot create writer");
+
+	rval = avro_file_writer_set_codec_threads(writer, thread_count);
+	if (rval == ENOSYS) {
+		thread_count = 0;
+	} else {
+		try(rval, "Cannot start codec threads");
+	}
+	if (compressed_size) {
+		try(avro_file_writer_set_block_target(writer, compressed_size, 0),
+		    "Cannot set block target");
+	}
+
+	encoder = avro_writer_memory(buf, sizeof(buf));
+	try(avro_generic_value_new(iface, &record), "Cannot create record");
+	for (i = 0; i < record_count; i++) {
+		avro_value_reset(&record);
+		fill_record(&record, i);
+		if (i % 2) {
+			try(avro_file_writer_append_value(writer, &record),
+			    "Cannot append value");
+		} else {
+			avro_writer_reset(encoder);
+			try(avro_value_write(encoder, &record),
+			    "Cannot encode value");
+			try(avro_file_writer_append_encoded(writer, buf,
+							    avro_writer_tell(encoder)),
+			    "Cannot append encoded value");
+		}
+	}
+	avro_value_decref(&record);
+	avro_writer_free(encoder);
+	try(avro_file_writer_close(writer), "Cannot close writer");
+
+	fprintf(stderr, "Wrote %" PRId64 " records with codec %s, %d threads\n",
+		record_count, codec, thread_count);
+	return 1;
+}
+
+/* Reads the record count and compressed size of each block in the
+ * file, up to max_blocks of them, and returns the number of blocks */
+static int
+read_blocks(int64_t *counts, int64_t *sizes, int max_blocks)
+{
+	avro_schema_t  meta_values_schema;
+	avro_schema_t  meta_schema;
+	avro_value_iface_t  *meta_iface;
+	avro_value_t  meta;
+	avro_reader_t  reader;
+	FILE  *fp;
+	char  magic[4];
+	char  sync[16];
+	int64_t  count;
+	int64_t  size;
+	int  n = 0;
+
+	fp = fopen(dbname, "rb");
+	if (!fp) {
+		perror("Cannot open file");
+		exit(EXIT_FAILURE);
+	}
+	reader = avro_reader_file(fp);
+
+	meta_values_schema = avro_schema_bytes();
+	meta_schema = avro_schema_map(meta_values_schema);
+	meta_iface = avro_generic_class_from_schema(meta_schema);
+	try(avro_generic_value_new(meta_iface, &meta), "Cannot create header");
+	try(avro_read(reader, magic, sizeof(magic)) ||
+	    avro_value_read(reader, &meta) ||
+	    avro_read(reader, sync, sizeof(sync)), "Cannot read file header");
+
+	while (avro_binary_encoding.read_long(reader, &count) == 0) {
+		if (n == max_blocks) {
+			fprintf(stderr, "More than %d blocks in file\n", max_blocks);
+			exit(EXIT_FAILURE);
+		}
+		try(avro_binary_encoding.read_long(reader, &size) ||
+		    avro_skip(reader, size) ||
+		    avro_read(reader, sync, sizeof(sync)), "Cannot read block");
+		counts[n] = count;
+		sizes[n] = size;
+		n++;
+	}
+
+	avro_value_decref(&meta);
+	avro_value_iface_decref(meta_iface);
+	avro_schema_decref(meta_schema);
+	avro_schema_decref(meta_values_schema);
+	avro_reader_free(reader);
+	return n;
+}
+
+/* The blocks after the first few must compress to about the target.
+ * Leaves out the last block, which the end of the records cuts short,
+ * and a big record that went into a block of its own along with the
+ * block it ended.  Codec threads learn the ratio a few blocks late. */
+static void
+check_block_sizes(const char *codec, int thread_count, size_t compressed_size)
+{
+	static int64_t  counts[TARGET_RECORD_COUNT];
+	static int64_t  sizes[TARGET_RECORD_COUNT];
+	int64_t  total = 0;
+	int64_t  tolerance;
+	int  checked = 0;
+	int  n, i;
+
+	n = read_blocks(counts, sizes, TARGET_RECORD_COUNT);
+	/* Skip the first half while the ratio is learned */
+	for (i = n / 2; i < n - 1; i++) {
+		if (counts[i] == 1 || counts[i + 1] == 1) {
+			continue;
+		}
+		if (sizes[i] < (int64_t) compressed_size / 2 ||
+		    sizes[i] > (int64_t) compressed_size * 2) {
+			fprintf(stderr, "Block %d of %d is %" PRId64 " bytes with "
+				"codec %s, target %" PRIsz "\n", i, n, sizes[i],
+				codec, compressed_size);
+			exit(EXIT_FAILURE);
+		}
+		total += sizes[i];
+		checked++;
+	}
+
+	tolerance = compressed_size / (thread_count ? 4 : 8);
+	if (checked < 4 ||
+	    total / checked < (int64_t) compressed_size - tolerance ||
+	    total / checked > (int64_t) compressed_size + tolerance) {
+		fprintf(stderr, "Blocks average %" PRId64 " bytes over %d of %d "
+			"blocks with codec %s, target %" PRIsz "\n",
+			checked ? total / checked : 0, checked, n, codec,
+			compressed_size);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Busy waits for at least ms milliseconds of wall time */
+static void
+spin(int ms)
+{
+	clock_t  start = clock();
+
+	while (clock() - start < (clock_t) ms * CLOCKS_PER_SEC / 1000) {
+	}
+}
+
+/* A block stays open until the next value appended after the latency
+ * limit, however far it is from its target size */
+static void
+check_latency(int max_latency_ms)
+{
+	avro_file_writer_t  writer;
+	avro_value_t  record;
+	int64_t  counts[4];
+	int64_t  sizes[4];
+	int64_t  i;
+	int  n;
+
+	remove(dbname);
+	try(avro_file_writer_create_with_codec_options_fp(NULL, dbname, 1,
+							  schema, &writer,
+							  "null", NULL,
+							  1024 * 1024),
+	    "Cannot create writer");
+	try(avro_file_writer_set_block_target(writer, 0, max_latency_ms),
+	    "Cannot set block target");
+
+	try(avro_generic_value_new(iface, &record), "Cannot create record");
+	for (i = 0; i < 30; i++) {
+		if (i == 10 || i == 20) {
+			spin(100);
+		}
+		avro_value_reset(&record);
+		fill_record(&record, i);
+		try(avro_file_writer_append_value(writer, &record),
+		    "Cannot append value");
+	}
+	avro_value_decref(&record);
+	try(avro_file_writer_close(writer), "Cannot close writer");
+
+	n = read_blocks(counts, sizes, 4);
+	if (max_latency_ms ?
+	    n != 3 || counts[0] != 11 || counts[1] != 10 || counts[2] != 9 :
+	    n != 1 || counts[0] != 30) {
+		fprintf(stderr, "Wrong blocks with a latency limit of %d ms\n",
+			max_latency_ms);
+		exit(EXIT_FAILURE);
+	}
+	remove(dbname);
+}
+
+static void
+check_file(const char *codec, int64_t record_count)
+{
+	avro_file_reader_t  reader;
+	avro_value_t  actual;
+	avro_value_t  expected;
+	int64_t  i;
+
+	try(avro_file_reader(dbname, &reader), "Cannot open file");
+	try(avro_generic_value_new(iface, &actual), "Cannot create record");
+	try(avro_generic_value_new(iface, &expected), "Cannot create record");
+	for (i = 0; i < record_count; i++) {
+		avro_value_reset(&expected);
+		fill_record(&expected, i);
+		try(avro_file_reader_read_value(reader, &actual),
+		    "Cannot read value");
+		if (!avro_value_equal(&expected, &actual)) {
+			fprintf(stderr, "Record %" PRId64 " differs with codec %s\n",
+				i, codec);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (avro_file_reader_read_value(reader, &actual) == 0) {
+		fprintf(stderr, "Extra records in file with codec %s\n", codec);
+		exit(EXIT_FAILURE);
+	}
+	avro_value_decref(&actual);
+	avro_value_decref(&expected);
+	avro_file_reader_close(reader);
+	remove(dbname);
+}
+
+/* Options out of a codec's range must be refused, not clamped */
+static void
+check_bad_options(const char *codec)
+{
+	static const struct avro_codec_options  bad[] = {
+		{ 99, 0, 0 },		/* level */
+		{ -99999999, 0, 0 },
+		{ 0, 40, 0 },		/* window */
+		{ 0, 5, 0 },
+		{ 0, 0, 99 },		/* strategy */
+		{ 0, 0, -1 }
+	};
+	avro_file_writer_t  writer;
+	size_t  i;
+
+	if (!codec_available(codec)) {
+		return;
+	}
+
+	for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+		remove(dbname);
+		if (avro_file_writer_create_with_codec_options_fp(NULL, dbname, 1,
+								  schema, &writer,
+								  codec, &bad[i],
+								  1024) == 0) {
+			fprintf(stderr, "Codec %s accepted level %d, window %d, "
+				"strategy %d\n", codec, bad[i].level,
+				bad[i].window, bad[i].strategy);
+			exit(EXIT_FAILURE);
+		}
+	}
+	remove(dbname);
+}
+
+/* Levels go through struct avro_codec_options, not the codec name */
+static void
+check_bad_names(void)
+{
+	static const char  *bad[] = {
+		"zstd:3", "zstandard:19", "deflate:6", "zstdx", "", NULL
+	};
+	avro_file_writer_t  writer;
+	int  i;
+
+	for (i = 0; bad[i]; i++) {
+		remove(dbname);
+		if (avro_file_writer_create_with_codec(dbname, schema, &writer,
+						       bad[i], 1024) == 0) {
+			fprintf(stderr, "Codec name \"%s\" was accepted\n",
+				bad[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	remove(dbname);
+}
+
+int main(void)
+{
+	static const char  *codecs[] = {
+		"null", "deflate", "lzma", "snappy", "zstandard", NULL
+	};
+	/* Level 1, a 4 KB window and strategy 1 suit every codec */
+	static const struct avro_codec_options  tuned = { 1, 12, 1 };
+	int  i;
+	int  threads;
+
+	try(avro_schema_from_json_literal(SCHEMA, &schema),
+	    "Cannot parse schema");
+	iface = avro_generic_class_from_schema(schema);
+
+	check_bad_names();
+	for (i = 0; codecs[i]; i++) {
+		if (strcmp(codecs[i], "null") && strcmp(codecs[i], "snappy")) {
+			check_bad_options(codecs[i]);
+		}
+		for (threads = 0; threads <= 3; threads += 3) {
+			if (write_file(codecs[i], NULL, threads, 0,
+				       RECORD_COUNT)) {
+				check_file(codecs[i], RECORD_COUNT);
+			}
+			if (write_file(codecs[i], &tuned, threads, 0,
+				       RECORD_COUNT)) {
+				check_file(codecs[i], RECORD_COUNT);
+			}
+			if (write_file(codecs[i], NULL, threads, BLOCK_TARGET,
+				       TARGET_RECORD_COUNT)) {
+				check_block_sizes(codecs[i], threads, BLOCK_TARGET);
+				check_file(codecs[i], TARGET_RECORD_COUNT);
+			}
+		}
+	}
+
+	check_latency(0);
+	check_latency(50);
+
+	avro_value_iface_decref(iface);
+	avro_schema_decref(schema);
+	return EXIT_SUCCESS;
+}
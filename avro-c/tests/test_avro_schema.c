@@ -154,6 +154,11 @@ static int test_enum(void)
 		exit(EXIT_FAILURE);
 	}
 
+	if (avro_schema_enum_number_of_symbols(schema) != 5) {
+		fprintf(stderr, "Unexpected number of enum schema symbols\n");
+		exit(EXIT_FAILURE);
+	}
+
 	avro_schema_decref(schema);
 	return 0;
 }
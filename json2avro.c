@@ -15,20 +15,24 @@
  *
  */
 
-/*
- * TODO
- * Enums
- *
- */
-
+#include <ctype.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <jansson.h>
 #include <avro.h>
 
 #define MAX_SCHEMA_LEN ((off_t) 1024*1024)
+#define BATCH_SIZE (1024*1024)
+
+/* \u0000 decodes to a NUL byte inside strings and bytes */
+#define LOAD_FLAGS (JSON_DISABLE_EOF_CHECK | JSON_ALLOW_NUL)
 
 char *read_schema_file(char *file_name) {
     FILE *schema_file = fopen(file_name, "rt");
@@ -70,17 +74,524 @@ void memory_status() {
     fclose(f);
 }
 
-int schema_traverse(const avro_schema_t schema, json_t *json, json_t *dft,
-                    avro_value_t *current_val, int quiet, int strjson, size_t max_str_sz) {
+static void *xrealloc(void *ptr, size_t size) {
+    void *p = realloc(ptr, size);
+    if (!p) {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/*
+ * Conversion plan
+ *
+ * Before any input is read, the schema is compiled into a flat array
+ * of plan nodes, one for every place a value can appear. The fields of
+ * a record and the branches of a union occupy consecutive nodes, so a
+ * node's position within that range is the Avro field or branch index.
+ * Field nodes also carry the field name, its precomputed hash and the
+ * field default, so converting a record does no schema lookups at all.
+ * Field names are interned in a frozen jansson key table that every
+ * input stream shares, so the objects jansson builds hold the very
+ * same key pointers and finding a field compares no strings.
+ * Named records that the schema refers back to share the field range
+ * of their definition, which makes recursive schemas work.
+ */
+
+enum plan_op {
+    OP_RECORD, OP_STRING, OP_BYTES, OP_INT, OP_LONG, OP_FLOAT, OP_DOUBLE,
+    OP_BOOLEAN, OP_NULL, OP_ENUM, OP_ARRAY, OP_MAP, OP_UNION, OP_FIXED,
+    OP_SYMBOL           /* an enum symbol, which only has a name */
+};
 
-    json = json ? json : dft;
-    if (!json) {
-        fprintf(stderr, "ERROR: Avro schema does not match JSON\n");
-        return 1;
+typedef struct plan_node {
+    int op;
+    avro_schema_t schema;
+    int child;          /* record: first field; union: first branch;
+                           enum: first symbol; array, map: items or values */
+    int nchildren;      /* record: field count; union: branch count;
+                           enum: symbol count */
+    int table;          /* record, enum: name lookup table, see plan_lookup();
+                           union: candidates, see plan_candidates() */
+    size_t table_mask;
+    const char *name;   /* field or symbol name, hash and default, if */
+    size_t name_len;    /* this node is a record field or enum symbol */
+    size_t hash;
+    json_t *dft;
+    avro_value_iface_t *iface;
+    avro_value_t dft_val;  /* the default converted, and in Avro binary; */
+    char *dft_bin;         /* self is NULL if the default does not */
+    size_t dft_bin_len;    /* convert */
+} plan_node_t;
+
+typedef struct plan {
+    plan_node_t *nodes;
+    int len, cap;
+    avro_schema_t *records;  /* compiled records and their field ranges */
+    int *record_nodes;
+    int nrecords;
+    int *tables;             /* field tables and union candidates */
+    int tables_len;
+    json_keys_t *keys;       /* interned field names */
+    int strjson;
+    int enum_default;        /* -u */
+    size_t max_str_sz;
+    int lazy;                /* -e lazy */
+} plan_t;
+
+/* FNV-1a, for keys that are not NUL-terminated */
+static size_t key_hash(const char *key, size_t len) {
+    size_t hash = 2166136261u;
+    while (len--)
+        hash = (hash ^ (unsigned char) *key++) * 16777619u;
+    return hash;
+}
+
+static int plan_alloc(plan_t *plan, int count) {
+    int first = plan->len;
+    if (plan->len + count > plan->cap) {
+        plan->cap = (plan->len + count) * 2;
+        plan->nodes = xrealloc(plan->nodes, plan->cap * sizeof(plan_node_t));
+    }
+    memset(plan->nodes + first, 0, count * sizeof(plan_node_t));
+    plan->len += count;
+    return first;
+}
+
+static int plan_alloc_table(plan_t *plan, size_t size) {
+    int first = plan->tables_len;
+    plan->tables = xrealloc(plan->tables, (plan->tables_len + size) * sizeof(int));
+    plan->tables_len += size;
+    return first;
+}
+
+/* Builds the table plan_lookup() looks field or symbol names up in.
+   It is open addressed, with -1 marking a free entry, and has at least
+   twice as many entries as there are names. */
+static void plan_compile_table(plan_t *plan, plan_node_t *record) {
+    size_t size = 2, i;
+    int f;
+
+    while (size < 2 * (size_t) record->nchildren)
+        size *= 2;
+    record->table = plan_alloc_table(plan, size);
+    record->table_mask = size - 1;
+
+    int *table = plan->tables + record->table;
+    for (i = 0; i < size; i++)
+        table[i] = -1;
+    for (f = 0; f < record->nchildren; f++) {
+        const plan_node_t *field = &plan->nodes[record->child + f];
+        i = key_hash(field->name, field->name_len) & record->table_mask;
+        while (table[i] >= 0)
+            i = (i + 1) & record->table_mask;
+        table[i] = f;
+    }
+}
+
+/* Returns the index of the field called key in a record, or of the
+   symbol key in an enum, or -1. The caller's guess, usually the field
+   after the previous one, is tried before the table. */
+static int plan_lookup(const plan_t *plan, const plan_node_t *record,
+                      const char *key, size_t len, int guess) {
+    const plan_node_t *fields = &plan->nodes[record->child];
+    const int *table = plan->tables + record->table;
+    size_t i;
+
+    if (guess < record->nchildren && fields[guess].name_len == len &&
+        !memcmp(fields[guess].name, key, len))
+        return guess;
+
+    for (i = key_hash(key, len) & record->table_mask; table[i] >= 0;
+         i = (i + 1) & record->table_mask) {
+        const plan_node_t *field = &fields[table[i]];
+        if (field->name_len == len && !memcmp(field->name, key, len))
+            return table[i];
     }
+    return -1;
+}
+
+#define JSON_TYPES (JSON_NULL + 1)
+
+enum { ACCEPTS_NEVER, ACCEPTS_MAYBE, ACCEPTS_ALWAYS };
+
+/* Whether a value of the given operation can be converted from a JSON
+   value of the given type, judging by the type alone */
+static int plan_accepts(const plan_t *plan, int op, int type) {
+    switch (op) {
+    case OP_RECORD:
+    case OP_MAP:
+        return type == JSON_OBJECT ? ACCEPTS_MAYBE : ACCEPTS_NEVER;
+    case OP_ARRAY:
+        return type == JSON_ARRAY ? ACCEPTS_MAYBE : ACCEPTS_NEVER;
+    case OP_FIXED:
+    case OP_ENUM:
+        return type == JSON_STRING ? ACCEPTS_MAYBE : ACCEPTS_NEVER;
+    case OP_STRING:
+        return type == JSON_STRING || plan->strjson ? ACCEPTS_ALWAYS : ACCEPTS_NEVER;
+    case OP_BYTES:
+        return type == JSON_STRING ? ACCEPTS_ALWAYS : ACCEPTS_NEVER;
+    case OP_INT:
+    case OP_LONG:
+        return type == JSON_INTEGER ? ACCEPTS_ALWAYS : ACCEPTS_NEVER;
+    case OP_FLOAT:
+    case OP_DOUBLE:
+        return type == JSON_INTEGER || type == JSON_REAL ? ACCEPTS_ALWAYS : ACCEPTS_NEVER;
+    case OP_BOOLEAN:
+        return type == JSON_TRUE || type == JSON_FALSE ? ACCEPTS_ALWAYS : ACCEPTS_NEVER;
+    case OP_NULL:
+        return type == JSON_NULL ? ACCEPTS_ALWAYS : ACCEPTS_NEVER;
+    }
+    return ACCEPTS_NEVER;
+}
+
+/* For every JSON type, lists the union branches that might take a
+   value of that type, in branch order and terminated by -1. The list
+   ends early at a branch that is sure to take it, so only the
+   ambiguous cases, say two records in one union, are left to trial
+   and error. */
+static void plan_compile_candidates(plan_t *plan, int idx) {
+    int type, i, n;
+    int size = plan->nodes[idx].nchildren + 1;
+    int first = plan_alloc_table(plan, JSON_TYPES * size);
+
+    plan->nodes[idx].table = first;
+    for (type = 0; type < JSON_TYPES; type++) {
+        int *candidates = plan->tables + first + type * size;
+        for (i = 0, n = 0; i < plan->nodes[idx].nchildren; i++) {
+            int accepts = plan_accepts(plan, plan->nodes[plan->nodes[idx].child + i].op, type);
+            if (accepts != ACCEPTS_NEVER)
+                candidates[n++] = i;
+            if (accepts == ACCEPTS_ALWAYS)
+                break;
+        }
+        candidates[n] = -1;
+    }
+}
+
+static const int *plan_candidates(const plan_t *plan, const plan_node_t *node, int type) {
+    return plan->tables + node->table + type * (node->nchildren + 1);
+}
+
+static int plan_compile_node(plan_t *plan, int idx, avro_schema_t schema) {
+    size_t i;
+    int first;
+
+    if (is_avro_link(schema))
+        schema = avro_schema_link_target(schema);
+    plan->nodes[idx].schema = schema;
 
     switch (schema->type) {
     case AVRO_RECORD:
+        plan->nodes[idx].op = OP_RECORD;
+        for (i = 0; i < (size_t) plan->nrecords; i++) {
+            if (plan->records[i] == schema) {
+                const plan_node_t *record = &plan->nodes[plan->record_nodes[i]];
+                plan->nodes[idx].child = record->child;
+                plan->nodes[idx].nchildren = record->nchildren;
+                plan->nodes[idx].table = record->table;
+                plan->nodes[idx].table_mask = record->table_mask;
+                return 0;
+            }
+        }
+
+        /* Reserve the field range and name the fields first, so that
+           references back to this record from within its fields can
+           find it */
+        plan->nodes[idx].nchildren = avro_schema_record_size(schema);
+        first = plan_alloc(plan, plan->nodes[idx].nchildren);
+        plan->nodes[idx].child = first;
+        plan->records = xrealloc(plan->records, (plan->nrecords + 1) * sizeof(avro_schema_t));
+        plan->record_nodes = xrealloc(plan->record_nodes, (plan->nrecords + 1) * sizeof(int));
+        plan->records[plan->nrecords] = schema;
+        plan->record_nodes[plan->nrecords++] = idx;
+
+        for (i = 0; i < avro_schema_record_size(schema); i++) {
+            plan_node_t *field = &plan->nodes[first + i];
+            const char *name = avro_schema_record_field_name(schema, i);
+            field->name = json_keys_intern(plan->keys, name);
+            if (!field->name)
+                field->name = name;
+            field->name_len = strlen(field->name);
+            field->hash = json_object_key_hash(field->name);
+            field->dft = avro_schema_record_field_default_get_by_index(schema, i);
+        }
+        plan_compile_table(plan, &plan->nodes[idx]);
+
+        for (i = 0; i < avro_schema_record_size(schema); i++)
+            if (plan_compile_node(plan, first + i, avro_schema_record_field_get_by_index(schema, i)))
+                return 1;
+        break;
+
+    case AVRO_STRING:  plan->nodes[idx].op = OP_STRING;  break;
+    case AVRO_BYTES:   plan->nodes[idx].op = OP_BYTES;   break;
+    case AVRO_INT32:   plan->nodes[idx].op = OP_INT;     break;
+    case AVRO_INT64:   plan->nodes[idx].op = OP_LONG;    break;
+    case AVRO_FLOAT:   plan->nodes[idx].op = OP_FLOAT;   break;
+    case AVRO_DOUBLE:  plan->nodes[idx].op = OP_DOUBLE;  break;
+    case AVRO_BOOLEAN: plan->nodes[idx].op = OP_BOOLEAN; break;
+    case AVRO_NULL:    plan->nodes[idx].op = OP_NULL;    break;
+    case AVRO_FIXED:   plan->nodes[idx].op = OP_FIXED;   break;
+
+    case AVRO_ENUM:
+        plan->nodes[idx].op = OP_ENUM;
+        plan->nodes[idx].nchildren = avro_schema_enum_number_of_symbols(schema);
+        first = plan_alloc(plan, plan->nodes[idx].nchildren);
+        plan->nodes[idx].child = first;
+        for (i = 0; i < (size_t) plan->nodes[idx].nchildren; i++) {
+            plan_node_t *symbol = &plan->nodes[first + i];
+            symbol->op = OP_SYMBOL;
+            symbol->name = avro_schema_enum_get(schema, i);
+            symbol->name_len = strlen(symbol->name);
+        }
+        plan_compile_table(plan, &plan->nodes[idx]);
+        break;
+
+    case AVRO_ARRAY:
+    case AVRO_MAP:
+        plan->nodes[idx].op = schema->type == AVRO_ARRAY ? OP_ARRAY : OP_MAP;
+        first = plan_alloc(plan, 1);
+        plan->nodes[idx].child = first;
+        return plan_compile_node(plan, first, schema->type == AVRO_ARRAY ?
+                                 avro_schema_array_items(schema) : avro_schema_map_values(schema));
+
+    case AVRO_UNION:
+        plan->nodes[idx].op = OP_UNION;
+        plan->nodes[idx].nchildren = avro_schema_union_size(schema);
+        first = plan_alloc(plan, plan->nodes[idx].nchildren);
+        plan->nodes[idx].child = first;
+        for (i = 0; i < avro_schema_union_size(schema); i++)
+            if (plan_compile_node(plan, first + i, avro_schema_union_branch(schema, i)))
+                return 1;
+        plan_compile_candidates(plan, idx);
+        break;
+
+    default:
+        fprintf(stderr, "ERROR: Unknown type: %d\n", schema->type);
+        return 1;
+    }
+    return 0;
+}
+
+int plan_traverse(const plan_t *plan, const plan_node_t *node, json_t *json,
+                  avro_value_t *current_val, int quiet);
+
+/* Converts the default of a field once, into a value plan_traverse()
+   copies into records that lack the field and into Avro binary for the
+   streaming engine. A default that does not convert is left as it is;
+   the field is then effectively required. */
+static void plan_convert_default(plan_t *plan, plan_node_t *field) {
+    avro_value_t val;
+    avro_writer_t writer;
+    size_t size;
+
+    if (avro_generic_value_new(field->iface, &val)) {
+        fprintf(stderr, "ERROR: Unable to create Avro value from schema: %s\n", avro_strerror());
+        exit(EXIT_FAILURE);
+    }
+    if (plan_traverse(plan, field, NULL, &val, 1)) {
+        avro_value_decref(&val);
+        return;
+    }
+
+    if (avro_value_sizeof(&val, &size)) {
+        fprintf(stderr, "ERROR: Unable to size field default: %s\n", avro_strerror());
+        exit(EXIT_FAILURE);
+    }
+    /* a null default encodes to nothing */
+    field->dft_bin = size ? xrealloc(NULL, size) : NULL;
+    writer = avro_writer_memory(field->dft_bin, size);
+    if (!writer || avro_value_write(writer, &val)) {
+        fprintf(stderr, "ERROR: Unable to encode field default: %s\n", avro_strerror());
+        exit(EXIT_FAILURE);
+    }
+    avro_writer_free(writer);
+    field->dft_bin_len = size;
+    field->dft_val = val;
+}
+
+/* Finds the value implementation of every field with a default by
+   walking a scratch value of the whole schema along with the plan. The
+   schema of a field cannot go to avro_generic_class_from_schema() by
+   itself, since it may refer to named types defined elsewhere. */
+static void plan_find_ifaces(plan_t *plan, int idx, avro_value_t *val, char *visited) {
+    plan_node_t *node = &plan->nodes[idx];
+    avro_value_t child;
+    int i;
+
+    if (node->dft)
+        node->iface = avro_value_iface_incref(val->iface);
+
+    switch (node->op) {
+    case OP_RECORD:
+        if (visited[node->child])
+            break;
+        visited[node->child] = 1;
+        for (i = 0; i < node->nchildren; i++) {
+            avro_value_get_by_index(val, i, &child, NULL);
+            plan_find_ifaces(plan, node->child + i, &child, visited);
+        }
+        break;
+    case OP_ARRAY:
+        avro_value_append(val, &child, NULL);
+        plan_find_ifaces(plan, node->child, &child, visited);
+        break;
+    case OP_MAP:
+        avro_value_add(val, "", &child, NULL, NULL);
+        plan_find_ifaces(plan, node->child, &child, visited);
+        break;
+    case OP_UNION:
+        for (i = 0; i < node->nchildren; i++) {
+            avro_value_set_branch(val, i, &child);
+            plan_find_ifaces(plan, node->child + i, &child, visited);
+        }
+        break;
+    }
+}
+
+/* The root of the plan is always node 0 */
+int plan_compile(plan_t *plan, avro_schema_t schema, int strjson, int enum_default,
+                 size_t max_str_sz, int lazy) {
+    int i;
+
+    memset(plan, 0, sizeof(plan_t));
+    plan->strjson = strjson;
+    plan->enum_default = enum_default;
+    plan->max_str_sz = max_str_sz;
+    plan->lazy = lazy;
+    plan->keys = json_keys_new();
+    if (!plan->keys) {
+        fprintf(stderr, "ERROR: Unable to allocate JSON key table\n");
+        exit(EXIT_FAILURE);
+    }
+    if (plan_compile_node(plan, plan_alloc(plan, 1), schema))
+        return 1;
+    json_keys_freeze(plan->keys);
+
+    avro_value_iface_t *iface = avro_generic_class_from_schema(schema);
+    avro_value_t val;
+    char *visited = calloc(plan->len, 1);
+    if (!iface || avro_generic_value_new(iface, &val) || !visited) {
+        fprintf(stderr, "ERROR: Unable to create Avro value from schema: %s\n", avro_strerror());
+        exit(EXIT_FAILURE);
+    }
+    plan_find_ifaces(plan, 0, &val, visited);
+    free(visited);
+    avro_value_decref(&val);
+
+    for (i = 0; i < plan->len; i++)
+        if (plan->nodes[i].dft)
+            plan_convert_default(plan, &plan->nodes[i]);
+    avro_value_iface_decref(iface);
+    return 0;
+}
+
+void plan_free(plan_t *plan) {
+    int i;
+
+    for (i = 0; i < plan->len; i++) {
+        if (plan->nodes[i].dft_val.self)
+            avro_value_decref(&plan->nodes[i].dft_val);
+        if (plan->nodes[i].iface)
+            avro_value_iface_decref(plan->nodes[i].iface);
+        free(plan->nodes[i].dft_bin);
+    }
+    free(plan->nodes);
+    free(plan->records);
+    free(plan->record_nodes);
+    free(plan->tables);
+    json_keys_free(plan->keys);
+}
+
+/* Copies a converted default into place. Unlike avro_value_copy(), it
+   copies strings into the memory the destination already has. */
+static int plan_copy(const plan_t *plan, const plan_node_t *node,
+                     avro_value_t *src, avro_value_t *dest) {
+    avro_value_t src_child, dest_child;
+    const char *key;
+    const void *buf;
+    size_t size, i;
+    int32_t i32;
+    int64_t i64;
+    float f;
+    double d;
+    int disc;
+
+    switch (node->op) {
+    case OP_RECORD:
+        for (i = 0; i < (size_t) node->nchildren; i++) {
+            avro_value_get_by_index(src, i, &src_child, NULL);
+            avro_value_get_by_index(dest, i, &dest_child, NULL);
+            if (plan_copy(plan, &plan->nodes[node->child + i], &src_child, &dest_child))
+                return 1;
+        }
+        return 0;
+    case OP_STRING:
+        avro_value_get_string(src, (const char **) &buf, &size);
+        return avro_value_set_string_len(dest, buf, size);
+    case OP_BYTES:
+        avro_value_get_bytes(src, &buf, &size);
+        return avro_value_set_bytes(dest, (void *) buf, size);
+    case OP_FIXED:
+        avro_value_get_fixed(src, &buf, &size);
+        return avro_value_set_fixed(dest, (void *) buf, size);
+    case OP_INT:
+        avro_value_get_int(src, &i32);
+        return avro_value_set_int(dest, i32);
+    case OP_LONG:
+        avro_value_get_long(src, &i64);
+        return avro_value_set_long(dest, i64);
+    case OP_FLOAT:
+        avro_value_get_float(src, &f);
+        return avro_value_set_float(dest, f);
+    case OP_DOUBLE:
+        avro_value_get_double(src, &d);
+        return avro_value_set_double(dest, d);
+    case OP_BOOLEAN:
+        avro_value_get_boolean(src, &disc);
+        return avro_value_set_boolean(dest, disc);
+    case OP_NULL:
+        return avro_value_set_null(dest);
+    case OP_ENUM:
+        avro_value_get_enum(src, &disc);
+        return avro_value_set_enum(dest, disc);
+    case OP_ARRAY:
+    case OP_MAP:
+        avro_value_get_size(src, &size);
+        for (i = 0; i < size; i++) {
+            avro_value_get_by_index(src, i, &src_child, &key);
+            if (node->op == OP_ARRAY)
+                avro_value_append(dest, &dest_child, NULL);
+            else
+                avro_value_add(dest, key, &dest_child, NULL, NULL);
+            if (plan_copy(plan, &plan->nodes[node->child], &src_child, &dest_child))
+                return 1;
+        }
+        return 0;
+    case OP_UNION:
+        avro_value_get_discriminant(src, &disc);
+        avro_value_get_current_branch(src, &src_child);
+        avro_value_set_branch(dest, disc, &dest_child);
+        return plan_copy(plan, &plan->nodes[node->child + disc], &src_child, &dest_child);
+    }
+    return 1;
+}
+
+int plan_traverse(const plan_t *plan, const plan_node_t *node, json_t *json,
+                  avro_value_t *current_val, int quiet) {
+
+    if (!json && node->dft_val.self)
+        return plan_copy(plan, node, (avro_value_t *) &node->dft_val, current_val);
+    json = json ? json : node->dft;
+    if (!json) {
+        if (!quiet)
+            fprintf(stderr, "ERROR: Avro schema does not match JSON\n");
+        return 1;
+    }
+
+    switch (node->op) {
+    case OP_RECORD:
     {
         if (!json_is_object(json)) {
             if (!quiet)
@@ -88,37 +599,28 @@ int schema_traverse(const avro_schema_t schema, json_t *json, json_t *dft,
             return 1;
         }
 
-        int len = avro_schema_record_size(schema), i;
-        for (i=0; i<len; i++) {
-
-            const char *name = avro_schema_record_field_name(schema, i);
-            avro_schema_t field_schema = avro_schema_record_field_get_by_index(schema, i);
-
-            json_t *json_val = json_object_get(json, name);
-            json_t *dft = avro_schema_record_field_default_get_by_index(schema, i);
+        const plan_node_t *field = &plan->nodes[node->child];
+        int i;
+        for (i=0; i<node->nchildren; i++, field++) {
+            json_t *json_val = json_object_get_hashed(json, field->name, field->hash);
 
-            avro_value_t field;
-            avro_value_get_by_index(current_val, i, &field, NULL);
+            avro_value_t field_val;
+            avro_value_get_by_index(current_val, i, &field_val, NULL);
 
-            if (schema_traverse(field_schema, json_val, dft, &field, quiet, strjson, max_str_sz))
+            if (plan_traverse(plan, field, json_val, &field_val, quiet))
                 return 1;
         }
     } break;
 
-    case AVRO_LINK:
-        /* TODO */
-        fprintf(stderr, "ERROR: AVRO_LINK is not implemented\n");
-        return 1;
-        break;
-
-    case AVRO_STRING:
+    case OP_STRING:
         if (!json_is_string(json)) {
-            if (json && strjson) {
+            if (json && plan->strjson) {
                 /* -j specified, just dump the remaining json as string */
                 char * js = json_dumps(json, JSON_COMPACT|JSON_SORT_KEYS|JSON_ENCODE_ANY);
-                if (max_str_sz && (strlen(js) > max_str_sz))
-                    js[max_str_sz] = 0; /* truncate the string - this will result in invalid JSON! */
-                avro_value_set_string(current_val, js);
+                size_t len = strlen(js);
+                if (plan->max_str_sz && len > plan->max_str_sz)
+                    js[len = plan->max_str_sz] = 0; /* truncate the string - this will result in invalid JSON! */
+                avro_value_set_string_len(current_val, js, len + 1);
                 free(js);
                 break;
             }
@@ -126,32 +628,33 @@ int schema_traverse(const avro_schema_t schema, json_t *json, json_t *dft,
                 fprintf(stderr, "ERROR: Expecting JSON string for Avro string, got something else\n");
             return 1;
         } else {
+            /* the length counts any embedded NULs, and Avro wants the
+               terminating one included in the size */
             const char *js = json_string_value(json);
-            if (max_str_sz && (strlen(js) > max_str_sz)) {
+            size_t len = json_string_length(json);
+            if (plan->max_str_sz && len > plan->max_str_sz) {
                 /* truncate the string */
-                char *jst = malloc(strlen(js));
-                strcpy(jst, js);
-                jst[max_str_sz] = 0;
-                avro_value_set_string(current_val, jst);
+                char *jst = malloc(plan->max_str_sz + 1);
+                memcpy(jst, js, plan->max_str_sz);
+                jst[plan->max_str_sz] = 0;
+                avro_value_set_string_len(current_val, jst, plan->max_str_sz + 1);
                 free(jst);
             } else
-                avro_value_set_string(current_val, js);
+                avro_value_set_string_len(current_val, js, len + 1);
         }
         break;
 
-    case AVRO_BYTES:
+    case OP_BYTES:
         if (!json_is_string(json)) {
             if (!quiet)
                 fprintf(stderr, "ERROR: Expecting JSON string for Avro string, got something else\n");
             return 1;
         }
-        /* NB: Jansson uses null-terminated strings, so embedded nulls are NOT
-           supported, not even escaped ones */
-        const char *s = json_string_value(json);
-        avro_value_set_bytes(current_val, (void *)s, strlen(s));
+        avro_value_set_bytes(current_val, (void *)json_string_value(json),
+                             json_string_length(json));
         break;
 
-    case AVRO_INT32:
+    case OP_INT:
         if (!json_is_integer(json)) {
             if (!quiet)
                 fprintf(stderr, "ERROR: Expecting JSON integer for Avro int, got something else\n");
@@ -160,7 +663,7 @@ int schema_traverse(const avro_schema_t schema, json_t *json, json_t *dft,
         avro_value_set_int(current_val, json_integer_value(json));
         break;
 
-    case AVRO_INT64:
+    case OP_LONG:
         if (!json_is_integer(json)) {
             if (!quiet)
                 fprintf(stderr, "ERROR: Expecting JSON integer for Avro long, got something else\n");
@@ -169,7 +672,7 @@ int schema_traverse(const avro_schema_t schema, json_t *json, json_t *dft,
         avro_value_set_long(current_val, json_integer_value(json));
         break;
 
-    case AVRO_FLOAT:
+    case OP_FLOAT:
         if (!json_is_number(json)) {
             if (!quiet)
                 fprintf(stderr, "ERROR: Expecting JSON number for Avro float, got something else\n");
@@ -178,7 +681,7 @@ int schema_traverse(const avro_schema_t schema, json_t *json, json_t *dft,
         avro_value_set_float(current_val, json_number_value(json));
         break;
 
-    case AVRO_DOUBLE:
+    case OP_DOUBLE:
         if (!json_is_number(json)) {
             if (!quiet)
                 fprintf(stderr, "ERROR: Expecting JSON number for Avro double, got something else\n");
@@ -187,7 +690,7 @@ int schema_traverse(const avro_schema_t schema, json_t *json, json_t *dft,
         avro_value_set_double(current_val, json_number_value(json));
         break;
 
-    case AVRO_BOOLEAN:
+    case OP_BOOLEAN:
         if (!json_is_boolean(json)) {
             if (!quiet)
                 fprintf(stderr, "ERROR: Expecting JSON boolean for Avro boolean, got something else\n");
@@ -196,7 +699,7 @@ int schema_traverse(const avro_schema_t schema, json_t *json, json_t *dft,
         avro_value_set_boolean(current_val, json_is_true(json));
         break;
 
-    case AVRO_NULL:
+    case OP_NULL:
         if (!json_is_null(json)) {
             if (!quiet)
                 fprintf(stderr, "ERROR: Expecting JSON null for Avro null, got something else\n");
@@ -205,146 +708,1757 @@ int schema_traverse(const avro_schema_t schema, json_t *json, json_t *dft,
         avro_value_set_null(current_val);
         break;
 
-    case AVRO_ENUM:
-        // TODO ???
+    case OP_ENUM:
+        if (!json_is_string(json)) {
+            if (!quiet)
+                fprintf(stderr, "ERROR: Expecting JSON string for Avro enum, got something else\n");
+            return 1;
+        } else {
+            const char *symbol = json_string_value(json);
+            int i = plan_lookup(plan, node, symbol, json_string_length(json), 0);
+            if (i < 0) {
+                /* -u: fall back to the field default, if there is one */
+                if (plan->enum_default && node->dft_val.self)
+                    return plan_copy(plan, node, (avro_value_t *) &node->dft_val, current_val);
+                if (!quiet)
+                    fprintf(stderr, "ERROR: Unknown symbol for Avro enum: %s\n", symbol);
+                return 1;
+            }
+            avro_value_set_enum(current_val, i);
+        }
         break;
 
-    case AVRO_ARRAY:
+    case OP_ARRAY:
         if (!json_is_array(json)) {
             if (!quiet)
                 fprintf(stderr, "ERROR: Expecting JSON array for Avro array, got something else\n");
             return 1;
         } else {
             int i, len = json_array_size(json);
-            avro_schema_t items = avro_schema_array_items(schema);
+            const plan_node_t *items = &plan->nodes[node->child];
             avro_value_t val;
             for (i=0; i<len; i++) {
                 avro_value_append(current_val, &val, NULL);
-                if (schema_traverse(items, json_array_get(json, i), NULL, &val, quiet, strjson, max_str_sz))
+                if (plan_traverse(plan, items, json_array_get(json, i), &val, quiet))
                     return 1;
             }
         }
         break;
 
-    case AVRO_MAP:
+    case OP_MAP:
         if (!json_is_object(json)) {
             if (!quiet)
                 fprintf(stderr, "ERROR: Expecting JSON object for Avro map, got something else\n");
             return 1;
         } else {
-            avro_schema_t values = avro_schema_map_values(schema);
+            const plan_node_t *values = &plan->nodes[node->child];
             void *iter = json_object_iter(json);
             avro_value_t val;
             while (iter) {
                 avro_value_add(current_val, json_object_iter_key(iter), &val, 0, 0);
-                if (schema_traverse(values, json_object_iter_value(iter), NULL, &val, quiet, strjson, max_str_sz))
+                if (plan_traverse(plan, values, json_object_iter_value(iter), &val, quiet))
                     return 1;
                 iter = json_object_iter_next(json, iter);
             }
         }
         break;
 
-    case AVRO_UNION:
+    case OP_UNION:
     {
-        int i;
+        const int *i = plan_candidates(plan, node, json_typeof(json));
         avro_value_t branch;
-        for (i=0; i<avro_schema_union_size(schema); i++) {
-            avro_value_set_branch(current_val, i, &branch);
-            avro_schema_t type = avro_schema_union_branch(schema, i);
-            if (!schema_traverse(type, json, NULL, &branch, 1, strjson, max_str_sz))
+        for (; *i >= 0; i++) {
+            avro_value_set_branch(current_val, *i, &branch);
+            if (!plan_traverse(plan, &plan->nodes[node->child + *i], json, &branch, 1))
                 break;
         }
-        if (i==avro_schema_union_size(schema)) {
-            fprintf(stderr, "ERROR: No type in the Avro union matched the JSON type we got\n");
+        if (*i < 0) {
+            if (!quiet)
+                fprintf(stderr, "ERROR: No type in the Avro union matched the JSON type we got\n");
             return 1;
         }
         break;
     }
-    case AVRO_FIXED:
+    case OP_FIXED:
         if (!json_is_string(json)) {
             if (!quiet)
                 fprintf(stderr, "ERROR: Expecting JSON string for Avro fixed, got something else\n");
             return 1;
         }
-        /* NB: Jansson uses null-terminated strings, so embedded nulls are NOT
-           supported, not even escaped ones */
         const char *f = json_string_value(json);
-        if (avro_value_set_fixed(current_val, (void *)f, strlen(f))) {
-            fprintf(stderr, "ERROR: Setting Avro fixed value FAILED\n");
+        if (avro_value_set_fixed(current_val, (void *)f, json_string_length(json))) {
+            if (!quiet)
+                fprintf(stderr, "ERROR: Setting Avro fixed value FAILED\n");
             return 1;
         }
         break;
+    }
+    return 0;
+}
+
+/*
+ * Lazy parsing (-e lazy)
+ *
+ * The default engine, except that jansson is told through a projection
+ * callback which parts of a document the plan is going to look at.
+ * Members that are not fields of the record they are in, and whatever
+ * is in a value of the wrong type, are skipped without being decoded.
+ * With -j, an object or array that ends up in a string is taken as it
+ * appears in the input instead of being decoded and dumped again.
+ * Skipped input is only checked for its structure, so a document with,
+ * say, a misspelled literal where the schema does not look is
+ * converted rather than rejected.
+ */
 
+/* Whether an object or array given to node ends up in a -j string */
+static int plan_is_text(const plan_t *plan, const plan_node_t *node) {
+    if (!plan->strjson)
+        return 0;
+    if (node->op == OP_UNION) {
+        const int *objects = plan_candidates(plan, node, JSON_OBJECT);
+        const int *arrays = plan_candidates(plan, node, JSON_ARRAY);
+        return objects[0] >= 0 && objects[0] == arrays[0] &&
+               plan->nodes[node->child + objects[0]].op == OP_STRING;
+    }
+    return node->op == OP_STRING;
+}
+
+/* The projection callback: context is the node that got the object
+   (key is a member) or the array (key is NULL) */
+static int plan_project(void *data, const void *context, const char *key, const void **child) {
+    const plan_t *plan = (const plan_t *) data;
+    const plan_node_t *node = (const plan_node_t *) context;
+    int i;
+
+    /* unless only one branch of a union can take the value, leave it
+       to plan_traverse() to try them */
+    if (node->op == OP_UNION) {
+        const int *branches = plan_candidates(plan, node, key ? JSON_OBJECT : JSON_ARRAY);
+        if (branches[0] < 0)
+            return JSON_PROJECT_SKIP;
+        if (branches[1] >= 0)
+            return JSON_PROJECT_ALL;
+        node = &plan->nodes[node->child + branches[0]];
+    }
+
+    switch (node->op) {
+    case OP_RECORD:
+        if (!key || (i = plan_lookup(plan, node, key, strlen(key), 0)) < 0)
+            return JSON_PROJECT_SKIP;
+        node = &plan->nodes[node->child + i];
+        break;
+    case OP_MAP:
+        if (!key)
+            return JSON_PROJECT_SKIP;
+        node = &plan->nodes[node->child];
+        break;
+    case OP_ARRAY:
+        if (key)
+            return JSON_PROJECT_SKIP;
+        node = &plan->nodes[node->child];
+        break;
+    case OP_STRING:
+        /* dumped whole by -j */
+        return plan->strjson ? JSON_PROJECT_ALL : JSON_PROJECT_SKIP;
     default:
-        fprintf(stderr, "ERROR: Unknown type: %d\n", schema->type);
-        return 1;
+        /* the value is rejected whatever is in it */
+        return JSON_PROJECT_SKIP;
     }
-    return 0;
+
+    if (plan_is_text(plan, node))
+        return JSON_PROJECT_TEXT;
+    *child = node;
+    return JSON_PROJECT_KEEP;
+}
+
+/* Output
+
+   Converted records go to an output_t rather than straight to the
+   Avro writer, so that -a can hold the first ones back. Until it has
+   TUNE_BLOCKS (or -a rate,N) blocks' worth of records, nothing is
+   written:
+   then each codec and level in tune_candidates writes the sample to
+   memory in turn, and the one with the best ratio among those that
+   compress at least the -a rate wins. With -t N, a candidate's rate
+   counts N times, as that many threads share the compression. If none
+   is fast enough, the output is not compressed. Only then is the
+   writer created, and the sample goes in ahead of everything else. */
+
+#define TUNE_BLOCKS 16
+#define DEFAULT_BLOCK_SIZE (16*1024)
+
+static const struct {
+    const char *codec;
+    int level;
+} tune_candidates[] = {
+    { "snappy", 0 },
+    { "deflate", 1 }, { "deflate", 6 }, { "deflate", 9 },
+    { "lzma", 1 }, { "lzma", 6 },
+    { "zstandard", 1 }, { "zstandard", 3 }, { "zstandard", 9 }, { "zstandard", 19 },
+};
+
+typedef struct {
+    const char *path;               /* "-" is stdout */
+    avro_schema_t schema;
+    const char *codec;
+    struct avro_codec_options options;
+    size_t block_sz;
+    size_t target_sz;               /* compressed block size, 0 without -B */
+    int max_latency;                /* ms */
+    int nthreads;
+    int verbose;
+    avro_file_writer_t writer;      /* NULL while -a is sampling */
+
+    double tune_rate;               /* bytes per second, 0 without -a */
+    size_t tune_len;                /* sample this much */
+    char *sample;
+    size_t sample_len, sample_cap;
+    size_t *sizes;                  /* of each record in the sample */
+    size_t nsizes, sizes_cap;
+    avro_writer_t encoder;
+} output_t;
+
+static void output_open(output_t *o) {
+    if (!strcmp(o->path, "-")) {
+        if (avro_file_writer_create_with_codec_options_fp(stdout, o->path, 0, o->schema, &o->writer,
+                                                          o->codec, &o->options, o->block_sz)) {
+            fprintf(stderr, "ERROR: avro_file_writer_create_with_codec_options_fp FAILED: %s\n", avro_strerror());
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        remove(o->path);
+        if (avro_file_writer_create_with_codec_options_fp(NULL, o->path, 1, o->schema, &o->writer,
+                                                          o->codec, &o->options, o->block_sz)) {
+            fprintf(stderr, "ERROR: avro_file_writer_create_with_codec_options_fp FAILED: %s\n", avro_strerror());
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (o->nthreads > 0 && avro_file_writer_set_codec_threads(o->writer, o->nthreads)) {
+        fprintf(stderr, "ERROR: avro_file_writer_set_codec_threads FAILED: %s\n", avro_strerror());
+        exit(EXIT_FAILURE);
+    }
+
+    if ((o->target_sz || o->max_latency) &&
+        avro_file_writer_set_block_target(o->writer, o->target_sz, o->max_latency)) {
+        fprintf(stderr, "ERROR: avro_file_writer_set_block_target FAILED: %s\n", avro_strerror());
+        exit(EXIT_FAILURE);
+    }
+
+    if (o->verbose) {
+        if (o->options.level)
+            fprintf(stderr, "Using codec: %s, level %d\n", o->codec, o->options.level);
+        else
+            fprintf(stderr, "Using codec: %s\n", o->codec);
+    }
+}
+
+/* Writes the sample with one candidate into memory. Returns the
+   compressed size and sets *secs, or returns 0 if the codec is not
+   built in. */
+static size_t tune_trial(output_t *o, const char *codec, const struct avro_codec_options *options, double *secs) {
+    avro_file_writer_t writer;
+    struct timespec start, end;
+    char *buf = NULL;
+    size_t len = 0, off = 0, i;
+    FILE *fp = open_memstream(&buf, &len);
+
+    if (!fp)
+        return 0;
+    if (avro_file_writer_create_with_codec_options_fp(fp, "sample", 0, o->schema, &writer,
+                                                      codec, options, o->block_sz)) {
+        fclose(fp);
+        free(buf);
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < o->nsizes; i++) {
+        if (avro_file_writer_append_encoded(writer, o->sample + off, o->sizes[i])) {
+            fprintf(stderr, "ERROR: avro_file_writer_append_encoded() FAILED: %s\n", avro_strerror());
+            exit(EXIT_FAILURE);
+        }
+        off += o->sizes[i];
+    }
+    avro_file_writer_close(writer);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fclose(fp);
+    free(buf);
+
+    *secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return len;
+}
+
+static void output_tune(output_t *o) {
+    size_t best_len = 0, off = 0, i;
+    double best_rate = 0;
+    int best = -1;
+
+    for (i = 0; o->nsizes && i < sizeof(tune_candidates) / sizeof(tune_candidates[0]); i++) {
+        struct avro_codec_options options = { tune_candidates[i].level, 0, 0 };
+        double secs, rate;
+        size_t len = tune_trial(o, tune_candidates[i].codec, &options, &secs);
+
+        if (!len)
+            continue;
+        rate = o->sample_len / (secs > 0 ? secs : 1e-9) * (o->nthreads > 0 ? o->nthreads : 1);
+        if (o->verbose)
+            fprintf(stderr, "Autotune: %s level %d: ratio %.2f, %.1f MB/s\n", tune_candidates[i].codec,
+                    tune_candidates[i].level, (double) o->sample_len / len, rate / (1024*1024));
+        if (rate >= o->tune_rate && (best < 0 || len < best_len || (len == best_len && rate > best_rate))) {
+            best = i;
+            best_len = len;
+            best_rate = rate;
+        }
+    }
+
+    if (best < 0) {
+        o->codec = "null";
+        o->options.level = 0;
+    } else {
+        o->codec = tune_candidates[best].codec;
+        o->options.level = tune_candidates[best].level;
+    }
+    output_open(o);
+
+    for (i = 0; i < o->nsizes; i++) {
+        if (avro_file_writer_append_encoded(o->writer, o->sample + off, o->sizes[i])) {
+            fprintf(stderr, "ERROR: avro_file_writer_append_encoded() FAILED: %s\n", avro_strerror());
+            exit(EXIT_FAILURE);
+        }
+        off += o->sizes[i];
+    }
+    free(o->sample);
+    free(o->sizes);
+    o->sample = NULL;
+    o->sizes = NULL;
+}
+
+static void output_sampled(output_t *o, size_t size) {
+    if (o->nsizes == o->sizes_cap) {
+        o->sizes_cap = o->sizes_cap ? o->sizes_cap * 2 : 1024;
+        o->sizes = xrealloc(o->sizes, o->sizes_cap * sizeof(size_t));
+    }
+    o->sizes[o->nsizes++] = size;
+    o->sample_len += size;
+    if (o->sample_len >= o->tune_len)
+        output_tune(o);
 }
 
-void process_file(FILE *input, avro_file_writer_t out, avro_schema_t schema,
-                  int verbose, int memstat, int errabort, int strjson, size_t max_str_sz) {
+static void output_init(output_t *o, const char *path, avro_schema_t schema, const char *codec,
+                        const struct avro_codec_options *options, size_t block_sz, size_t target_sz,
+                        int max_latency, int nthreads, double tune_rate, int tune_blocks, int verbose) {
+    memset(o, 0, sizeof(*o));
+    o->path = path;
+    o->schema = avro_schema_incref(schema);
+    o->codec = codec;
+    o->options = *options;
+    o->block_sz = block_sz;
+    o->target_sz = target_sz;
+    o->max_latency = max_latency;
+    o->nthreads = nthreads;
+    o->verbose = verbose;
+    o->tune_rate = tune_rate;
+    if (tune_rate > 0) {
+        o->tune_len = (size_t) tune_blocks * (block_sz ? block_sz : DEFAULT_BLOCK_SIZE);
+        o->encoder = avro_writer_memory(NULL, 0);
+    } else
+        output_open(o);
+}
+
+static void output_value(output_t *o, avro_value_t *value) {
+    if (o->writer) {
+        if (avro_file_writer_append_value(o->writer, value)) {
+            fprintf(stderr, "ERROR: avro_file_writer_append_value() FAILED: %s\n", avro_strerror());
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+    for (;;) {
+        avro_writer_memory_set_dest(o->encoder, o->sample + o->sample_len, o->sample_cap - o->sample_len);
+        if (!avro_value_write(o->encoder, value))
+            break;
+        o->sample_cap = o->sample_cap ? o->sample_cap * 2 : BATCH_SIZE;
+        o->sample = xrealloc(o->sample, o->sample_cap);
+    }
+    output_sampled(o, avro_writer_tell(o->encoder));
+}
+
+static void output_encoded(output_t *o, const char *buf, size_t len) {
+    if (o->writer) {
+        if (avro_file_writer_append_encoded(o->writer, buf, len)) {
+            fprintf(stderr, "ERROR: avro_file_writer_append_encoded() FAILED: %s\n", avro_strerror());
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+    if (o->sample_len + len > o->sample_cap) {
+        o->sample_cap = o->sample_cap ? o->sample_cap : BATCH_SIZE;
+        while (o->sample_len + len > o->sample_cap)
+            o->sample_cap *= 2;
+        o->sample = xrealloc(o->sample, o->sample_cap);
+    }
+    memcpy(o->sample + o->sample_len, buf, len);
+    output_sampled(o, len);
+}
+
+static void output_close(output_t *o) {
+    /* the input ran out before the sample was complete */
+    if (!o->writer)
+        output_tune(o);
+    if (o->encoder)
+        avro_writer_free(o->encoder);
+    avro_file_writer_close(o->writer);
+    avro_schema_decref(o->schema);
+}
+
+void process_file(FILE *input, output_t *out, avro_schema_t schema, const plan_t *plan,
+                  int verbose, int memstat, int errabort) {
 
     json_error_t err;
     json_t *json;
+    json_stream_t *stream;
+    json_arena_t *arena;
     int n = 0;
 
-    json = json_loadf(input, JSON_DISABLE_EOF_CHECK, &err);
-    while (!feof(input)) {
+    /* Build the value class and the record once and reuse them for
+       every input record: avro_value_reset() keeps the memory of
+       arrays, maps and strings around, so in steady state the loop
+       does no schema work or allocation of its own. */
+    avro_value_t record;
+    avro_value_iface_t *iface = avro_generic_class_from_schema(schema);
+    if (!iface || avro_generic_value_new(iface, &record)) {
+        fprintf(stderr, "ERROR: Unable to create Avro value from schema: %s\n", avro_strerror());
+        exit(EXIT_FAILURE);
+    }
+
+    /* Read the input in large blocks; the stream carries whatever
+       follows one document over to the next. Each document is built
+       in the arena, which is reset rather than freed node by node once
+       the document has been converted. */
+    stream = json_stream_file(input);
+    arena = json_arena_new();
+    if (!stream || !arena) {
+        fprintf(stderr, "ERROR: Unable to allocate JSON input buffer\n");
+        exit(EXIT_FAILURE);
+    }
+    json_stream_set_arena(stream, arena);
+    json_stream_set_keys(stream, plan->keys);
+    if (plan->lazy)
+        json_stream_set_projection(stream, plan_project, (void *) plan, plan->nodes);
+
+    json = json_stream_load(stream, LOAD_FLAGS, &err);
+    while (!json_stream_eof(stream)) {
         n++;
         if (verbose && !(n % 1000))
             printf("Processing record %d\n", n);
         if (!json) {
             if (errabort) {
                 fprintf(stderr, "JSON error on line %d, column %d, pos %d: %s, aborting.\n", n, err.column, err.position, err.text);
+                json_stream_close(stream);
+                json_arena_free(arena);
                 return;
             }
             fprintf(stderr, "JSON error on line %d, column %d, pos %d: %s, skipping to EOL\n", n, err.column, err.position, err.text);
-            while (getc(input) != '\n' && !feof(input)) {};
-            json = json_loadf(input, JSON_DISABLE_EOF_CHECK, &err);
+            json_stream_skip_line(stream);
+            json_arena_reset(arena);
+            json = json_stream_load(stream, LOAD_FLAGS, &err);
             continue;
         }
 
-        avro_value_t record;
-        avro_value_iface_t *iface = avro_generic_class_from_schema(schema);
-        avro_generic_value_new(iface, &record);
+        avro_value_reset(&record);
 
-        if (!schema_traverse(schema, json, NULL, &record, 0, strjson, max_str_sz)) {
+        if (!plan_traverse(plan, plan->nodes, json, &record, 0)) {
 
-            if (avro_file_writer_append_value(out, &record)) {
-                fprintf(stderr, "ERROR: avro_file_writer_append_value() FAILED: %s\n", avro_strerror());
-                exit(EXIT_FAILURE);
-            }
+            output_value(out, &record);
 
         } else
             fprintf(stderr, "Error processing record %d, skipping...\n", n);
 
-        avro_value_iface_decref(iface);
-        avro_value_decref(&record);
-
         json_decref(json);
+        json_arena_reset(arena);
         if (memstat && !(n % 1000))
             memory_status();
 
-        json = json_loadf(input, JSON_DISABLE_EOF_CHECK, &err);
+        json = json_stream_load(stream, LOAD_FLAGS, &err);
     }
 
     if (memstat) memory_status();
 
+    if (ferror(input)) {
+        perror("ERROR: reading input");
+        exit(EXIT_FAILURE);
+    }
+
+    json_stream_close(stream);
+    json_arena_free(arena);
+    avro_value_decref(&record);
+    avro_value_iface_decref(iface);
     avro_schema_decref(schema);
 }
 
-void print_help(char *program_name) {
-    fprintf(stderr, "Usage: %s [options] [input_file.json] <output_file.avro>\n", program_name);
-    fprintf(stderr, "\n");
+/*
+ * Multi-threaded conversion (-t N)
+ *
+ * A reader thread cuts the input into batches of roughly BATCH_SIZE
+ * bytes, always at a newline, so every JSON document must end on its
+ * own line. A regular input file is mapped into memory and batches
+ * point straight into the mapping; anything else (a pipe, say) is read
+ * into per-batch buffers. N workers each take the next batch, parse it and encode
+ * the records into the batch's private output buffer, and the main
+ * thread appends the encoded records to the Avro file strictly in
+ * batch order, so the output is the same as in single-threaded mode.
+ */
+
+enum { BATCH_FREE, BATCH_READY, BATCH_BUSY, BATCH_DONE };
+
+typedef struct batch {
+    int state;
+    const char *in;        /* raw JSON, ends at a newline or at EOF */
+    size_t in_len;
+    char *buf;             /* holds in, unless the input is mapped */
+    size_t buf_cap;
+    int first_line;        /* input line number of in[0] */
+    char *out;             /* binary-encoded records, back to back */
+    size_t out_len, out_cap;
+    size_t *sizes;         /* encoded size of each record in out */
+    int nrec, nrec_cap;
+    int ndocs;             /* JSON documents seen, including bad ones */
+    long seq;              /* position of the batch in the input */
+    int aborted;           /* -x: the batch stopped at a JSON error */
+    char abort_msg[JSON_ERROR_TEXT_LENGTH + 64];  /* printed when it is written */
+} batch_t;
+
+typedef struct pipeline {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    batch_t *slots;
+    int nslots;
+    long next_read, next_parse, next_write;
+    int eof, stop;
+    int read_errno;        /* the input failed, with this errno */
+    FILE *input;
+    char *tail;            /* start of the next batch read from input */
+    size_t tail_len, tail_cap;
+    const char *map;       /* the input file, if it could be mapped */
+    size_t map_len, map_pos;
+    const plan_t *plan;
+    avro_value_iface_t *iface;
+    int stream;            /* -e stream */
+    int errabort;
+    int aborted;           /* -x: a batch stopped at a JSON error */
+    long abort_seq;        /* the first such batch; later ones are dropped */
+} pipeline_t;
+
+static int count_lines(const char *buf, size_t len) {
+    const char *end = buf + len;
+    int n = 0;
+    while ((buf = memchr(buf, '\n', end - buf))) {
+        buf++;
+        n++;
+    }
+    return n;
+}
+
+static char *last_newline(char *buf, size_t len) {
+    while (len--)
+        if (buf[len] == '\n')
+            return buf + len;
+    return NULL;
+}
+
+/* Waits for batch number *seq to reach the given state. Other threads
+   may advance *seq while we sleep, so the slot is looked up afresh on
+   every wakeup. */
+static batch_t *pipeline_wait(pipeline_t *p, long *seq, int state) {
+    for (;;) {
+        batch_t *b = &p->slots[*seq % p->nslots];
+        if (p->stop)
+            return NULL;
+        if (b->state == state)
+            return b;
+        if (p->eof && *seq >= p->next_read)
+            return NULL;
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+}
+
+/* Fills a batch from the input stream. The batch starts with whatever
+   followed the last newline of the previous one and is topped up from
+   the input, growing the buffer for as long as there is no newline in
+   it. Returns 1 once the input is exhausted or fails to read. */
+static int read_batch(pipeline_t *p, batch_t *b) {
+    if (b->buf_cap < BATCH_SIZE + p->tail_len) {
+        b->buf_cap = BATCH_SIZE + p->tail_len;
+        b->buf = xrealloc(b->buf, b->buf_cap);
+    }
+    memcpy(b->buf, p->tail, p->tail_len);
+    b->in_len = p->tail_len;
+    p->tail_len = 0;
+
+    char *nl = NULL;
+    for (;;) {
+        size_t start = b->in_len;
+        b->in_len += fread(b->buf + b->in_len, 1, b->buf_cap - b->in_len, p->input);
+        nl = last_newline(b->buf + start, b->in_len - start);
+        if (nl || feof(p->input) || ferror(p->input))
+            break;
+        b->buf_cap *= 2;
+        b->buf = xrealloc(b->buf, b->buf_cap);
+    }
+    b->in = b->buf;
+
+    if (ferror(p->input)) {
+        p->read_errno = errno ? errno : EIO;
+        return 1;
+    }
+    if (!nl)
+        return feof(p->input);
+
+    p->tail_len = b->buf + b->in_len - (nl + 1);
+    if (p->tail_cap < p->tail_len) {
+        p->tail_cap = p->tail_len;
+        p->tail = xrealloc(p->tail, p->tail_cap);
+    }
+    memcpy(p->tail, nl + 1, p->tail_len);
+    b->in_len -= p->tail_len;
+    return 0;
+}
+
+/* Points a batch at the next BATCH_SIZE or so bytes of a memory-mapped
+   input file, extended to the next newline. Nothing is copied. */
+static int map_batch(pipeline_t *p, batch_t *b) {
+    size_t len = p->map_len - p->map_pos;
+    if (len > BATCH_SIZE) {
+        const char *start = p->map + p->map_pos;
+        const char *nl = memchr(start + BATCH_SIZE, '\n', len - BATCH_SIZE);
+        if (nl)
+            len = nl + 1 - start;
+    }
+    b->in = p->map + p->map_pos;
+    b->in_len = len;
+    p->map_pos += len;
+    return p->map_pos == p->map_len;
+}
+
+static void *pipeline_reader(void *arg) {
+    pipeline_t *p = (pipeline_t *) arg;
+    int line = 1;
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        while (!p->stop && p->slots[p->next_read % p->nslots].state != BATCH_FREE)
+            pthread_cond_wait(&p->cond, &p->lock);
+        batch_t *b = p->stop ? NULL : &p->slots[p->next_read % p->nslots];
+        pthread_mutex_unlock(&p->lock);
+        if (!b)
+            break;
+
+        int done = p->map ? map_batch(p, b) : read_batch(p, b);
+
+        pthread_mutex_lock(&p->lock);
+        if (p->read_errno) {
+            /* Nothing after a read error is trustworthy */
+            p->stop = 1;
+            pthread_cond_broadcast(&p->cond);
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        if (b->in_len) {
+            b->first_line = line;
+            line += count_lines(b->in, b->in_len);
+            b->state = BATCH_READY;
+            p->next_read++;
+        }
+        if (done)
+            p->eof = 1;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+        if (done)
+            break;
+    }
+
+    return NULL;
+}
+
+static void batch_add_size(batch_t *b, size_t size) {
+    if (b->nrec == b->nrec_cap) {
+        b->nrec_cap = b->nrec_cap ? b->nrec_cap * 2 : 1024;
+        b->sizes = xrealloc(b->sizes, b->nrec_cap * sizeof(size_t));
+    }
+    b->sizes[b->nrec++] = size;
+}
+
+static void batch_append_record(batch_t *b, avro_writer_t writer, avro_value_t *record) {
+    for (;;) {
+        avro_writer_memory_set_dest(writer, b->out + b->out_len, b->out_cap - b->out_len);
+        if (!avro_value_write(writer, record))
+            break;
+        b->out_cap = b->out_cap ? b->out_cap * 2 : BATCH_SIZE;
+        b->out = xrealloc(b->out, b->out_cap);
+    }
+    batch_add_size(b, avro_writer_tell(writer));
+    b->out_len += avro_writer_tell(writer);
+}
+
+/* -x: Notes that batch b stopped at a JSON error, or tells whether an
+   earlier batch did, in which case nothing in b gets written and
+   converting or reporting anything more in it is wasted. */
+static void pipeline_abort(pipeline_t *p, batch_t *b) {
+    pthread_mutex_lock(&p->lock);
+    if (!p->aborted || b->seq < p->abort_seq) {
+        p->aborted = 1;
+        p->abort_seq = b->seq;
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+static int pipeline_aborted(pipeline_t *p, batch_t *b) {
+    int aborted;
+    pthread_mutex_lock(&p->lock);
+    aborted = p->aborted && b->seq > p->abort_seq;
+    pthread_mutex_unlock(&p->lock);
+    return aborted;
+}
+
+/* Converts the documents in b->in from *pos on with jansson, either
+   all of them or just the next one, and moves *pos past what was read.
+   input is a jansson stream over b->in that builds the documents in
+   arena. Returns 0 once there is nothing more to convert in the batch. */
+static int convert_json(pipeline_t *p, batch_t *b, json_stream_t *input, json_arena_t *arena,
+                        size_t *pos, int all, avro_value_t *record, avro_writer_t writer) {
+    json_error_t err;
+    json_t *json;
+    size_t start = *pos;
+    int more;
+
+    json_stream_seek(input, *pos);
+    json = json_stream_load(input, LOAD_FLAGS, &err);
+    while (!json_stream_eof(input)) {
+        if (p->errabort && pipeline_aborted(p, b)) {
+            json_decref(json);
+            json_arena_reset(arena);
+            b->aborted = 1;
+            break;
+        }
+        b->ndocs++;
+        if (!json) {
+            /* err.line counts from where the load started; the stream
+               may be past the line the error is on */
+            int line = b->first_line + count_lines(b->in, start) + err.line - 1;
+            if (p->errabort) {
+                snprintf(b->abort_msg, sizeof(b->abort_msg),
+                         "JSON error on line %d, column %d, pos %d: %s, aborting.\n", line, err.column, err.position, err.text);
+                b->aborted = 1;
+                pipeline_abort(p, b);
+                break;
+            }
+            fprintf(stderr, "JSON error on line %d, column %d, pos %d: %s, skipping to EOL\n", line, err.column, err.position, err.text);
+            json_stream_skip_line(input);
+            json_arena_reset(arena);
+            if (!all)
+                break;
+            start = json_stream_tell(input);
+            json = json_stream_load(input, LOAD_FLAGS, &err);
+            continue;
+        }
+
+        avro_value_reset(record);
+
+        if (!plan_traverse(p->plan, p->plan->nodes, json, record, 0))
+            batch_append_record(b, writer, record);
+        else
+            fprintf(stderr, "Error processing record on line %d, skipping...\n",
+                    b->first_line + count_lines(b->in, json_stream_tell(input)));
+
+        json_decref(json);
+        json_arena_reset(arena);
+        if (!all)
+            break;
+        start = json_stream_tell(input);
+        json = json_stream_load(input, LOAD_FLAGS, &err);
+    }
+
+    more = !json_stream_eof(input) && !b->aborted;
+    *pos = json_stream_tell(input);
+    return more;
+}
+
+static json_stream_t *batch_json_stream(pipeline_t *p, batch_t *b, json_arena_t *arena) {
+    json_stream_t *input = json_stream_buffer(b->in, b->in_len);
+    if (!input) {
+        fprintf(stderr, "ERROR: Unable to allocate JSON parser\n");
+        exit(EXIT_FAILURE);
+    }
+    json_stream_set_arena(input, arena);
+    json_stream_set_keys(input, p->plan->keys);
+    if (p->plan->lazy)
+        json_stream_set_projection(input, plan_project, (void *) p->plan, p->plan->nodes);
+    return input;
+}
+
+static void convert_batch(pipeline_t *p, batch_t *b, json_arena_t *arena,
+                          avro_value_t *record, avro_writer_t writer) {
+    json_stream_t *input = batch_json_stream(p, b, arena);
+    size_t pos = 0;
+
+    b->out_len = 0;
+    b->nrec = 0;
+    b->ndocs = 0;
+    b->aborted = 0;
+    b->abort_msg[0] = '\0';
+    convert_json(p, b, input, arena, &pos, 1, record, writer);
+    json_stream_close(input);
+}
+
+/*
+ * Streaming conversion (-e stream)
+ *
+ * The streaming engine builds neither jansson trees nor Avro values.
+ * It tokenizes each document against the plan and writes Avro binary
+ * straight into the batch output. Record fields are encoded in the
+ * order their keys come in, and each one's stretch of output is noted
+ * in a field slot; if the keys were out of schema order, or some were
+ * missing and have to be filled in from the defaults encoded by
+ * plan_compile(), the record is put back together from its slots.
+ *
+ * The engine is a fast path only. A document that is not valid JSON,
+ * does not match the schema or needs something the engine does not do
+ * (-j dumps, maps with duplicate keys) is handed to
+ * convert_json(), so the output and the error messages are those of
+ * the default engine.
+ */
+
+enum { ENC_OK, ENC_MISMATCH, ENC_FALLBACK };
+
+typedef struct field_slot {
+    size_t off, len;
+    int set;
+} field_slot_t;
+
+typedef struct map_key {
+    size_t hash, off, len;
+} map_key_t;
+
+typedef struct encoder {
+    const plan_t *plan;
+    const char *p, *end;   /* input */
+    batch_t *b;            /* output goes to b->out */
+    char *str;             /* unescaped strings and long numbers */
+    size_t str_cap;
+    char *tmp;             /* records being put back together */
+    size_t tmp_cap;
+    field_slot_t *slots;   /* of all records being encoded */
+    size_t nslots, slots_cap;
+    map_key_t *keys;       /* of all maps being encoded */
+    size_t nkeys, keys_cap;
+} encoder_t;
+
+static char *enc_reserve(encoder_t *e, size_t len) {
+    batch_t *b = e->b;
+    if (b->out_len + len > b->out_cap) {
+        b->out_cap = b->out_cap ? b->out_cap : BATCH_SIZE;
+        while (b->out_len + len > b->out_cap)
+            b->out_cap *= 2;
+        b->out = xrealloc(b->out, b->out_cap);
+    }
+    return b->out + b->out_len;
+}
+
+static int zigzag_varint(int64_t n, char *buf) {
+    uint64_t v = ((uint64_t) n << 1) ^ (uint64_t) (n >> 63);
+    int len = 0;
+    while (v & ~(uint64_t) 0x7f) {
+        buf[len++] = (char) ((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    buf[len++] = (char) v;
+    return len;
+}
+
+static void enc_long(encoder_t *e, int64_t n) {
+    e->b->out_len += zigzag_varint(n, enc_reserve(e, 10));
+}
+
+static void enc_raw(encoder_t *e, const char *buf, size_t len) {
+    memcpy(enc_reserve(e, len), buf, len);
+    e->b->out_len += len;
+}
+
+static void enc_float(encoder_t *e, float f) {
+    uint32_t bits;
+    char *out = enc_reserve(e, 4);
+    int i;
+    memcpy(&bits, &f, 4);
+    for (i = 0; i < 4; i++)
+        out[i] = (char) (bits >> (8 * i));
+    e->b->out_len += 4;
+}
+
+static void enc_double(encoder_t *e, double d) {
+    uint64_t bits;
+    char *out = enc_reserve(e, 8);
+    int i;
+    memcpy(&bits, &d, 8);
+    for (i = 0; i < 8; i++)
+        out[i] = (char) (bits >> (8 * i));
+    e->b->out_len += 8;
+}
+
+static void *enc_grow(void *buf, size_t *cap, size_t need, size_t size) {
+    if (need <= *cap)
+        return buf;
+    *cap = *cap ? *cap : 64;
+    while (need > *cap)
+        *cap *= 2;
+    return xrealloc(buf, *cap * size);
+}
+
+/* Skips whitespace and returns the next input byte, or -1 at the end */
+static int enc_peek(encoder_t *e) {
+    while (e->p < e->end && (*e->p == ' ' || *e->p == '\t' || *e->p == '\n' || *e->p == '\r'))
+        e->p++;
+    return e->p < e->end ? (unsigned char) *e->p : -1;
+}
+
+static int enc_expect(encoder_t *e, int c) {
+    if (enc_peek(e) != c)
+        return 0;
+    e->p++;
+    return 1;
+}
+
+/* Length of the valid UTF-8 sequence at s, by jansson's rules, or 0 */
+static int utf8_length(const unsigned char *s, size_t avail) {
+    int32_t value;
+    int len, i;
+
+    if (0xC2 <= s[0] && s[0] <= 0xDF) {
+        len = 2;
+        value = s[0] & 0x1F;
+    } else if (0xE0 <= s[0] && s[0] <= 0xEF) {
+        len = 3;
+        value = s[0] & 0xF;
+    } else if (0xF0 <= s[0] && s[0] <= 0xF4) {
+        len = 4;
+        value = s[0] & 0x7;
+    } else
+        return 0;
+
+    if (avail < (size_t) len)
+        return 0;
+    for (i = 1; i < len; i++) {
+        if ((s[i] & 0xC0) != 0x80)
+            return 0;
+        value = (value << 6) + (s[i] & 0x3F);
+    }
+    if (value > 0x10FFFF || (0xD800 <= value && value <= 0xDFFF) ||
+        (len == 3 && value < 0x800) || (len == 4 && value < 0x10000))
+        return 0;
+    return len;
+}
+
+static int32_t hex4(const char *s, const char *end) {
+    int32_t value = 0;
+    int i;
+
+    if (end - s < 4)
+        return -1;
+    for (i = 0; i < 4; i++) {
+        char c = s[i];
+        value <<= 4;
+        if ('0' <= c && c <= '9')
+            value += c - '0';
+        else if ('a' <= c && c <= 'f')
+            value += c - 'a' + 10;
+        else if ('A' <= c && c <= 'F')
+            value += c - 'A' + 10;
+        else
+            return -1;
+    }
+    return value;
+}
+
+/* Scans the string whose opening quote is at e->p. The result points
+   into the input if there was nothing to unescape, into e->str if
+   there was. Decoding follows jansson; \u0000 becomes a NUL byte. */
+static int enc_string(encoder_t *e, const char **str, size_t *len) {
+    const char *p = e->p + 1, *start = p;
+    size_t n;
+
+    while (p < e->end && *p != '"' && *p != '\\' && (unsigned char) *p >= 0x20 && (unsigned char) *p < 0x80)
+        p++;
+    if (p < e->end && *p == '"') {
+        *str = start;
+        *len = p - start;
+        e->p = p + 1;
+        return ENC_OK;
+    }
+
+    n = p - start;
+    e->str = enc_grow(e->str, &e->str_cap, n + 4, 1);
+    memcpy(e->str, start, n);
+    for (;;) {
+        unsigned char c;
+        int32_t value;
+
+        if (p >= e->end || (unsigned char) *p < 0x20)
+            return ENC_FALLBACK;
+        c = *p;
+        if (c == '"')
+            break;
+        e->str = enc_grow(e->str, &e->str_cap, n + 4, 1);
+
+        if (c >= 0x80) {
+            int ulen = utf8_length((const unsigned char *) p, e->end - p);
+            if (!ulen)
+                return ENC_FALLBACK;
+            memcpy(e->str + n, p, ulen);
+            n += ulen;
+            p += ulen;
+            continue;
+        }
+        if (c != '\\') {
+            e->str[n++] = c;
+            p++;
+            continue;
+        }
+
+        if (p + 1 >= e->end)
+            return ENC_FALLBACK;
+        switch (p[1]) {
+        case '"': case '\\': case '/':
+            e->str[n++] = p[1]; break;
+        case 'b': e->str[n++] = '\b'; break;
+        case 'f': e->str[n++] = '\f'; break;
+        case 'n': e->str[n++] = '\n'; break;
+        case 'r': e->str[n++] = '\r'; break;
+        case 't': e->str[n++] = '\t'; break;
+        case 'u':
+            value = hex4(p + 2, e->end);
+            if (value < 0)
+                return ENC_FALLBACK;
+            p += 6;
+            if (0xD800 <= value && value <= 0xDBFF) {
+                int32_t value2;
+                if (e->end - p < 2 || p[0] != '\\' || p[1] != 'u')
+                    return ENC_FALLBACK;
+                value2 = hex4(p + 2, e->end);
+                if (value2 < 0xDC00 || value2 > 0xDFFF)
+                    return ENC_FALLBACK;
+                p += 6;
+                value = ((value - 0xD800) << 10) + (value2 - 0xDC00) + 0x10000;
+            } else if (0xDC00 <= value && value <= 0xDFFF)
+                return ENC_FALLBACK;
+
+            if (value < 0x80)
+                e->str[n++] = value;
+            else if (value < 0x800) {
+                e->str[n++] = 0xC0 + (value >> 6);
+                e->str[n++] = 0x80 + (value & 0x3F);
+            } else if (value < 0x10000) {
+                e->str[n++] = 0xE0 + (value >> 12);
+                e->str[n++] = 0x80 + ((value >> 6) & 0x3F);
+                e->str[n++] = 0x80 + (value & 0x3F);
+            } else {
+                e->str[n++] = 0xF0 + (value >> 18);
+                e->str[n++] = 0x80 + ((value >> 12) & 0x3F);
+                e->str[n++] = 0x80 + ((value >> 6) & 0x3F);
+                e->str[n++] = 0x80 + (value & 0x3F);
+            }
+            continue;
+        default:
+            return ENC_FALLBACK;
+        }
+        p += 2;
+    }
+
+    *str = e->str;
+    *len = n;
+    e->p = p + 1;
+    return ENC_OK;
+}
+
+/* An object key; jansson refuses keys with a NUL in them, so those
+   go to the fallback to be reported. */
+static int enc_key(encoder_t *e, const char **key, size_t *len) {
+    if (enc_string(e, key, len) || memchr(*key, 0, *len))
+        return ENC_FALLBACK;
+    return ENC_OK;
+}
+
+/* Scans a number the way jansson does: without a fraction or exponent
+   it is an integer, otherwise a real, and either must not overflow. */
+static int enc_number(encoder_t *e, int *is_int, json_int_t *ival, double *dval) {
+    const char *p = e->p, *start = p;
+    int neg = 0, real = 0;
+
+    if (p < e->end && *p == '-') {
+        neg = 1;
+        p++;
+    }
+    if (p >= e->end || !isdigit((unsigned char) *p))
+        return ENC_FALLBACK;
+    if (*p == '0') {
+        p++;
+        if (p < e->end && isdigit((unsigned char) *p))
+            return ENC_FALLBACK;
+    } else {
+        while (p < e->end && isdigit((unsigned char) *p))
+            p++;
+    }
+    if (p < e->end && *p == '.') {
+        real = 1;
+        p++;
+        if (p >= e->end || !isdigit((unsigned char) *p))
+            return ENC_FALLBACK;
+        while (p < e->end && isdigit((unsigned char) *p))
+            p++;
+    }
+    if (p < e->end && (*p == 'e' || *p == 'E')) {
+        real = 1;
+        p++;
+        if (p < e->end && (*p == '+' || *p == '-'))
+            p++;
+        if (p >= e->end || !isdigit((unsigned char) *p))
+            return ENC_FALLBACK;
+        while (p < e->end && isdigit((unsigned char) *p))
+            p++;
+    }
+
+    *is_int = !real;
+    if (!real && p - start - neg <= 18) {
+        /* cannot overflow */
+        const char *d = start + neg;
+        json_int_t value = 0;
+        while (d < p)
+            value = value * 10 + (*d++ - '0');
+        *ival = neg ? -value : value;
+    } else {
+        size_t len = p - start;
+        char *end;
+
+        e->str = enc_grow(e->str, &e->str_cap, len + 1, 1);
+        memcpy(e->str, start, len);
+        e->str[len] = '\0';
+        errno = 0;
+        if (!real) {
+            *ival = strtoll(e->str, &end, 10);
+            if (errno == ERANGE)
+                return ENC_FALLBACK;
+        } else {
+            *dval = strtod(e->str, &end);
+            if (errno == ERANGE && *dval != 0)
+                return ENC_FALLBACK;
+        }
+    }
+    e->p = p;
+    return ENC_OK;
+}
+
+/* Matches true, false or null. Like jansson, reads the whole run of
+   letters. */
+static int enc_literal(encoder_t *e, const char *word, size_t len) {
+    if ((size_t) (e->end - e->p) < len || memcmp(e->p, word, len))
+        return ENC_FALLBACK;
+    e->p += len;
+    if (e->p < e->end && isalpha((unsigned char) *e->p))
+        return ENC_FALLBACK;
+    return ENC_OK;
+}
+
+/* Checks and skips a value the schema has no use for */
+static int enc_skip(encoder_t *e) {
+    const char *str;
+    size_t len;
+    json_int_t ival;
+    double dval;
+    int c = enc_peek(e), is_int;
+
+    switch (c) {
+    case '{':
+        e->p++;
+        if (enc_expect(e, '}'))
+            return ENC_OK;
+        do {
+            if (enc_peek(e) != '"' || enc_key(e, &str, &len) ||
+                !enc_expect(e, ':') || enc_skip(e))
+                return ENC_FALLBACK;
+        } while (enc_expect(e, ','));
+        return enc_expect(e, '}') ? ENC_OK : ENC_FALLBACK;
+    case '[':
+        e->p++;
+        if (enc_expect(e, ']'))
+            return ENC_OK;
+        do {
+            if (enc_skip(e))
+                return ENC_FALLBACK;
+        } while (enc_expect(e, ','));
+        return enc_expect(e, ']') ? ENC_OK : ENC_FALLBACK;
+    case '"':
+        return enc_string(e, &str, &len);
+    case 't':
+        return enc_literal(e, "true", 4);
+    case 'f':
+        return enc_literal(e, "false", 5);
+    case 'n':
+        return enc_literal(e, "null", 4);
+    default:
+        if (c == '-' || isdigit(c))
+            return enc_number(e, &is_int, &ival, &dval);
+        return ENC_FALLBACK;
+    }
+}
+
+static int enc_value(encoder_t *e, const plan_node_t *node);
+
+static int enc_record(encoder_t *e, const plan_node_t *node) {
+    const plan_node_t *fields = &e->plan->nodes[node->child];
+    size_t base = e->nslots, start = e->b->out_len, total, len;
+    int next = 0, inorder = 1, i, rval = ENC_OK;
+    const char *key;
+
+    if (!enc_expect(e, '{'))
+        return ENC_MISMATCH;
+
+    e->slots = enc_grow(e->slots, &e->slots_cap, base + node->nchildren, sizeof(field_slot_t));
+    for (i = 0; i < node->nchildren; i++)
+        e->slots[base + i].set = 0;
+    e->nslots += node->nchildren;
+
+    if (!enc_expect(e, '}')) {
+        do {
+            if (enc_peek(e) != '"' || enc_key(e, &key, &len) || !enc_expect(e, ':')) {
+                rval = ENC_FALLBACK;
+                goto out;
+            }
+            i = plan_lookup(e->plan, node, key, len, next);
+            if (i < 0) {
+                if ((rval = enc_skip(e)))
+                    goto out;
+                continue;
+            }
+            if (i != next)
+                inorder = 0;
+            e->slots[base + i].off = e->b->out_len;
+            if ((rval = enc_value(e, &fields[i])))
+                goto out;
+            e->slots[base + i].len = e->b->out_len - e->slots[base + i].off;
+            e->slots[base + i].set = 1;
+            next = i + 1;
+        } while (enc_expect(e, ','));
+        if (!enc_expect(e, '}')) {
+            rval = ENC_FALLBACK;
+            goto out;
+        }
+    }
+
+    if (inorder && next == node->nchildren)
+        goto out;
+
+    /* Put the fields in schema order, with defaults for missing ones */
+    total = 0;
+    for (i = 0; i < node->nchildren; i++) {
+        if (e->slots[base + i].set)
+            total += e->slots[base + i].len;
+        else if (fields[i].dft_val.self)
+            total += fields[i].dft_bin_len;
+        else {
+            rval = ENC_MISMATCH;
+            goto out;
+        }
+    }
+    e->tmp = enc_grow(e->tmp, &e->tmp_cap, total, 1);
+    for (i = 0, len = 0; i < node->nchildren; i++) {
+        field_slot_t *slot = &e->slots[base + i];
+        if (slot->set) {
+            memcpy(e->tmp + len, e->b->out + slot->off, slot->len);
+            len += slot->len;
+        } else if (fields[i].dft_bin_len) {
+            memcpy(e->tmp + len, fields[i].dft_bin, fields[i].dft_bin_len);
+            len += fields[i].dft_bin_len;
+        }
+    }
+    e->b->out_len = start;
+    enc_raw(e, e->tmp, total);
+
+out:
+    e->nslots = base;
+    return rval;
+}
+
+/* Arrays and maps are written as a single block, like avro_value_write()
+   does. One byte was left at start for the item count, which usually
+   suffices. */
+static void enc_block(encoder_t *e, size_t start, int64_t count) {
+    char buf[10];
+    int len;
+
+    e->b->out_len--;
+    if (!count) {
+        enc_long(e, 0);
+        return;
+    }
+    len = zigzag_varint(count, buf);
+    if (len > 1) {
+        enc_reserve(e, len);
+        memmove(e->b->out + start + len, e->b->out + start + 1, e->b->out_len - start);
+    }
+    memcpy(e->b->out + start, buf, len);
+    e->b->out_len += len;
+    enc_long(e, 0);
+}
+
+static int enc_array(encoder_t *e, const plan_node_t *node) {
+    const plan_node_t *items = &e->plan->nodes[node->child];
+    size_t start = e->b->out_len;
+    int64_t count = 0;
+    int rval;
+
+    if (!enc_expect(e, '['))
+        return ENC_MISMATCH;
+
+    enc_reserve(e, 1);
+    e->b->out_len++;
+    if (!enc_expect(e, ']')) {
+        do {
+            if ((rval = enc_value(e, items)))
+                return rval;
+            count++;
+        } while (enc_expect(e, ','));
+        if (!enc_expect(e, ']'))
+            return ENC_FALLBACK;
+    }
+
+    enc_block(e, start, count);
+    return ENC_OK;
+}
+
+static int enc_map(encoder_t *e, const plan_node_t *node) {
+    const plan_node_t *values = &e->plan->nodes[node->child];
+    size_t base = e->nkeys, start = e->b->out_len, len, i;
+    int64_t count = 0;
+    int rval = ENC_OK;
+    const char *key;
+
+    if (!enc_expect(e, '{'))
+        return ENC_MISMATCH;
+
+    enc_reserve(e, 1);
+    e->b->out_len++;
+    if (!enc_expect(e, '}')) {
+        do {
+            map_key_t *k;
+
+            if (enc_peek(e) != '"' || enc_key(e, &key, &len)) {
+                rval = ENC_FALLBACK;
+                goto out;
+            }
+
+            /* jansson would keep the last of several equal keys only */
+            e->keys = enc_grow(e->keys, &e->keys_cap, e->nkeys + 1, sizeof(map_key_t));
+            k = &e->keys[e->nkeys++];
+            k->hash = key_hash(key, len);
+            k->len = len;
+            for (i = base; i < e->nkeys - 1; i++) {
+                if (e->keys[i].hash == k->hash && e->keys[i].len == len &&
+                    !memcmp(e->b->out + e->keys[i].off, key, len)) {
+                    rval = ENC_FALLBACK;
+                    goto out;
+                }
+            }
+            enc_long(e, len);
+            k->off = e->b->out_len;
+            enc_raw(e, key, len);
+
+            if (!enc_expect(e, ':')) {
+                rval = ENC_FALLBACK;
+                goto out;
+            }
+            if ((rval = enc_value(e, values)))
+                goto out;
+            count++;
+        } while (enc_expect(e, ','));
+        if (!enc_expect(e, '}')) {
+            rval = ENC_FALLBACK;
+            goto out;
+        }
+    }
+    enc_block(e, start, count);
+
+out:
+    e->nkeys = base;
+    return rval;
+}
+
+/* The jansson type of the value at e->p, or -1 if there is none */
+static int enc_type(encoder_t *e) {
+    const char *p;
+
+    switch (enc_peek(e)) {
+    case '{': return JSON_OBJECT;
+    case '[': return JSON_ARRAY;
+    case '"': return JSON_STRING;
+    case 't': return JSON_TRUE;
+    case 'f': return JSON_FALSE;
+    case 'n': return JSON_NULL;
+    case '-': case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+        for (p = e->p + 1; p < e->end && (isdigit((unsigned char) *p) || *p == '-'); p++)
+            ;
+        if (p < e->end && (*p == '.' || *p == 'e' || *p == 'E'))
+            return JSON_REAL;
+        return JSON_INTEGER;
+    }
+    return -1;
+}
+
+/* Tries the candidate branches in order, like plan_traverse() */
+static int enc_union(encoder_t *e, const plan_node_t *node) {
+    const char *p = e->p;
+    size_t start = e->b->out_len;
+    const int *i;
+    int type = enc_type(e), rval;
+
+    if (type < 0)
+        return ENC_FALLBACK;
+    for (i = plan_candidates(e->plan, node, type); *i >= 0; i++) {
+        enc_long(e, *i);
+        rval = enc_value(e, &e->plan->nodes[node->child + *i]);
+        if (rval != ENC_MISMATCH)
+            return rval;
+        e->p = p;
+        e->b->out_len = start;
+    }
+    return ENC_MISMATCH;
+}
+
+static int enc_value(encoder_t *e, const plan_node_t *node) {
+    const char *str;
+    size_t len;
+    json_int_t ival;
+    double dval;
+    int c = enc_peek(e), is_int, symbol, rval;
+
+    switch (node->op) {
+    case OP_RECORD:
+        return enc_record(e, node);
+
+    case OP_STRING:
+        if (c != '"')
+            return e->plan->strjson ? ENC_FALLBACK : ENC_MISMATCH;
+        if ((rval = enc_string(e, &str, &len)))
+            return rval;
+        if (e->plan->max_str_sz && len > e->plan->max_str_sz)
+            len = e->plan->max_str_sz;
+        enc_long(e, len);
+        enc_raw(e, str, len);
+        return ENC_OK;
+
+    case OP_BYTES:
+        if (c != '"')
+            return ENC_MISMATCH;
+        if ((rval = enc_string(e, &str, &len)))
+            return rval;
+        enc_long(e, len);
+        enc_raw(e, str, len);
+        return ENC_OK;
+
+    case OP_FIXED:
+        if (c != '"')
+            return ENC_MISMATCH;
+        if ((rval = enc_string(e, &str, &len)))
+            return rval;
+        if (len != (size_t) avro_schema_fixed_size(node->schema))
+            return ENC_MISMATCH;
+        enc_raw(e, str, len);
+        return ENC_OK;
+
+    case OP_ENUM:
+        if (c != '"')
+            return ENC_MISMATCH;
+        if ((rval = enc_string(e, &str, &len)))
+            return rval;
+        if ((symbol = plan_lookup(e->plan, node, str, len, 0)) >= 0)
+            enc_long(e, symbol);
+        else if (e->plan->enum_default && node->dft_val.self)
+            enc_raw(e, node->dft_bin, node->dft_bin_len);
+        else
+            return ENC_MISMATCH;
+        return ENC_OK;
+
+    case OP_INT:
+    case OP_LONG:
+        if (c != '-' && !isdigit(c))
+            return ENC_MISMATCH;
+        if ((rval = enc_number(e, &is_int, &ival, &dval)))
+            return rval;
+        if (!is_int)
+            return ENC_MISMATCH;
+        enc_long(e, node->op == OP_INT ? (int32_t) ival : ival);
+        return ENC_OK;
+
+    case OP_FLOAT:
+    case OP_DOUBLE:
+        if (c != '-' && !isdigit(c))
+            return ENC_MISMATCH;
+        if ((rval = enc_number(e, &is_int, &ival, &dval)))
+            return rval;
+        if (is_int)
+            dval = ival;
+        if (node->op == OP_FLOAT)
+            enc_float(e, dval);
+        else
+            enc_double(e, dval);
+        return ENC_OK;
+
+    case OP_BOOLEAN:
+        if (c == 't') {
+            rval = enc_literal(e, "true", 4);
+        } else if (c == 'f') {
+            rval = enc_literal(e, "false", 5);
+        } else
+            return ENC_MISMATCH;
+        if (!rval) {
+            char b = c == 't';
+            enc_raw(e, &b, 1);
+        }
+        return rval;
+
+    case OP_NULL:
+        if (c != 'n')
+            return ENC_MISMATCH;
+        return enc_literal(e, "null", 4);
+
+    case OP_ARRAY:
+        return enc_array(e, node);
+
+    case OP_MAP:
+        return enc_map(e, node);
+
+    case OP_UNION:
+        return enc_union(e, node);
+    }
+    return ENC_FALLBACK;
+}
+
+static void encode_batch(pipeline_t *p, batch_t *b, encoder_t *e, json_arena_t *arena,
+                         avro_value_t *record, avro_writer_t writer) {
+    json_stream_t *input = NULL;
+
+    b->out_len = 0;
+    b->nrec = 0;
+    b->ndocs = 0;
+    b->aborted = 0;
+    b->abort_msg[0] = '\0';
+
+    e->b = b;
+    e->p = b->in;
+    e->end = b->in + b->in_len;
+    for (;;) {
+        const char *doc = e->p;
+        size_t start = b->out_len, pos;
+        int c = enc_peek(e);
+
+        if (c < 0)
+            break;
+        if ((c == '{' || c == '[') && enc_value(e, p->plan->nodes) == ENC_OK) {
+            b->ndocs++;
+            batch_add_size(b, b->out_len - start);
+            continue;
+        }
+
+        b->out_len = start;
+        pos = doc - b->in;
+        if (!input)
+            input = batch_json_stream(p, b, arena);
+        if (!convert_json(p, b, input, arena, &pos, 0, record, writer))
+            break;
+        e->p = b->in + pos;
+    }
+    json_stream_close(input);
+}
+
+static void *pipeline_worker(void *arg) {
+    pipeline_t *p = (pipeline_t *) arg;
+    avro_value_t record;
+    avro_writer_t writer = avro_writer_memory(NULL, 0);
+    json_arena_t *arena = json_arena_new();
+    encoder_t e;
+
+    memset(&e, 0, sizeof(e));
+    e.plan = p->plan;
+
+    if (!writer || !arena || avro_generic_value_new(p->iface, &record)) {
+        fprintf(stderr, "ERROR: Unable to create Avro value from schema: %s\n", avro_strerror());
+        exit(EXIT_FAILURE);
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        batch_t *b = pipeline_wait(p, &p->next_parse, BATCH_READY);
+        if (b) {
+            b->state = BATCH_BUSY;
+            b->seq = p->next_parse++;
+        }
+        pthread_mutex_unlock(&p->lock);
+        if (!b)
+            break;
+
+        if (p->errabort && pipeline_aborted(p, b)) {
+            b->nrec = 0;
+            b->ndocs = 0;
+            b->aborted = 1;
+            b->abort_msg[0] = '\0';
+        } else if (p->stream)
+            encode_batch(p, b, &e, arena, &record, writer);
+        else
+            convert_batch(p, b, arena, &record, writer);
+
+        pthread_mutex_lock(&p->lock);
+        b->state = BATCH_DONE;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    avro_value_decref(&record);
+    avro_writer_free(writer);
+    json_arena_free(arena);
+    free(e.str);
+    free(e.tmp);
+    free(e.slots);
+    free(e.keys);
+    return NULL;
+}
+
+void process_file_threaded(FILE *input, output_t *out, avro_schema_t schema, const plan_t *plan,
+                           int nthreads, int stream, int verbose, int memstat, int errabort) {
+
+    pipeline_t p;
+    pthread_t reader, *workers;
+    int i, n = 0;
+
+    memset(&p, 0, sizeof(p));
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+    p.nslots = 2 * nthreads;
+    p.slots = calloc(p.nslots, sizeof(batch_t));
+    p.input = input;
+    p.plan = plan;
+    p.stream = stream;
+    p.errabort = errabort;
+    p.iface = avro_generic_class_from_schema(schema);
+    if (!p.slots || !p.iface) {
+        fprintf(stderr, "ERROR: Unable to set up conversion pipeline: %s\n", avro_strerror());
+        exit(EXIT_FAILURE);
+    }
+
+    /* A regular file is mapped into memory and cut into batches in
+       place rather than read through stdio. */
+    struct stat st;
+    if (!fstat(fileno(input), &st) && S_ISREG(st.st_mode) && st.st_size > 0 && ftello(input) == 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(input), 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            p.map = map;
+            p.map_len = st.st_size;
+        }
+    }
+
+    workers = calloc(nthreads, sizeof(pthread_t));
+    pthread_create(&reader, NULL, pipeline_reader, &p);
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&workers[i], NULL, pipeline_worker, &p);
+
+    for (;;) {
+        pthread_mutex_lock(&p.lock);
+        batch_t *b = pipeline_wait(&p, &p.next_write, BATCH_DONE);
+        pthread_mutex_unlock(&p.lock);
+        if (!b)
+            break;
+
+        if (b->aborted)
+            fputs(b->abort_msg, stderr);
+        size_t off = 0;
+        for (i = 0; i < b->nrec; i++) {
+            output_encoded(out, b->out + off, b->sizes[i]);
+            off += b->sizes[i];
+        }
+
+        int k;
+        for (k = n / 1000 + 1; k * 1000 <= n + b->ndocs; k++) {
+            if (verbose)
+                printf("Processing record %d\n", k * 1000);
+            if (memstat)
+                memory_status();
+        }
+        n += b->ndocs;
+
+        pthread_mutex_lock(&p.lock);
+        b->state = BATCH_FREE;
+        p.next_write++;
+        if (b->aborted)
+            p.stop = 1;
+        pthread_cond_broadcast(&p.cond);
+        pthread_mutex_unlock(&p.lock);
+    }
+
+    pthread_join(reader, NULL);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(workers[i], NULL);
+
+    if (memstat) memory_status();
+
+    if (ferror(input)) {
+        errno = p.read_errno;
+        perror("ERROR: reading input");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < p.nslots; i++) {
+        free(p.slots[i].buf);
+        free(p.slots[i].out);
+        free(p.slots[i].sizes);
+    }
+    free(p.slots);
+    free(p.tail);
+    free(workers);
+    if (p.map)
+        munmap((void *) p.map, p.map_len);
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+    avro_value_iface_decref(p.iface);
+    avro_schema_decref(schema);
+}
+
+void print_help(char *program_name) {
+    fprintf(stderr, "Usage: %s [options] [input_file.json] <output_file.avro>\n", program_name);
+    fprintf(stderr, "\n");
     fprintf(stderr, "Where options are:\n");
     fprintf(stderr, " -s schema (required) Avro schema to use for conversion.\n");
     fprintf(stderr, " -S file   (required) JSON file to read the avro schema from.\n");
-    fprintf(stderr, " -c algo   (optional) Set output compression algorithm: null, snappy, deflate, lzma\n");
+    fprintf(stderr, " -c algo   (optional) Set output compression algorithm: null, snappy, deflate, lzma,\n");
+    fprintf(stderr, "                      zstandard (or zstd). deflate:N, lzma:N and zstd:N pick level N\n");
     fprintf(stderr, "                      Default: no compression\n");
-    fprintf(stderr, " -b bytes  (optional) Set output block size in bytes. Default: 16384\n");
+    fprintf(stderr, " -a rate   (optional) Pick the codec and level with the best ratio on the first\n");
+    fprintf(stderr, "                      blocks among those that compress at least rate MB/s.\n");
+    fprintf(stderr, "                      rate,N samples N blocks. Default N: %d\n", TUNE_BLOCKS);
+    fprintf(stderr, " -b bytes  (optional) Set output block size in bytes. A bigger record is\n");
+    fprintf(stderr, "                      written as a block of its own. Default: 16384\n");
+    fprintf(stderr, " -B bytes  (optional) Size blocks to compress to about this many bytes, from\n");
+    fprintf(stderr, "                      the ratio seen so far, starting at the -b size.\n");
+    fprintf(stderr, "                      bytes,ms also ends a block once it has been open for ms\n");
+    fprintf(stderr, "                      milliseconds when the next record comes in.\n");
+    fprintf(stderr, " -t N      (optional) Convert and compress with N threads each. Every JSON\n");
+    fprintf(stderr, "                      document must end on its own line. Default: single-threaded\n");
+    fprintf(stderr, " -e engine (optional) Conversion engine: dom, lazy or stream. lazy skips JSON\n");
+    fprintf(stderr, "                      the schema does not use, checking only its structure.\n");
+    fprintf(stderr, "                      stream encodes JSON straight to Avro and, like -t,\n");
+    fprintf(stderr, "                      needs every document to end on its own line.\n");
+    fprintf(stderr, "                      Default: dom\n");
     fprintf(stderr, " -d        (optional) Turn on debug mode.\n");
     fprintf(stderr, " -j        (optional) Dump unexpected JSON objects as strings.\n");
+    fprintf(stderr, " -u        (optional) Use the field default for unknown enum symbols.\n");
+    fprintf(stderr, "                      Default: skip the record.\n");
     fprintf(stderr, " -x        (optional) Abort on JSON parsing errors. Default: skip invalid json.\n");
     fprintf(stderr, " -z bytes  (optional) Maximum JSON string size. Default: no limit.\n");
     fprintf(stderr, " -m        (optional) Linux only, enable periodic memory stats information output.\n");
@@ -364,20 +2478,29 @@ int main(int argc, char *argv[]) {
     FILE *input;
 
     avro_schema_t schema;
-    avro_file_writer_t out;
+    output_t out;
+    plan_t plan;
     const char *key;
 
-    int opt, opterr = 0, verbose = 0, memstat = 0, errabort = 0, strjson = 0;
+    int opt, opterr = 0, verbose = 0, memstat = 0, errabort = 0, strjson = 0, enum_default = 0;
     char *schema_arg = NULL;
     char *codec = NULL;
+    struct avro_codec_options codec_options = { 0, 0, 0 };
+    double tune_rate = 0;
+    int tune_blocks = TUNE_BLOCKS;
     char *endptr = NULL;
     char *outpath = NULL;
     size_t block_sz = 0;
+    size_t target_sz = 0;
+    int max_latency = 0;
     size_t max_str_sz = 0;
+    int nthreads = 0;
+    int stream = 0;
+    int lazy = 0;
     extern char *optarg;
     extern int optind, optopt;
 
-    while ((opt = getopt(argc, argv, "c:s:S:b:z:dmxjh")) != -1) {
+    while ((opt = getopt(argc, argv, "c:a:s:S:b:B:z:t:e:dmxjuh")) != -1) {
         switch (opt) {
         case 's':
             schema_arg = optarg;
@@ -392,6 +2515,16 @@ int main(int argc, char *argv[]) {
                 opterr++;
             }
             break;
+        case 'B':
+            /* bytes[,ms] */
+            target_sz = strtol(optarg, &endptr, 0);
+            if (*endptr == ',')
+                max_latency = strtol(endptr + 1, &endptr, 0);
+            if (*endptr || max_latency < 0) {
+                fprintf(stderr, "ERROR: Invalid block target for -B: %s\n", optarg);
+                opterr++;
+            }
+            break;
         case 'z':
             max_str_sz = strtol(optarg, &endptr, 0);
             if (*endptr) {
@@ -399,9 +2532,37 @@ int main(int argc, char *argv[]) {
                 opterr++;
             }
             break;
+        case 't':
+            nthreads = strtol(optarg, &endptr, 0);
+            if (*endptr || nthreads < 0) {
+                fprintf(stderr, "ERROR: Invalid number of threads for -t: %s\n", optarg);
+                opterr++;
+            }
+            break;
+        case 'e':
+            stream = lazy = 0;
+            if (!strcmp(optarg, "stream"))
+                stream = 1;
+            else if (!strcmp(optarg, "lazy"))
+                lazy = 1;
+            else if (strcmp(optarg, "dom")) {
+                fprintf(stderr, "ERROR: Invalid engine for -e: %s, valid engines: dom, lazy, stream\n", optarg);
+                opterr++;
+            }
+            break;
         case 'c':
             codec = optarg;
             break;
+        case 'a':
+            /* MB/s[,blocks] */
+            tune_rate = strtod(optarg, &endptr) * 1024 * 1024;
+            if (*endptr == ',')
+                tune_blocks = strtol(endptr + 1, &endptr, 0);
+            if (*endptr || tune_rate <= 0 || tune_blocks <= 0) {
+                fprintf(stderr, "ERROR: Invalid rate for -a: %s\n", optarg);
+                opterr++;
+            }
+            break;
         case 'd':
             verbose = 1;
             break;
@@ -411,6 +2572,9 @@ int main(int argc, char *argv[]) {
         case 'j':
             strjson = 1;
             break;
+        case 'u':
+            enum_default = 1;
+            break;
         case 'm':
             #if defined(__linux__)
               memstat = 1;
@@ -443,10 +2607,30 @@ int main(int argc, char *argv[]) {
     if (opterr) usage_error(argv[0], 0);
     if (!schema_arg) usage_error(argv[0], "Please provide correct schema!");
 
+    if (codec && tune_rate > 0) usage_error(argv[0], "-a picks the codec, so it cannot be used with -c");
+
     if (!codec) codec = "null";
-    else if (strcmp(codec, "snappy") && strcmp(codec, "deflate") && strcmp(codec, "lzma") && strcmp(codec, "null")) {
-        fprintf(stderr, "ERROR: Invalid codec %s, valid codecs: snappy, deflate, lzma, null\n", codec);
-        exit(EXIT_FAILURE);
+    else {
+        /* codec:level */
+        char *level = strchr(codec, ':');
+        if (level) {
+            *level++ = 0;
+            if (!strcmp(codec, "null") || !strcmp(codec, "snappy")) {
+                fprintf(stderr, "ERROR: Codec %s takes no level\n", codec);
+                exit(EXIT_FAILURE);
+            }
+            /* 0 would mean the codec's default level in codec_options */
+            codec_options.level = strtol(level, &endptr, 0);
+            if (!*level || *endptr || !codec_options.level) {
+                fprintf(stderr, "ERROR: Invalid level for codec %s: %s\n", codec, level);
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (strcmp(codec, "snappy") && strcmp(codec, "deflate") && strcmp(codec, "lzma") && strcmp(codec, "null") &&
+            strcmp(codec, "zstandard") && strcmp(codec, "zstd")) {
+            fprintf(stderr, "ERROR: Invalid codec %s, valid codecs: snappy, deflate, lzma, zstandard, null\n", codec);
+            exit(EXIT_FAILURE);
+        }
     }
 
     if ((argc - optind) == 1) {
@@ -467,26 +2651,21 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    if (!strcmp(outpath, "-")) {
-        if (avro_file_writer_create_with_codec_fp(stdout, outpath, 0, schema, &out, codec, block_sz)) {
-            fprintf(stderr, "ERROR: avro_file_writer_create_with_codec_fp FAILED: %s\n", avro_strerror());
-            exit(EXIT_FAILURE);
-        }
+    if (plan_compile(&plan, schema, strjson, enum_default, max_str_sz, lazy))
+        exit(EXIT_FAILURE);
 
-    } else {
-        remove(outpath);
-        if (avro_file_writer_create_with_codec(outpath, schema, &out, codec, block_sz)) {
-            fprintf(stderr, "ERROR: avro_file_writer_create_with_codec FAILED: %s\n", avro_strerror());
-            exit(EXIT_FAILURE);
-        }
-    }
+    output_init(&out, outpath, schema, codec, &codec_options, block_sz, target_sz, max_latency, nthreads,
+                tune_rate, tune_blocks, verbose);
 
-    if (verbose)
-        fprintf(stderr, "Using codec: %s\n", codec);
+    if (nthreads > 0 || stream)
+        process_file_threaded(input, &out, schema, &plan, nthreads ? nthreads : 1, stream,
+                              verbose, memstat, errabort);
+    else
+        process_file(input, &out, schema, &plan, verbose, memstat, errabort);
 
-    process_file(input, out, schema, verbose, memstat, errabort, strjson, max_str_sz);
+    plan_free(&plan);
 
     if (verbose)
         printf("Closing writer....\n");
-    avro_file_writer_close(out);
+    output_close(&out);
 }
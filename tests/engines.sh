@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# Converts tests/engines.json with every engine, with and without -t,
+# and checks that the decoded records are the same each time. The
+# fixture mixes valid records, records that do not match the schema
+# and broken lines, so it also checks that every engine drops the same
+# input after an error.
+#
+# Run it from the top of the tree after make, or through make check.
+# JSON2AVRO and AVROCAT override the programs it uses.
+
+JSON2AVRO=${JSON2AVRO:-./json2avro}
+AVROCAT=${AVROCAT:-avrolib/bin/avrocat}
+DIR=$(dirname "$0")
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+status=0
+for options in "" "-u"; do
+    expected=
+    for engine in dom lazy stream; do
+        for threads in "" "-t 2"; do
+            run="-e $engine${threads:+ $threads}${options:+ $options}"
+            if ! $JSON2AVRO -S "$DIR/engines.avsc" $run "$DIR/engines.json" \
+                    "$TMP/out.avro" 2>"$TMP/err"; then
+                echo "FAIL [$run]: json2avro failed"
+                cat "$TMP/err"
+                status=1
+                continue
+            fi
+            if ! $AVROCAT "$TMP/out.avro" >"$TMP/out.txt"; then
+                echo "FAIL [$run]: could not decode the output"
+                status=1
+                continue
+            fi
+
+            if [ -z "$expected" ]; then
+                expected="$run"
+                mv "$TMP/out.txt" "$TMP/expected.txt"
+                echo "ok   [$run] $(wc -l <"$TMP/expected.txt") records"
+            elif cmp -s "$TMP/expected.txt" "$TMP/out.txt"; then
+                echo "ok   [$run]"
+            else
+                echo "FAIL [$run]: records differ from [$expected]"
+                diff "$TMP/expected.txt" "$TMP/out.txt" | head -20
+                status=1
+            fi
+        done
+    done
+done
+
+exit $status